@@ -4,51 +4,103 @@
 #include <initializer_list>
 #include <vector>
 #include <array>
+#include <memory>
 #include <string>
 #include <span>
 
+#include "mapper.hpp"
+#include "rom_image.hpp"
+#include "save_file.hpp"
+
 namespace GbcEmulator {
 
 class Cartridge {
 public:
+    // Copies the ROM, prefer sharing a RomImage when running the same ROM many times
     Cartridge(std::span<uint8_t> rom, std::span<uint8_t> eram = std::span<uint8_t, 0>{});
+    Cartridge(std::shared_ptr<const RomImage> rom,
+              std::span<uint8_t> eram = std::span<uint8_t, 0>{});
     Cartridge(const Cartridge&) = delete;
     Cartridge& operator=(const Cartridge&) = delete;
     Cartridge(Cartridge&&) = default;
     Cartridge& operator=(Cartridge&&) = default;
+    // Saves the clock, the save file writes back the rest
+    ~Cartridge();
 
     constexpr uint8_t loadFromRom(uint16_t address) const {
-        return address < 0x4000 ? rom_[address] : selected_rom_bank_[address - 0x4000];
+        return address < 0x4000 ? fixed_rom_bank_[address] : selected_rom_bank_[address - 0x4000];
     }
 
-    constexpr uint8_t loadFromExternRam(uint16_t address) const {
-        return address < 0xD000 ? eram_[address] : selected_eram_bank_[address - 0xD000];
+    uint8_t loadFromExternRam(uint16_t address) const;
+
+    // Writes to the mapper registers, the selected banks are updated right away
+    void storeInRom(uint16_t address, uint8_t value);
+
+    void storeInExternRam(uint16_t address, uint8_t value);
+
+    uint16_t getFixedRomBank() const {
+        return static_cast<uint16_t>((fixed_rom_bank_ - rom_->getData().data()) / 0x4000);
     }
 
-    // TODO: handle depending on cartridge mapper
-    constexpr void storeInRom(uint16_t address, uint8_t value) {}
+    uint16_t getSelectedRomBank() const {
+        return static_cast<uint16_t>((selected_rom_bank_ - rom_->getData().data()) / 0x4000);
+    }
+
+    uint8_t getSelectedExternRamBank() const {
+        return selected_eram_bank_
+            ? static_cast<uint8_t>((selected_eram_bank_ - eram_.data()) / 0x2000) : 0;
+    }
 
-    constexpr void storeInExternRam(uint16_t address, uint8_t value) {
-        selected_eram_bank_[address] = value;
+    // Memory currently mapped at 0x0000-0x3FFF, 0x4000-0x7FFF and 0xA000-0xBFFF.
+    // eRAM is nullptr while disabled, or when accesses have to go through the mapper.
+    const uint8_t* getFixedRomBankMemory() const { return fixed_rom_bank_; }
+    const uint8_t* getSelectedRomBankMemory() const { return selected_rom_bank_; }
+    uint8_t* getSelectedExternRamMemory() {
+        const Mapper::Banks& banks = mapper_->getBanks();
+        return banks.eram_enabled && mapper_->isExternRamPlain() ? selected_eram_bank_ : nullptr;
     }
+    // nullptr when writes have to go through storeInExternRam, to be saved
+    uint8_t* getWritableExternRamMemory() {
+        return save_file_ ? nullptr : getSelectedExternRamMemory();
+    }
+
+    bool hasBattery() const { return rom_->hasBattery(); }
+
+    // Moves eRAM onto a .sav file, its current content is kept where the file has none.
+    // Has to be done before the cartridge is mapped. Returns false if the file can't be
+    // used, eRAM then stays in memory.
+    // The clock, if any, is restored from the file, plus the host time elapsed since it was
+    // saved when catching up.
+    bool openSaveFile(const std::string& path, bool is_clock_catching_up = true);
+    bool hasSaveFile() const { return static_cast<bool>(save_file_); }
+
+    // The clock of the cartridge counts the cycles of this Clock from now on
+    void connectClock(const Clock& clock) { mapper_->connectClock(clock); }
+    bool hasClock() const { return mapper_->hasClock(); }
 
-    constexpr const std::string& getName() const { return name_; }
-    constexpr bool isRomBootable() const { return is_logo_ok_ && is_header_checksum_ok_; }
+    // Back to the banks selected at power on, eRAM is kept
+    void reset();
+
+    const std::string& getName() const { return rom_->getName(); }
+    bool isRomBootable() const { return rom_->isLogoOk() && rom_->isHeaderChecksumOk(); }
+    const std::shared_ptr<const RomImage>& getRomImage() const { return rom_; }
 
 private:
-    std::vector<uint8_t> rom_;
-    std::vector<uint8_t>::iterator selected_rom_bank_;
-    std::vector<uint8_t> eram_;
-    std::vector<uint8_t>::iterator selected_eram_bank_;
-
-    std::string name_;
-    uint8_t cgb_flag_;
-    std::array<uint8_t, 2> new_licensee_code_;
-    uint8_t sgb_flag_;
-    uint8_t destination_code_;
-    uint8_t old_licensee_code_;
-    uint8_t rom_version_number_;
-    bool is_logo_ok_, is_header_checksum_ok_, is_full_checksum_ok_;
+    // Points the banks to the ones selected by the mapper
+    void updateBanks();
+    // Writes the clock to the save file, when both exist
+    void saveClock();
+
+    std::unique_ptr<Mapper> mapper_;
+
+    std::shared_ptr<const RomImage> rom_;
+    const uint8_t* fixed_rom_bank_;
+    const uint8_t* selected_rom_bank_;
+    // eRAM is either in eram_buffer_ or in save_file_
+    std::vector<uint8_t> eram_buffer_;
+    std::unique_ptr<SaveFile> save_file_;
+    std::span<uint8_t> eram_;
+    uint8_t* selected_eram_bank_;
 };
 
 }  // namespace GbcEmulator
\ No newline at end of file
@@ -4,28 +4,60 @@
 
 namespace GbcEmulator {
 
+// Counts T-cycles of the normal speed. In CGB double speed the CPU, and the components
+// clocked by it, run twice as fast: each of their T-cycles only lasts half as long.
 class Clock {
 public:
+    inline static constexpr TCycleCount cycles_per_second = 4194304;
+
     Clock() = default;
     Clock(const Clock&) = delete;
     Clock& operator=(const Clock&) = delete;
 
     constexpr TCycleCount get() const noexcept { return clock_; }
-    constexpr void add(TCycleCount amount) noexcept { clock_ += amount; }
+    // Advances by T-cycles of the CPU, at its current speed
+    constexpr void add(TCycleCount t_cycles) noexcept { clock_ += t_cycles >> speed_shift_; }
+
+    // Converts T-cycles of the CPU to T-cycles of the clock, and back
+    constexpr TCycleCount fromCpuCycles(TCycleCount t_cycles) const noexcept {
+        return t_cycles >> speed_shift_;
+    }
+    constexpr TCycleCount toCpuCycles(TCycleCount t_cycles) const noexcept {
+        return t_cycles << speed_shift_;
+    }
 
-    constexpr bool isDoubleSpeed() const noexcept { return isDoubleSpeed_; }
+    constexpr bool isDoubleSpeed() const noexcept { return speed_shift_; }
     constexpr void setDoubleSpeed(bool is_double_speed) noexcept {
-        isDoubleSpeed_ = is_double_speed;
+        speed_shift_ = is_double_speed;
+        last_speed_switch_start_ = clock_;
+        last_speed_switch_ = clock_;
+    }
+    // Switches the speed over t_cycles of the new speed, during which the components running
+    // at the CPU speed are stopped
+    constexpr void switchSpeed(TCycleCount t_cycles) noexcept {
+        setDoubleSpeed(!speed_shift_);
+        add(t_cycles);
+        last_speed_switch_ = clock_;
+    }
+    // Lazy components running at the CPU speed count their cycles before the last switch
+    // started at the old speed, and none until it ended
+    constexpr TCycleCount getLastSpeedSwitchStart() const noexcept {
+        return last_speed_switch_start_;
     }
+    constexpr TCycleCount getLastSpeedSwitch() const noexcept { return last_speed_switch_; }
 
     constexpr void reset() {
         clock_ = 0;
-        isDoubleSpeed_ = false;
+        speed_shift_ = 0;
+        last_speed_switch_start_ = 0;
+        last_speed_switch_ = 0;
     }
 
 private:
     TCycleCount clock_ = 0;
-    bool isDoubleSpeed_ = false;
+    unsigned int speed_shift_ = 0;
+    TCycleCount last_speed_switch_start_ = 0;
+    TCycleCount last_speed_switch_ = 0;
 };
 
 }  // namespace GbcEmulator
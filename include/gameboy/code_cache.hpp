@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "types.hpp"
+
+namespace GbcEmulator {
+
+class Cpu;
+
+// Straight-line runs of instructions decoded once, keyed by bank and address.
+// Blocks remember the generation of the pages they were decoded from, so a write
+// to one of these pages makes them stale.
+class CodeCache {
+public:
+    using InstructionHandler = void (*)(Cpu&);
+    using NativeRun = void (*)(Byte* registers);
+
+    struct DecodedInstruction {
+        InstructionHandler handler;
+        Word address;
+        Byte opcode;
+        std::array<Byte, 2> operands;
+
+        // Compiled run starting at this instruction, see JitCompiler
+        NativeRun native = nullptr;
+        Byte native_length = 0;
+        uint16_t native_cycles = 0;
+        Word native_end_address = 0;
+    };
+
+    struct Block {
+        std::vector<DecodedInstruction> instructions;
+        Byte first_page, last_page;
+        uint32_t first_page_generation, last_page_generation;
+    };
+
+    CodeCache() = default;
+    CodeCache(const CodeCache&) = delete;
+    CodeCache& operator=(const CodeCache&) = delete;
+
+    static constexpr uint32_t makeKey(Word address, uint16_t bank) {
+        return static_cast<uint32_t>(bank) << 16 | address;
+    }
+
+    // Returns nullptr if the block was never decoded, or is stale
+    inline const Block* find(uint32_t key) {
+        LookupEntry& entry = lookup_[key % lookup_.size()];
+        if (entry.key != key) {
+            auto it = blocks_.find(key);
+            if (it == blocks_.end())
+                return nullptr;
+            entry = {key, &it->second};
+        }
+
+        const Block* block = entry.block;
+        if (page_generations_[block->first_page] != block->first_page_generation ||
+            page_generations_[block->last_page] != block->last_page_generation)
+            return nullptr;
+
+        return block;
+    }
+
+    const Block& insert(uint32_t key, Block&& block);
+
+    // Bumped on every invalidation, a running block has to stop when it changes
+    constexpr uint32_t getGeneration() const { return generation_; }
+
+    inline void notifyWrite(Word address) {
+        Byte page = static_cast<Byte>(address >> 8);
+        if (code_pages_.test(page))
+            invalidatePage(page);
+    }
+
+    // Blocks are keyed by bank, they don't need to be dropped, only left
+    inline void notifyBankSwitch() { ++generation_; }
+
+    void clear();
+
+private:
+    void invalidatePage(Byte page);
+
+    // Direct-mapped front of blocks_, most lookups are for the same few loops
+    struct LookupEntry {
+        uint32_t key = std::numeric_limits<uint32_t>::max();
+        const Block* block = nullptr;
+    };
+    std::array<LookupEntry, 0x400> lookup_;
+
+    std::unordered_map<uint32_t, Block> blocks_;
+    std::bitset<0x100> code_pages_;
+    std::array<uint32_t, 0x100> page_generations_ = {};
+    uint32_t generation_ = 0;
+};
+
+}  // namespace GbcEmulator
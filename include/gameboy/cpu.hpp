@@ -1,36 +1,163 @@
 #pragma once
 
 #include <bitset>
+#include <functional>
+#include <memory>
 
 #include "clock.hpp"
+#include "code_cache.hpp"
 #include "cpu_state.hpp"
 
 namespace GbcEmulator {
 
 class MemoryManagmentUnit;
+class InterruptScheduler;
+class JitCompiler;
+
+// Computed goto (labels as values) is a GNU extension, also supported by Clang
+#if defined(__GNUC__) || defined(__clang__)
+#define GBC_HAS_COMPUTED_GOTO 1
+#else
+#define GBC_HAS_COMPUTED_GOTO 0
+#endif
+
+// Set by the build when the optional GameBoyJit target is linked in
+#ifndef GBC_HAS_JIT
+#define GBC_HAS_JIT 0
+#endif
 
 class Cpu {
 public:
-    explicit Cpu(MemoryManagmentUnit& bus) : bus_{bus} { reset(); }
+    // How the opcode is dispatched to its implementation, it doesn't change emulation behaviour
+    enum class DispatchMode {
+        Switch,    // Single switch over the opcode
+        Table,     // Table of handlers generated at compile time
+        Threaded,  // Computed goto, falls back to Table if unsupported by the compiler
+        Cached,    // Runs ROM, WRAM and HRAM code from pre-decoded blocks
+        Jit,       // Cached, with register-only runs compiled to x86-64, falls back to Cached
+    };
+
+    static constexpr bool has_threaded_dispatch = GBC_HAS_COMPUTED_GOTO;
+    static constexpr bool has_jit = GBC_HAS_JIT;
+
+    Cpu(MemoryManagmentUnit& bus, InterruptScheduler& interrupts);
     Cpu(const Cpu&) = delete;
     Cpu& operator=(const Cpu&) = delete;
+    ~Cpu();
 
     constexpr Clock& getClock() { return clock_; }
 
     constexpr const CpuState& getState() const { return state_; }
     constexpr CpuState createStateSnapshot() const { return state_; }
-    constexpr void restoreStateSnapshot(const CpuState& state) { state_ = state; }
+    constexpr void restoreStateSnapshot(const CpuState& state) {
+        state_ = state;
+        pending_flags_ = {};
+    }
 
     void reset();
     void setPause(bool is_paused = true) { state_.paused = is_paused; }
+
+    // Back to the normal speed without a switch armed, for the next game
+    void resetSpeed();
+    // KEY1, arms the speed switch done by the next STOP
+    Byte getKey1();
+    void setKey1(Byte value);
+    void registerCgbIoHandlers(MemoryManagmentUnit& mmu);
+
+    // Debugging features checked by the run loop. It is compiled for every combination of them,
+    // so a run only pays for the features in use.
+    enum class RunFeature : unsigned {
+        Breakpoints = 1 << 0,
+        Tracing     = 1 << 1,
+        Watchpoints = 1 << 2,
+    };
+    static constexpr unsigned run_feature_combinations = 1 << 3;
+
+    static constexpr bool hasRunFeature(unsigned features, RunFeature feature) {
+        return features & static_cast<unsigned>(feature);
+    }
+
+    // Combination of RunFeature needed by the breakpoints, trace callback and watchpoints
+    // currently set
+    unsigned getRunFeatures() const {
+        return (breakpoint_count_ ? static_cast<unsigned>(RunFeature::Breakpoints) : 0)
+             | (trace_callback_ ? static_cast<unsigned>(RunFeature::Tracing) : 0)
+             | (has_watchpoints_ ? static_cast<unsigned>(RunFeature::Watchpoints) : 0);
+    }
+
+    template <unsigned Features>
     void stepTCycles(TCycleCount n);
 
+    using RunLoop = void (Cpu::*)(TCycleCount);
+    static RunLoop getRunLoop(unsigned features);
+
+    constexpr DispatchMode getDispatchMode() const { return dispatch_mode_; }
+    void setDispatchMode(DispatchMode mode);
+
+    // Defers the flags of ALU operations until F is read, it doesn't change emulation behaviour.
+    // F is always up to date outside of stepTCycles.
+    constexpr bool hasLazyFlags() const { return lazy_flags_; }
+    void setLazyFlags(bool is_lazy) {
+        materializeFlags();
+        lazy_flags_ = is_lazy;
+    }
+
+    // Fast-forwards loops polling an I/O register until the polled value changes,
+    // it doesn't change emulation behaviour.
+    constexpr bool hasIdleLoopSkipping() const { return idle_loop_skipping_; }
+    constexpr void setIdleLoopSkipping(bool is_enabled) { idle_loop_skipping_ = is_enabled; }
+    constexpr TCycleCount getSkippedIdleCycles() const { return skipped_idle_cycles_; }
+
+    inline void notifyCodeWrite(Word address) { code_cache_.notifyWrite(address); }
+    inline void notifyBankSwitch() { code_cache_.notifyBankSwitch(); }
+    void clearCodeCache() { code_cache_.clear(); }
+
     bool hasBreakpoint(Word address) const { return breakpoints_.test(address); }
-    void setBreakpoint(Word address) { breakpoints_.set(address); }
-    void clearBreakpoint(Word address) { breakpoints_.set(address, false); }
-    void clearAllBreakpoints() { breakpoints_.reset(); }
+    void setBreakpoint(Word address) {
+        breakpoint_count_ += !breakpoints_.test(address);
+        breakpoints_.set(address);
+    }
+    void clearBreakpoint(Word address) {
+        breakpoint_count_ -= breakpoints_.test(address);
+        breakpoints_.set(address, false);
+    }
+    void clearAllBreakpoints() {
+        breakpoints_.reset();
+        breakpoint_count_ = 0;
+    }
+
+    // Set by the MMU, which owns the watchpoints
+    void setWatchpointsEnabled(bool is_enabled) { has_watchpoints_ = is_enabled; }
+
+    // Called with the state before every instruction, an empty callback disables tracing
+    using TraceCallback = std::function<void(const CpuState&)>;
+    void setTraceCallback(TraceCallback callback) { trace_callback_ = std::move(callback); }
 
 private:
+    using InstructionHandler = CodeCache::InstructionHandler;
+
+    template <Byte Op>
+    static void baseHandler(Cpu& cpu) { cpu.baseInstruction<Op>(); }
+    template <Byte Op>
+    static void prefixHandler(Cpu& cpu) { cpu.prefixInstruction<Op>(); }
+    static InstructionHandler getBaseHandler(Byte inst);
+
+    template <unsigned Features>
+    bool prepareInstruction(TCycleCount target_cycle);
+    template <unsigned Features>
+    void runSwitch(TCycleCount target_cycle);
+    template <unsigned Features>
+    void runTable(TCycleCount target_cycle);
+    template <unsigned Features>
+    void runThreaded(TCycleCount target_cycle);
+    template <unsigned Features>
+    void runCached(TCycleCount target_cycle);
+
+    const CodeCache::Block* decodeBlock(Word address);
+    void compileBlock(CodeCache::Block& block);
+    template <unsigned Features>
+    bool canRunNative(TCycleCount cycles, TCycleCount target_cycle);
+
     Byte readAtAddr(Word address);
     void writeAtAddr(Word address, Byte value);
     void writeWordAtAddr(Word address, Word value);
@@ -39,6 +166,42 @@ private:
     Word readNextWord();
 
     void baseInstruction(Byte inst);
+    template <Byte Op>
+    void baseInstruction();
+
+    bool checkCondition(Byte condition);
+
+    // Last flag-setting operation whose flags haven't been written to F yet
+    enum class FlagsOperation : Byte { None, Add, Adc, Sub, Sbc, And, Xor, Or, Cp, Inc, Dec };
+    struct PendingFlags {
+        FlagsOperation operation = FlagsOperation::None;
+        Byte lhs, rhs, result;
+        bool carry;
+    };
+
+    inline void deferFlags(FlagsOperation operation, Byte lhs, Byte rhs, Byte result,
+                           bool carry = false) {
+        pending_flags_ = {operation, lhs, rhs, result, carry};
+        if (!lazy_flags_)
+            writePendingFlags();
+    }
+
+    inline void materializeFlags() {
+        if (pending_flags_.operation != FlagsOperation::None)
+            writePendingFlags();
+    }
+
+    // For operations overwriting Z, N, H and C without reading them
+    inline void discardPendingFlags() { pending_flags_.operation = FlagsOperation::None; }
+
+    void writePendingFlags();
+
+    template <Byte Index>
+    Byte readOperand();
+    template <Byte Index>
+    void writeOperand(Byte value);
+    template <Byte Operation>
+    void aluOperation(Byte value);
 
     void stop();
     void halt();
@@ -46,17 +209,17 @@ private:
     void ei();
     void di();
 
-    void loadAddSigned(_Reg16 regTo, Word value, Byte offset);
+    void loadAddSigned(Word& regTo, Word value, Byte offset);
 
-    void incAddr(_Reg16 addr);
-    void decAddr(_Reg16 addr);
-    void incWord(_Reg16 reg);
-    void decWord(_Reg16 reg);
+    void incAddr(Word addr);
+    void decAddr(Word addr);
+    void incWord(Word& reg);
+    void decWord(Word& reg);
     void incByte(Byte& reg);
     void decByte(Byte& reg);
 
-    void addWord(_Reg16 regTo, Word value);
-    void addWordSigned(_Reg16 regTo, Byte value);
+    void addWord(Word& regTo, Word value);
+    void addWordSigned(Word& regTo, Byte value);
     void add(Byte& regTo, Byte value);
     void adc(Byte& regTo, Byte value);
     void sub(Byte& regTo, Byte value);
@@ -77,10 +240,11 @@ private:
     void ccf();
 
     void jmpRel(Byte offset, bool condition = true);
+    void skipIdleLoop(Word jump_end);
     void jmp(Word address, bool condition = true);
 
     void push(Word value);
-    void pop(_Reg16 regTo);
+    void pop(Word& regTo);
 
     void call(Word address, bool condition = true);
     void ret();
@@ -88,6 +252,8 @@ private:
     void reti();
 
     void prefixInstruction(Byte inst);
+    template <Byte Op>
+    void prefixInstruction();
 
     Byte rlc(Byte value);
     Byte rrc(Byte value);
@@ -108,11 +274,45 @@ private:
     void undefinedInstruction();
 
     MemoryManagmentUnit& bus_;
+    InterruptScheduler& interrupts_;
     CpuState state_;
 
     Clock clock_;
 
+    DispatchMode dispatch_mode_ = DispatchMode::Table;
+
+    bool lazy_flags_ = true;
+    PendingFlags pending_flags_;
+
+    // End of the current stepTCycles run
+    TCycleCount target_cycle_ = 0;
+
+    bool idle_loop_skipping_ = true;
+    TCycleCount skipped_idle_cycles_ = 0;
+    // Address following the last backward relative jump taken, and when it was taken
+    Word last_loop_jump_ = 0;
+    TCycleCount last_loop_jump_time_ = 0;
+
+    CodeCache code_cache_;
+    // Operands of the instruction being run from the code cache, nullptr otherwise
+    const Byte* prefetched_operands_ = nullptr;
+#if GBC_HAS_JIT
+    // Only created once the Jit dispatch mode is selected
+    std::unique_ptr<JitCompiler> jit_;
+#endif
+
     std::bitset<0x10000> breakpoints_;
+    std::size_t breakpoint_count_ = 0;
+    TraceCallback trace_callback_;
+    bool has_watchpoints_ = false;
+    // Instruction at which a breakpoint or watchpoint last paused, and when, so resuming
+    // from there doesn't hit it again
+    Word paused_pc_ = 0;
+    TCycleCount paused_cycle_ = TCycle_never;
+
+    bool is_speed_switch_armed_ = false;
+    // The CPU is stopped while the speed switches, in T-cycles of the new speed
+    inline static constexpr TCycleCount speed_switch_cycles = 2050 * 4;
 
     friend class GameBoyDebugger;
 };
@@ -1,109 +1,56 @@
 #pragma once
 
-#include <iomanip>
-#include <iostream>
-#include <type_traits>
 #include <array>
+#include <bit>
+#include <cstddef>
 
 #include "types.hpp"
 
 namespace GbcEmulator {
 
+// Offsets in the register file, in bytes, the low byte of a pair is at the even offset
 enum class Reg16 { PC=0, AF=2, BC=4, DE=6, HL=8, SP=10 };
 enum class Reg8  { F=2, A=3, C=4, B=5, E=6, D=7, L=8, H=9 };
 enum class RegFlag : Byte { C=1<<4, H=1<<5, N=1<<6, Z=1<<7 };
 
-class _Reg16
+// Register pairs are stored as native words, so 16-bit accesses are plain loads and stores.
+// 8-bit registers are views on the halves of these words.
+class CpuState
 {
 public:
-    constexpr _Reg16(Byte& hi, Byte& lo) : _hi{hi}, _lo{lo} {}
-    _Reg16(const _Reg16&) = delete;
-    _Reg16& operator=(const _Reg16&) = delete;
-
-    constexpr _Reg16& operator=(Word value) {
-        _hi = static_cast<Byte>(value >> 8) & 0xFFu;
-        _lo = value & 0xFFu;
-        return *this;
-    }
-
-    constexpr operator Word() const {
-        return (_hi << 8) | _lo;
+    inline Byte operator[](Reg8 r) const {
+        return reinterpret_cast<const Byte*>(_words.data())[byteIndex(r)];
     }
 
-    constexpr Word operator++(int) {
-        Word value = operator Word();
-        operator+=(1);
-        return value;
+    inline Byte& operator[](Reg8 r) {
+        return reinterpret_cast<Byte*>(_words.data())[byteIndex(r)];
     }
 
-    constexpr _Reg16& operator++() {
-        return operator+=(1);
+    constexpr Word operator[](Reg16 rr) const {
+        return _words[static_cast<std::size_t>(rr) / 2];
     }
 
-    constexpr _Reg16& operator+=(Word rhs) {
-        return operator=(operator Word() + rhs);
+    constexpr Word& operator[](Reg16 rr) {
+        return _words[static_cast<std::size_t>(rr) / 2];
     }
 
-    constexpr Word operator--(int) {
-        Word value = operator Word();
-        operator-=(1);
-        return value;
+    inline bool getFlag(RegFlag f) const {
+        return operator[](Reg8::F) & static_cast<Byte>(f);
     }
 
-    constexpr _Reg16& operator--() {
-        return operator-=(1);
+    inline void setFlag(RegFlag f, bool value) {
+        Byte& flags = operator[](Reg8::F);
+        flags = static_cast<Byte>((flags & ~static_cast<Byte>(f)) | (value ? static_cast<Byte>(f) : 0));
     }
 
-    constexpr _Reg16& operator-=(Word rhs) {
-        return operator=(operator Word() - rhs);
-    }
-
-private:
-    Byte& _hi;
-    Byte& _lo;
-};
-
-class _RegFlag
-{
-public:
-    constexpr _RegFlag(Byte& byte, Byte mask) : _byte{byte}, _mask{mask} {}
-    _RegFlag(const _RegFlag&) = delete;
-    _RegFlag& operator=(const _RegFlag&) = delete;
-
-    constexpr _RegFlag& operator=(bool value) {
-        _byte = (~_mask & _byte) | (value ? _mask : 0);
-        return *this;
+    // Packs the 4 flags in a single store, the lower nibble of F is kept
+    inline void setFlags(bool z, bool n, bool h, bool c) {
+        Byte& flags = operator[](Reg8::F);
+        flags = static_cast<Byte>((flags & 0x0F) | (z << 7) | (n << 6) | (h << 5) | (c << 4));
     }
 
-    constexpr operator bool() const {
-        return _byte & _mask;
-    }
-
-private:
-    Byte& _byte;
-    Byte _mask;
-};
-
-class CpuState
-{
-public:
-    constexpr Byte operator[](Reg8 r) const {
-        return _reg[static_cast<std::array<unsigned char, 12>::size_type>(r)];
-    }
-    
-    constexpr Byte& operator[](Reg8 r) {
-        return _reg[static_cast<std::array<unsigned char, 12>::size_type>(r)];
-    }
-
-    constexpr _Reg16 operator[](Reg16 rr) {
-        auto rr_index = static_cast<std::array<unsigned char, 12>::size_type>(rr);
-        return _Reg16{_reg[rr_index+1], _reg[rr_index]};
-    }
-
-    constexpr _RegFlag operator[](RegFlag f) {
-        auto f_reg = static_cast<std::array<unsigned char, 12>::size_type>(Reg8::F);
-        return _RegFlag {_reg[f_reg], static_cast<Byte>(f)};
-    }
+    // Raw register file, laid out as the Reg8 and Reg16 offsets on little-endian hosts
+    inline Byte* data() { return reinterpret_cast<Byte*>(_words.data()); }
 
     bool ime, next_ime;
     bool paused;
@@ -116,14 +63,19 @@ public:
 
     constexpr void reset() {
         paused = true;
-        _reg.fill(0);
+        _words.fill(0);
         next_ime = 0;
         ime = 0;
         mode = Mode::Normal;
     }
 
 private:
-    std::array<Byte, 12> _reg;
+    static constexpr std::size_t byteIndex(Reg8 r) {
+        auto index = static_cast<std::size_t>(r);
+        return std::endian::native == std::endian::little ? index : index ^ 1;
+    }
+
+    std::array<Word, 6> _words;
 };
 
 }  // namespace GbcEmulator
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <optional>
+
+#include "types.hpp"
+
+namespace GbcEmulator {
+
+class Clock;
+class MemoryManagmentUnit;
+class Ppu;
+
+// OAM DMA and CGB VRAM DMA (general purpose and HBlank).
+// Transfers are caught up lazily: while one is running, every memory access goes
+// through the MMU handlers, which bring it up to the current cycle first. The
+// bytes nobody could observe in between are copied in bulk.
+class Dma {
+public:
+    Dma(Clock& clock, MemoryManagmentUnit& mmu, Ppu& ppu)
+    : clock_{clock}, mmu_{mmu}, ppu_{ppu} { reset(); }
+    Dma(const Dma&) = delete;
+    Dma& operator=(const Dma&) = delete;
+
+    constexpr Byte getOamDmaSource() const { return static_cast<Byte>(oam_source_ >> 8); }
+    void startOamDma(Byte value);
+
+    void setHdma1(Byte value);
+    void setHdma2(Byte value);
+    void setHdma3(Byte value);
+    void setHdma4(Byte value);
+    // Blocks left minus one, bit 7 set while no HBlank DMA is running
+    Byte getHdma5();
+    void setHdma5(Byte value);
+
+    // DMA
+    void registerIoHandlers(MemoryManagmentUnit& mmu);
+    // HDMA1-HDMA5
+    void registerCgbIoHandlers(MemoryManagmentUnit& mmu);
+
+    // A halted CPU isn't stalled by the blocks of the HBlank DMA
+    void catchUp(bool is_cpu_halted = false);
+    constexpr bool isActive() const { return is_oam_dma_active_ || is_hdma_active_; }
+    // HBlank at which the next block is copied, TCycle_never without an HBlank DMA running
+    constexpr TCycleCount getNextHdmaBlock() const {
+        return is_hdma_active_ ? next_hblank_ : TCycle_never;
+    }
+
+    // What the CPU sees instead of memory while OAM DMA holds its bus (DMG)
+    std::optional<Byte> getConflictingLoad(Word address) const;
+    bool isStoreBlocked(Word address) const;
+
+    void reset();
+
+private:
+    // Whether the OAM DMA is using the bus of this address
+    bool isOamDmaBus(Word address) const;
+    Word getOamDmaSourceAddress(Word offset) const;
+
+    // Copies a block at start, the CPU is stalled from then on unless is_stalling is false
+    void transferVramBlock(TCycleCount start, bool is_stalling = true);
+    void updateMmuRouting();
+
+    // In T-cycles of the CPU from the start of the write to DMA: the write, one M-cycle of setup,
+    // then one byte per M-cycle
+    inline static constexpr TCycleCount oam_dma_setup = 8;
+    inline static constexpr TCycleCount oam_dma_byte = 4;
+    inline static constexpr Word oam_size = 0xA0;
+
+    inline static constexpr Word vram_dma_block_size = 0x10;
+    // CPU halted per block, in T-cycles of the normal speed whatever the CPU speed
+    inline static constexpr TCycleCount vram_dma_block_stall = 32;
+
+    Clock& clock_;
+    MemoryManagmentUnit& mmu_;
+    Ppu& ppu_;
+
+    // OAM DMA
+    bool is_oam_dma_active_;
+    Word oam_source_;
+    TCycleCount oam_dma_start_;
+    TCycleCount oam_dma_byte_length_;
+    Word oam_copied_;
+
+    // VRAM DMA
+    Word vram_source_, vram_destination_;
+    Byte vram_blocks_left_;
+    bool is_hdma_active_;
+    TCycleCount next_hblank_;
+};
+
+}  // namespace GbcEmulator
@@ -6,6 +6,7 @@
 #include "serial_connection.hpp"
 #include "timer.hpp"
 #include "ppu.hpp"
+#include "dma.hpp"
 
 namespace GbcEmulator {
 
@@ -21,25 +22,45 @@ public:
     constexpr Timer& getTimer() noexcept { return timer_; }
     constexpr SerialConnection& getSerial() noexcept { return serial_; }
     constexpr Ppu& getPpu() noexcept { return ppu_; }
+    constexpr Dma& getDma() noexcept { return dma_; }
 
     constexpr bool isRunning() const
     {
         return !cpu_.getState().paused;
     }
 
+    // Set by the cartridge loaded, from its CGB flag
+    constexpr bool isCgbMode() const { return is_cgb_mode_; }
+
+    // Battery-backed cartridges keep their RAM in a .sav file next to the ROM
     bool loadRomFile(const std::string& path);
     void reset();
 
+    constexpr bool hasBatterySaves() const { return battery_saves_; }
+    // Only applies to the ROMs loaded afterwards
+    constexpr void setBatterySaves(bool enabled) { battery_saves_ = enabled; }
+    // Cartridge clocks also count the host time passed since their save was written,
+    // only applies to the ROMs loaded afterwards
+    constexpr bool hasClockCatchUp() const { return clock_catch_up_; }
+    constexpr void setClockCatchUp(bool enabled) { clock_catch_up_ = enabled; }
+
     void setPause(bool is_paused = true) { cpu_.setPause(is_paused); }
     void runFor(TCycleCount t_cycles);
     
 private:
+    void registerIoHandlers();
+
     MemoryManagmentUnit mmu_;
     Cpu cpu_;
     InterruptScheduler interrupt_;
     Timer timer_;
     SerialConnection serial_;
     Ppu ppu_;
+    Dma dma_;
+
+    bool battery_saves_ = false;
+    bool clock_catch_up_ = false;
+    bool is_cgb_mode_ = false;
 
     friend class GameBoyDebugger;
 };
@@ -11,6 +11,7 @@ namespace GbcEmulator {
 
 class Clock;
 class GameBoy;
+class MemoryManagmentUnit;
 
 class InterruptScheduler {
 public:
@@ -21,6 +22,7 @@ public:
     inline void reschedule(InterruptType type, TCycleCount cycle) {
         interrupt_times_[static_cast<std::underlying_type<InterruptType>::type>(type)] = cycle;
         recalculateClosestInterrupt();
+        updatePendingDeadline();
     }
 
     inline Byte getIf() {
@@ -31,8 +33,30 @@ public:
     inline void setIf(Byte value) {
         catchUp();
         if_ = value | 0xE0;
+        updatePendingDeadline();
     }
 
+    constexpr Byte getIe() const { return ie_; }
+
+    inline void setIe(Byte value) {
+        ie_ = value;
+        updatePendingDeadline();
+    }
+
+    // Requested interrupts that are enabled in IE
+    inline Byte getPending() {
+        catchUp();
+        return if_ & ie_ & 0x1F;
+    }
+
+    // First cycle at which getPending() may not be 0, unless IF or IE are written. STAT is
+    // scheduled wherever it may be requested, so getPending() tells once there.
+    // It is 0 when an interrupt is already pending, TCycle_never when none is scheduled.
+    constexpr TCycleCount getPendingDeadline() const { return pending_deadline_; }
+
+    // IF, IE is mapped outside of the I/O registers
+    void registerIoHandlers(MemoryManagmentUnit& mmu);
+
     constexpr const std::array<TCycleCount, 4>& getAllInts() const { return interrupt_times_; }
     
     void catchUp();
@@ -46,12 +70,14 @@ private:
     }
 
     void recalculateClosestInterrupt();
+    void updatePendingDeadline();
 
     Clock& clock_;
     GameBoy& gb_;
 
-    Byte if_;
+    Byte if_, ie_;
     TCycleCount closest_interrupt_time_ = TCycle_never;
+    TCycleCount pending_deadline_ = TCycle_never;
     InterruptType closest_interrupt_type_;
     std::array<TCycleCount, 4> interrupt_times_ = {
         TCycle_never,
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+
+#include "code_cache.hpp"
+#include "types.hpp"
+
+namespace GbcEmulator {
+
+// Translates straight-line runs of register-only instructions to x86-64.
+// Compiled runs never touch memory, so they can't observe or change the clock
+// mid-run: the CPU only has to add their T-cycles once they return.
+class JitCompiler {
+public:
+    using NativeRun = CodeCache::NativeRun;
+
+    JitCompiler();
+    JitCompiler(const JitCompiler&) = delete;
+    JitCompiler& operator=(const JitCompiler&) = delete;
+    ~JitCompiler();
+
+    // Returns how many T-cycles the instruction takes, or 0 if it can't be compiled
+    static unsigned getCompiledCycles(const CodeCache::DecodedInstruction& inst);
+
+    // Returns nullptr when the code buffer is full, it has to be reset before compiling again
+    NativeRun compile(std::span<const CodeCache::DecodedInstruction> instructions);
+
+    // Drops all compiled code, every NativeRun returned before becomes invalid
+    void reset() { used_ = 0; }
+
+private:
+    static constexpr std::size_t buffer_size = 1 << 20;
+
+    Byte* buffer_;
+    std::size_t used_ = 0;
+};
+
+}  // namespace GbcEmulator
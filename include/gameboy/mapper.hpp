@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+
+namespace GbcEmulator {
+
+class Clock;
+
+// Memory bank controller of a cartridge. It only sees writes to its registers
+// (0x0000-0x7FFF), the Cartridge then points the memory map to the selected banks,
+// so reads never go through the mapper.
+class Mapper {
+public:
+    // Banks selected by the registers, before being wrapped to the size of the cartridge
+    struct Banks {
+        uint16_t fixed_rom = 0;     // 0x0000-0x3FFF
+        uint16_t selected_rom = 1;  // 0x4000-0x7FFF
+        uint8_t eram = 0;           // 0xA000-0xBFFF
+        bool eram_enabled = false;
+    };
+
+    // Returns nullptr for unsupported cartridge types (header byte 0x147)
+    static std::unique_ptr<Mapper> create(std::span<const uint8_t> rom);
+
+    virtual ~Mapper() = default;
+
+    virtual void storeRegister(uint16_t address, uint8_t value) = 0;
+    virtual void reset() = 0;
+
+    // eRAM that can't be mapped as plain memory (MBC2 nibbles, MBC3 clock registers)
+    // goes through these, the rest is read and written directly by the memory map
+    virtual bool isExternRamPlain() const { return true; }
+    virtual uint8_t loadFromExternRam([[maybe_unused]] std::span<const uint8_t> eram,
+                                      [[maybe_unused]] uint16_t address) const { return 0xFF; }
+    virtual void storeInExternRam([[maybe_unused]] std::span<uint8_t> eram,
+                                  [[maybe_unused]] uint16_t address,
+                                  [[maybe_unused]] uint8_t value) {}
+
+    // RAM built into the controller, used instead of the size in the header
+    virtual std::size_t getBuiltInRamSize() const { return 0; }
+
+    // Real-time clock (MBC3). It counts the cycles of the emulated Clock, stopped until one
+    // is connected. Its registers are only computed when latched or written.
+    virtual bool hasClock() const { return false; }
+    virtual bool isClockSelected() const { return false; }
+    virtual void connectClock([[maybe_unused]] const Clock& clock) {}
+    // The usual 48 bytes of .sav files: the registers, the latched ones, and the host time
+    // they were saved at. Loading adds the host time elapsed since, when given.
+    virtual void saveClockData([[maybe_unused]] std::span<uint8_t> data,
+                               [[maybe_unused]] int64_t unix_time) const {}
+    virtual void loadClockData([[maybe_unused]] std::span<const uint8_t> data,
+                               [[maybe_unused]] std::optional<int64_t> unix_time) {}
+
+    constexpr const Banks& getBanks() const { return banks_; }
+
+protected:
+    Banks banks_;
+};
+
+}  // namespace GbcEmulator
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+
+#include "types.hpp"
+
+namespace GbcEmulator {
+
+// Counts the accesses of the CPU per 256 bytes page and per I/O register (0xFF00-0xFF7F).
+// The cycle-weighted counts add the T-cycles elapsed since the previous access, so the time
+// spent polling a register is charged to it. Skipped idle loops are charged to the register
+// they poll, the time spent halted to no access.
+class MemoryProfiler {
+public:
+    struct Counts {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        TCycleCount read_cycles = 0;
+        TCycleCount write_cycles = 0;
+    };
+
+    inline void countRead(Word address, TCycleCount now) {
+        TCycleCount cycles = takeCycles(now);
+        for (Counts* counts : {&pages_[address >> 8], getIoCounts(address)}) {
+            if (!counts) continue;
+            ++counts->reads;
+            counts->read_cycles += cycles;
+        }
+    }
+
+    inline void countWrite(Word address, TCycleCount now) {
+        TCycleCount cycles = takeCycles(now);
+        for (Counts* counts : {&pages_[address >> 8], getIoCounts(address)}) {
+            if (!counts) continue;
+            ++counts->writes;
+            counts->write_cycles += cycles;
+        }
+    }
+
+    // The reads of the iterations of an idle loop skipped until now
+    inline void countSkippedReads(Word address, uint64_t reads, TCycleCount now) {
+        TCycleCount cycles = takeCycles(now);
+        for (Counts* counts : {&pages_[address >> 8], getIoCounts(address)}) {
+            if (!counts) continue;
+            counts->reads += reads;
+            counts->read_cycles += cycles;
+        }
+    }
+
+    const std::array<Counts, 0x100>& getPages() const { return pages_; }
+    const std::array<Counts, 0x80>& getIoRegisters() const { return io_registers_; }
+
+    // One row per page and per I/O register accessed at least once
+    void writeCsv(std::ostream& out) const;
+    void writeJson(std::ostream& out) const;
+
+    // Starts over at this cycle
+    void reset(TCycleCount now = 0) {
+        pages_.fill({});
+        io_registers_.fill({});
+        last_access_ = now;
+    }
+    // Keeps the counts, the cycles before now are not charged to the next access
+    void resume(TCycleCount now) { last_access_ = now; }
+
+private:
+    inline TCycleCount takeCycles(TCycleCount now) {
+        TCycleCount cycles = now - last_access_;
+        last_access_ = now;
+        return cycles;
+    }
+
+    inline Counts* getIoCounts(Word address) {
+        return (address & 0xFF80) == 0xFF00 ? &io_registers_[address & 0x7F] : nullptr;
+    }
+
+    std::array<Counts, 0x100> pages_;
+    std::array<Counts, 0x80> io_registers_;
+    TCycleCount last_access_ = 0;
+};
+
+}  // namespace GbcEmulator
@@ -2,9 +2,21 @@
 
 #include <array>
 #include <memory>
+#include <optional>
+#include <span>
+#include <vector>
 
+#include "cpu.hpp"
 #include "types.hpp"
 
+#ifndef GBC_HAS_MEMORY_PROFILER
+#define GBC_HAS_MEMORY_PROFILER 0
+#endif
+
+#if GBC_HAS_MEMORY_PROFILER
+#include "memory_profiler.hpp"
+#endif
+
 namespace GbcEmulator {
 
 class GameBoy;
@@ -12,13 +24,168 @@ class Cartridge;
 
 class MemoryManagmentUnit {
 public:
-    explicit MemoryManagmentUnit(GameBoy& gb);
+    MemoryManagmentUnit(GameBoy& gb, Cpu& cpu);
     MemoryManagmentUnit(const MemoryManagmentUnit&) = delete;
     MemoryManagmentUnit& operator=(const MemoryManagmentUnit&) = delete;
     ~MemoryManagmentUnit();
 
-    Byte load(Word address);
-    void store(Word address, Byte value);
+    // Plain memory is accessed through the page tables, the rest goes through the handlers
+    inline Byte load(Word address) {
+        if (const Byte* page = read_pages_[address >> 8])
+            return page[address & 0xFF];
+        return loadFromHandler(address);
+    }
+
+    inline void store(Word address, Byte value) {
+        if (Byte* page = write_pages_[address >> 8]) {
+            page[address & 0xFF] = value;
+            cpu_.notifyCodeWrite(address);
+            return;
+        }
+        storeToHandler(address, value);
+    }
+
+    // Handler of an I/O register (0xFF00-0xFF7F), registers without one are served from io_
+    struct IoHandler {
+        Byte (*read)(void* component) = nullptr;
+        void (*write)(void* component, Byte value) = nullptr;
+        void* component = nullptr;
+        // Unused bits, always read as 1
+        Byte read_mask = 0x00;
+    };
+
+    void registerIoHandler(Word address, const IoHandler& handler) {
+        io_handlers_[address & 0x7F] = handler;
+    }
+    // Back to the registers of nobody, before registering those of another hardware mode
+    void clearIoHandlers();
+
+    // Registers member functions of a component, nullptr for a register without read or write
+    template <auto Read, auto Write, typename Component>
+    void registerIoHandler(Word address, Component& component, Byte read_mask = 0x00) {
+        IoHandler handler{nullptr, nullptr, &component, read_mask};
+        if constexpr (Read != nullptr)
+            handler.read = [](void* c) -> Byte { return (static_cast<Component*>(c)->*Read)(); };
+        if constexpr (Write != nullptr)
+            handler.write = [](void* c, Byte value) { (static_cast<Component*>(c)->*Write)(value); };
+        registerIoHandler(address, handler);
+    }
+
+    // VBK and SVBK, the CGB VRAM and WRAM banks
+    Byte getVbk();
+    void setVbk(Byte value);
+    Byte getSvbk();
+    void setSvbk(Byte value);
+    void registerCgbIoHandlers();
+
+    // Memory as it is, without DMA bus conflicts or watchpoints, for the DMA and debuggers.
+    // Plain memory is copied with memcpy.
+    Byte loadDirect(Word address);
+    void storeDirect(Word address, Byte value);
+    void copyDirect(Word destination, Word source, Word size);
+
+    // Sends every access through the handlers, so a running DMA can be caught up first
+    void setDmaRouting(bool enabled);
+    // For a halted CPU, which doesn't access memory: catches the DMA up, and returns the next
+    // cycle at which it has to be caught up again, TCycle_never if none
+    TCycleCount catchUpHaltedDma();
+    // Next cycle at which the DMA copies something, TCycle_never if none
+    TCycleCount getDmaDeadline() const;
+
+    // Pauses the emulation when the CPU accesses [first, last]. Only the pages it covers
+    // go through the handlers, the others keep their fast path.
+    // Opcode and operand fetches count as reads too.
+    struct Watchpoint {
+        enum Access : Byte {
+            Read    = 1 << 0,
+            Write   = 1 << 1,
+            Execute = 1 << 2,
+        };
+
+        Word first = 0;
+        Word last = 0;
+        Byte access = Read | Write;
+        // Only hits when the byte read, written or executed equals it
+        std::optional<Byte> value;
+
+        // Whether it can hit at all, the MMU only takes those
+        constexpr bool isValid() const { return access != 0 && first <= last; }
+    };
+
+    struct WatchpointHit {
+        std::size_t index;
+        Word address;
+        Byte value;
+        Watchpoint::Access access;
+    };
+
+    const std::vector<Watchpoint>& getWatchpoints() const { return watchpoints_; }
+    // Adding or setting a watchpoint that is not valid throws std::invalid_argument
+    void addWatchpoint(const Watchpoint& watchpoint);
+    void setWatchpoint(std::size_t index, const Watchpoint& watchpoint);
+    void removeWatchpoint(std::size_t index);
+    void clearAllWatchpoints();
+
+    // Reads and writes are reported once their instruction is done,
+    // returns whether one hit since the last call
+    bool takeWatchpointHit();
+    // Whether the instruction at this address hits an execute watchpoint
+    bool checkExecuteWatchpoints(Word address);
+    const std::optional<WatchpointHit>& getLastWatchpointHit() const { return last_watchpoint_hit_; }
+
+    // Every write to VRAM or OAM takes a new generation, which each 16 bytes block it touches
+    // (a tile, or 16 tile map entries) keeps. A consumer remembers the generation it last
+    // saw and only redoes the blocks changed since, independently of the others.
+    using VideoGeneration = uint64_t;
+    inline static constexpr std::size_t video_block_size = 0x10;
+
+    constexpr VideoGeneration getVideoGeneration() const { return video_generation_; }
+    // Blocks of both banks, bank 1 starts at block 0x200
+    bool isVramBlockChangedSince(std::size_t block, VideoGeneration generation) const {
+        return vram_block_generations_[block] > generation;
+    }
+    bool isOamBlockChangedSince(std::size_t block, VideoGeneration generation) const {
+        return oam_block_generations_[block] > generation;
+    }
+
+    std::span<const Byte> getVram() const { return vram_; }
+    std::span<const Byte> getOam() const { return oam_; }
+
+    // Which bank is currently mapped at this address, 0 for unbanked regions
+    uint16_t getBank(Word address) const;
+
+#if GBC_HAS_MEMORY_PROFILER
+    // Counts every access of the CPU, by sending them all through the handlers while enabled.
+    // Instruction fetches served by the code cache and skipped idle loops are not seen.
+    void setProfiling(bool enabled);
+    constexpr bool isProfiling() const { return is_profiling_; }
+    const MemoryProfiler& getProfiler() const { return profiler_; }
+    void resetProfiler() { profiler_.reset(cpu_.getClock().get()); }
+#endif
+    // Tell the profiler about the cycles the CPU skipped without accessing memory:
+    // iterations of an idle loop polling address, or time spent halted
+    inline void countSkippedPolling([[maybe_unused]] Word address,
+                                    [[maybe_unused]] TCycleCount iterations) {
+#if GBC_HAS_MEMORY_PROFILER
+        if (is_profiling_)
+            profiler_.countSkippedReads(address, iterations, cpu_.getClock().get());
+#endif
+    }
+    inline void skipHaltedCycles() {
+#if GBC_HAS_MEMORY_PROFILER
+        if (is_profiling_)
+            profiler_.resume(cpu_.getClock().get());
+#endif
+    }
+
+    // Cycles between which an I/O register keeps its value, as long as nothing writes to it
+    struct IoValueWindow {
+        TCycleCount since;
+        TCycleCount until;
+    };
+
+    // Returns an empty window for registers that may change at any time
+    IoValueWindow getIoValueWindow(Word address);
 
     void loadCartridge(Cartridge&& cartridge);
     bool hasCartridge() const { return static_cast<bool>(cartridge_); }
@@ -26,7 +193,47 @@ public:
     void reset();
 
 private:
+    Byte loadFromHandler(Word address);
+    void storeToHandler(Word address, Byte value);
+
+    // Points the pages of banked regions to the banks currently selected
+    void updateBankPages();
+    // Same for the cartridge banks only, after a write to the mapper
+    void updateCartridgePages();
+    void mapPages(Word address, std::size_t size, const Byte* readable, Byte* writable);
+    // Applies the memory pages from first_page to end_page to the ones used by load and store
+    void updatePages(std::size_t first_page = 0, std::size_t end_page = 0x100);
+    void updateWatchedPages();
+    void checkWatchpoints(Word address, Byte value, Watchpoint::Access access);
+
+    // Offset in vram_ of an address in the selected bank
+    std::size_t getVramOffset(Word address) const;
+    void markVramWrite(std::size_t offset, std::size_t size);
+    void markOamWrite(std::size_t offset, std::size_t size);
+
     GameBoy& gb_;
+    Cpu& cpu_;
+
+    // One entry per 256 bytes page, nullptr if the page needs a handler
+    std::array<const Byte*, 0x100> read_pages_;
+    std::array<Byte*, 0x100> write_pages_;
+
+    // Where the pages are in memory, read_pages_ and write_pages_ leave out the
+    // watched pages, and every page while the DMA or the profiler needs to see every access
+    std::array<const Byte*, 0x100> memory_read_pages_;
+    std::array<Byte*, 0x100> memory_write_pages_;
+    bool is_dma_routing_ = false;
+
+#if GBC_HAS_MEMORY_PROFILER
+    MemoryProfiler profiler_;
+    bool is_profiling_ = false;
+#endif
+
+    std::vector<Watchpoint> watchpoints_;
+    // Accesses watched in each page, these pages are left out of read_pages_ and write_pages_
+    std::array<Byte, 0x100> watched_pages_{};
+    bool has_watchpoint_hit_ = false;
+    std::optional<WatchpointHit> last_watchpoint_hit_;
 
     std::unique_ptr<Cartridge> cartridge_;
 
@@ -38,13 +245,16 @@ private:
 
     std::array<Byte, 0xA0> oam_;
 
+    VideoGeneration video_generation_ = 0;
+    std::array<VideoGeneration, 0x4000 / video_block_size> vram_block_generations_;
+    std::array<VideoGeneration, 0xA0 / video_block_size> oam_block_generations_;
+
     std::array<Byte, 0x80> io_;
+    std::array<IoHandler, 0x80> io_handlers_;
 
     std::array<Byte, 0x7F> hram_;
 
-    Byte ie_;
-
     friend class GameBoyDebugger;
 };
 
-}  // namespace GbcEmulator
\ No newline at end of file
+}  // namespace GbcEmulator
@@ -1,27 +1,46 @@
 #pragma once
 
 #include <array>
-    
+#include <cstdint>
+#include <memory>
+#include <span>
+
+#include "tile_cache.hpp"
 #include "types.hpp"
 
 namespace GbcEmulator {
 
 class Clock;
 class InterruptScheduler;
+class MemoryManagmentUnit;
 
+// Renders lazily: catchUp draws the visible lines as it gets past them, with the registers and
+// video memory of that moment. Writes to them catch up first, so they land on the line, or in
+// PixelFifo mode the pixel, they were made during.
 class Ppu {
 public:
-    Ppu(Clock& clock, InterruptScheduler& interrupt_scheduler)
-    : clock_{clock}, interrupt_scheduler_{interrupt_scheduler}
-    { reset(); }
+    // How the visible lines are drawn. The modes share every register and the rest of the state,
+    // a change takes effect from the next pixel transfer
+    enum class RenderMode {
+        Scanline,   // Whole lines at the end of a pixel transfer of fixed length
+        PixelFifo,  // Dot by dot through the BG fetcher and the pixel FIFOs, the pixel transfer
+                    // is lengthened by SCX, the window and the sprites
+        Deferred,   // Timed as Scanline, but the lines only record their registers along with
+                    // the video memory writes, worker threads draw the frame while the next one
+                    // runs, so the screen is a frame behind
+    };
+
+    Ppu(Clock& clock, InterruptScheduler& interrupt_scheduler, MemoryManagmentUnit& mmu);
+    ~Ppu();
 
     Byte getLcdc() {
         return lcdc;
     }
 
+    // The mode and LY=LYC bits follow the PPU
     Byte getStat() {
         catchUp();
-        return stat;
+        return static_cast<Byte>((stat & 0x78) | (ly == lyc ? 0x04 : 0) | getMode());
     }
 
     Byte getLy() {
@@ -41,24 +60,36 @@ public:
         return scy;
     }
 
+    Byte getBgp() { return bgp; }
+    Byte getObp0() { return obp0; }
+    Byte getObp1() { return obp1; }
+    Byte getWy() { return wy; }
+    Byte getWx() { return wx; }
+
     void setLcdc(Byte byte) {
         catchUp();
         lcdc = byte;
+        rescheduleInterrupts();
     }
 
     void setStat(Byte byte) {
         catchUp();
-        stat = byte;
+        stat = byte & 0x78;
+        rescheduleInterrupts();
     }
 
     void setLy(Byte byte) {
         catchUp();
+        // The lines recorded so far would no longer be in order
+        flushRecordedLines();
         ly = byte;
+        rescheduleInterrupts();
     }
 
     void setLyc(Byte byte) {
         catchUp();
         lyc = byte;
+        rescheduleInterrupts();
     }
 
     void setScx(Byte byte) {
@@ -71,27 +102,235 @@ public:
         scy = byte;
     }
 
+    void setBgp(Byte byte);
+    void setObp0(Byte byte);
+    void setObp1(Byte byte);
+
+    void setWy(Byte byte) {
+        catchUp();
+        wy = byte;
+    }
+
+    void setWx(Byte byte) {
+        catchUp();
+        wx = byte;
+    }
+
+    // BCPS/BCPD and OCPS/OCPD, the CGB palette memories and their auto-incremented index
+    Byte getBcps() { return bcps_; }
+    void setBcps(Byte byte) { bcps_ = byte & 0xBF; }
+    Byte getBcpd() { return bg_palette_memory_[bcps_ & 0x3F]; }
+    void setBcpd(Byte byte);
+    Byte getOcps() { return ocps_; }
+    void setOcps(Byte byte) { ocps_ = byte & 0xBF; }
+    Byte getOcpd() { return obj_palette_memory_[ocps_ & 0x3F]; }
+    void setOcpd(Byte byte);
+
+    // LCDC, STAT, SCY, SCX, LY, LYC, BGP, OBP0, OBP1, WY and WX
+    void registerIoHandlers(MemoryManagmentUnit& mmu);
+    // BCPS, BCPD, OCPS and OCPD
+    void registerCgbIoHandlers(MemoryManagmentUnit& mmu);
+
+    // CGB mode renders with the attributes of the tile maps and the CGB palettes
+    void setCgbMode(bool is_cgb_mode);
+
+    constexpr RenderMode getRenderMode() const { return render_mode_; }
+    void setRenderMode(RenderMode mode);
+
+    // Called by the MMU once bytes of VRAM (bank 1 from 0x2000) or OAM are written, for Deferred
+    // mode to replay them on the lines after the write
+    void recordVramWrite(std::size_t offset, std::size_t size) {
+        if (is_recording_frame_)
+            recordVideoWrite(offset, size);
+    }
+    void recordOamWrite(std::size_t offset, std::size_t size) {
+        if (is_recording_frame_)
+            recordVideoWrite(vram_size + offset, size);
+    }
+
+    // Cycles at which LY last changed and will next change on its own
+    TCycleCount getLastLyChange();
+    TCycleCount getNextLyChange();
+    // Same for the mode and LY=LYC bits of STAT, during a pixel transfer not drawn yet the next
+    // change is unknown and reported as the next cycle
+    TCycleCount getLastStatChange();
+    TCycleCount getNextStatChange();
+
+    // First cycle after since at which a visible line enters HBlank, TCycle_never if the LCD is off
+    TCycleCount getNextHBlank(TCycleCount since);
+
+    // Cycles for the interrupt scheduler, the interrupts are requested once the clock is past
+    // them. VBlank is requested at the start of line 144. STAT is scheduled wherever its line
+    // may rise, takeStatInterrupt tells whether it did since the last call
+    TCycleCount getNextVBlankInterrupt();
+    TCycleCount getNextStatInterrupt();
+    bool takeStatInterrupt();
+
     void catchUp();
     void reset();
 
     constexpr static int screen_width  = 160;
     constexpr static int screen_height = 144;
-    const std::array<uint16_t, screen_width*screen_height>& getScreenData() const { return pixel_data_; }
+    // The last complete frame, in RGBA 5551
+    const std::array<uint16_t, screen_width*screen_height>& getScreenData() const { return screen_; }
+    // Frames completed since the reset, the screen data changes along with it
+    constexpr uint64_t getFrameCount() const { return frame_count_; }
+
+    // Shared with the debug views, so a tile is decoded once for all of them
+    TileCache& getTileCache() { return tile_cache_; }
 
 private:
     constexpr static int scanline_dot_count = 456;
     constexpr static int scanline_count = 154;
     constexpr static int full_frame_dot_count = scanline_dot_count * scanline_count;
+    constexpr static int oam_scan_dot_count = 80;
+    // OAM scan and the shortest pixel transfer
+    constexpr static int hblank_start_dot = oam_scan_dot_count + 172;
+    constexpr static std::size_t max_sprites_per_line = 10;
+    constexpr static std::size_t vram_size = 0x4000;
+    constexpr static std::size_t oam_size = 0xA0;
+
+    using Palette = std::array<uint16_t, 4>;
+    using SpriteList = std::array<std::size_t, max_sprites_per_line>;
+
+    // What drawing a visible line reads besides video memory
+    struct LineState {
+        Byte ly, lcdc, scx, scy;
+        // Screen X of the window, screen_width when it isn't shown
+        int window_x;
+        Byte window_line;
+        bool is_cgb_mode;
+        std::array<Palette, 8> bg_palettes;
+        std::array<Palette, 8> obj_palettes;
+    };
+    template <typename TileRows>
+    class LineRenderer;
+    class DeferredRenderer;
+
+    // Mode of the STAT bits 0-1
+    Byte getMode() const;
+    // The STAT line is high while one of the sources enabled in STAT is, the interrupt is
+    // requested when it rises
+    bool isStatLineHigh() const;
+    void updateStatLine();
+    // After a write to a register they depend on
+    void rescheduleInterrupts();
+    // Dot at which line ly enters HBlank, is_current_line is false for the lines not started
+    // yet, for which it is estimated from SCX in PixelFifo mode
+    int getHBlankDot(bool is_current_line) const;
+    // Sets up line ly at its first dot, with the render mode of that moment
+    void startScanline();
+
+    // Draws line ly into pixel_data_, or records it in Deferred mode
+    void renderScanline();
+    // The registers line ly is drawn with, updates the window line counter
+    LineState captureLine();
+    // The first 10 sprites on a line into sprites, in OAM order, and their count
+    static std::size_t scanOam(std::span<const Byte> oam, Byte ly, Byte lcdc, SpriteList& sprites);
+    // Color indices of the row of a sprite on a line, from the left. TileRows gives the color
+    // indices of the row of a tile the way TileCache does
+    template <typename TileRows>
+    static std::array<Byte, 8> decodeSpriteRow(const Byte* entry, Byte ly, Byte lcdc,
+                                               bool is_cgb_mode, TileRows& tile_rows);
+
+    // Deferred mode: the frame recorded starts on line 0, and is handed to the workers when
+    // complete at the end of line 143, after the previous one is published
+    void startRecordingFrame();
+    void finishFrame();
+    void recordVideoWrite(std::size_t offset, std::size_t size);
+    // Draws the lines recorded so far right away, the rest of the frame is drawn as it goes
+    void flushRecordedLines();
+    // Publishes the frame the workers are drawing, once done
+    void publishDeferredFrame();
+
+    // PixelFifo mode: sets up the pixel transfer of line ly, then runs up to dot_count dots of
+    // it, and returns the dots run, fewer when the line ends
+    void startPixelFifo();
+    TCycleCount runPixelFifo(TCycleCount dot_count);
+    // One dot of the BG fetcher: tile index, low then high data in 2 dots each, then the push
+    // into the BG FIFO once it is empty
+    void stepFetcher();
+    // Shifts out a pixel, unless the window or a sprite stops the FIFO first
+    void shiftPixelOut();
+    // Merges the row of sprite line_sprites_[next_sprite_] into the OBJ FIFO
+    void fetchSprite();
+    // Offset in VRAM of a tile, LCDC selects how the tile index is read for BG and window
+    static std::size_t getBgTileOffset(Byte lcdc, Byte tile_index);
+
+    // Colors of the palettes of the current mode, from their registers or memory
+    void updatePalettes();
+    static Palette decodeDmgPalette(Byte value);
+    static Palette decodeCgbPalette(const Byte* memory);
 
     Clock& clock_;
     InterruptScheduler& interrupt_scheduler_;
+    MemoryManagmentUnit& mmu_;
+    TileCache tile_cache_;
 
     TCycleCount last_timestamp_;
 
     Byte lcdc, stat, scy, scx, ly, lyc, bgp, obp0, obp1, wy, wx;
 
+    bool is_stat_line_high_;
+    bool has_stat_risen_;
+
+    bool is_cgb_mode_ = false;
+    Byte bcps_, ocps_;
+    std::array<Byte, 0x40> bg_palette_memory_;
+    std::array<Byte, 0x40> obj_palette_memory_;
+    // Colors of the palettes of the current mode, DMG only uses the first BG one and the
+    // first two OBJ ones
+    std::array<Palette, 8> bg_palettes_;
+    std::array<Palette, 8> obj_palettes_;
+
+    // The window has its own line counter, only incremented on the lines showing it
+    bool is_window_triggered_;
+    Byte window_line_;
+
+    RenderMode render_mode_ = RenderMode::Scanline;
+    RenderMode line_render_mode_;
+    bool is_line_drawn_;
+    uint16_t hblank_dot_;
+
+    SpriteList line_sprites_;
+    std::size_t line_sprite_count_;
+
+    // PixelFifo mode: the pixels waiting to be shifted out, with their palette and priority
+    // (the CGB attribute for BG, behind BG for the sprites)
+    struct FifoPixel {
+        Byte color_index = 0;
+        Byte palette = 0;
+        bool has_priority = false;
+        // The CGB favors the sprite first in OAM over the one fetched first
+        std::size_t oam_index = 0;
+    };
+    // BG pops from the head, 8 when empty. OBJ is indexed by screen X modulo 8, it only ever
+    // holds the 8 pixels from the next one
+    std::array<FifoPixel, 8> bg_fifo_;
+    std::size_t bg_fifo_head_;
+    std::array<FifoPixel, 8> obj_fifo_;
+    // Negative during the fetch of the first tile, which is thrown away
+    int fetch_step_;
+    Byte fetch_x_;
+    bool is_fetching_window_;
+    Byte fetch_tile_index_, fetch_attributes_, fetch_low_, fetch_high_;
+    std::size_t fetch_row_offset_;
+    // Pixels to discard: SCX modulo 8 at the line start, the window left of the screen
+    int discarded_pixel_count_;
+    // Sprites are fetched once the BG fetcher is done with its tile, the BG FIFO waiting
+    bool is_sprite_pending_;
+    int sprite_fetch_dots_;
+    std::size_t next_sprite_;
+    std::size_t fifo_x_;
+
     std::array<uint16_t, screen_width*screen_height> pixel_data_;
+    std::array<uint16_t, screen_width*screen_height> screen_;
+    uint64_t frame_count_;
     uint16_t scanline_x;
+
+    // Only created once Deferred mode is selected
+    std::unique_ptr<DeferredRenderer> deferred_;
+    bool is_recording_frame_ = false;
 };
 
 }  // namespace GbcEmulator
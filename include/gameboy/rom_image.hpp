@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace GbcEmulator {
+
+// Read-only ROM content with its header parsed and checksums verified once.
+// Images opened from a file are memory mapped and shared by every Cartridge
+// loading the same file, they are released with their last handle.
+class RomImage {
+public:
+    inline static constexpr std::array<uint8_t, 48> nintendo_logo = {
+        0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83,
+        0x00, 0x0C, 0x00, 0x0D, 0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
+        0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99, 0xBB, 0xBB, 0x67, 0x63,
+        0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
+    };
+
+    // Copies a ROM already in memory, throws if too small for a header
+    explicit RomImage(std::span<const uint8_t> rom);
+    RomImage(const RomImage&) = delete;
+    RomImage& operator=(const RomImage&) = delete;
+    ~RomImage();
+
+    // Returns the image already open for this file if it wasn't modified since,
+    // maps it otherwise. Returns nullptr if the file can't be read.
+    static std::shared_ptr<const RomImage> open(const std::string& path);
+
+    std::span<const uint8_t> getData() const { return data_; }
+    std::size_t getSize() const { return data_.size(); }
+
+    const std::string& getName() const { return name_; }
+    uint8_t getCgbFlag() const { return cgb_flag_; }
+    uint8_t getSgbFlag() const { return sgb_flag_; }
+    uint8_t getCartridgeType() const { return data_[0x0147]; }
+    uint8_t getRomSizeFlag() const { return data_[0x0148]; }
+    uint8_t getExternRamSizeFlag() const { return data_[0x0149]; }
+
+    // RAM, or clock, kept by a battery
+    bool hasBattery() const;
+
+    bool isLogoOk() const { return is_logo_ok_; }
+    bool isHeaderChecksumOk() const { return is_header_checksum_ok_; }
+    bool isFullChecksumOk() const { return is_full_checksum_ok_; }
+
+private:
+    RomImage() = default;
+    void parseHeader();
+
+    std::span<const uint8_t> data_;
+
+    // Backing memory, either a file mapping or a copy
+    void* mapping_ = nullptr;
+    std::size_t mapping_size_ = 0;
+    std::vector<uint8_t> copy_;
+
+    std::string name_;
+    uint8_t cgb_flag_;
+    std::array<uint8_t, 2> new_licensee_code_;
+    uint8_t sgb_flag_;
+    uint8_t destination_code_;
+    uint8_t old_licensee_code_;
+    uint8_t rom_version_number_;
+    bool is_logo_ok_, is_header_checksum_ok_, is_full_checksum_ok_;
+};
+
+}  // namespace GbcEmulator
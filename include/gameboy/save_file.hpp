@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace GbcEmulator {
+
+// Battery-backed cartridge RAM kept in memory and saved to a .sav file: the RAM, then for the
+// cartridges with a clock its usual 48 bytes block, like other emulators.
+// Writes only mark pages dirty, a background thread writes them back. Each write back
+// goes through a journal (<path>.journal) first, and the file is only written once the
+// journal is on disk, so after a crash it holds every page of the last write back, not a
+// mix of two.
+class SaveFile {
+public:
+    inline static constexpr std::size_t page_size = 0x200;
+    inline static constexpr std::size_t clock_data_size = 48;
+    inline static constexpr std::chrono::milliseconds default_flush_interval{1000};
+
+    // Loads the save at path, created or extended to the size of initial and the clock if
+    // needed, with its new bytes set to initial and a stopped clock. Returns nullptr if it
+    // can't be used, or if another instance already uses it.
+    static std::unique_ptr<SaveFile> open(const std::string& path, std::span<const uint8_t> initial,
+                                          bool has_clock,
+                                          std::chrono::milliseconds flush_interval =
+                                              default_flush_interval);
+
+    SaveFile(const SaveFile&) = delete;
+    SaveFile& operator=(const SaveFile&) = delete;
+    // Writes back what is still dirty
+    ~SaveFile();
+
+    // Reads can be made directly, writes have to go through store or beginWrite
+    std::span<uint8_t> getRam() { return ram_; }
+    std::span<uint8_t> getClockData() { return clock_data_; }
+
+    // Writes a byte of the RAM and marks its page dirty, without waiting for the flusher
+    void store(std::size_t offset, uint8_t value) {
+        std::atomic_ref{ram_[offset]}.store(value, std::memory_order_relaxed);
+        std::size_t page = offset / page_size;
+        dirty_pages_[page / 64].fetch_or(uint64_t{1} << (page % 64), std::memory_order_release);
+    }
+
+    // Marks [offset, offset + size) of the RAM dirty, the returned lock keeps the
+    // flusher out while the caller writes to it
+    [[nodiscard]] std::unique_lock<std::mutex> beginWrite(std::size_t offset, std::size_t size);
+    [[nodiscard]] std::unique_lock<std::mutex> beginClockWrite();
+
+    // Writes back the dirty pages now, returns false on an I/O error
+    bool flush();
+
+private:
+    SaveFile() = default;
+    bool recoverJournal();
+    // Size of the file: the RAM, then the clock if there is one
+    std::size_t getFileSize() const { return ram_.size() + (has_clock_ ? clock_data_size : 0); }
+    // Writes [offset, getFileSize()) of the file from the RAM and the clock
+    bool writeToFile(std::size_t offset);
+    void runFlusher(std::stop_token stop_token);
+
+    int fd_ = -1;
+    int journal_fd_ = -1;
+    std::string journal_path_;
+    std::vector<uint8_t> ram_;
+    std::array<uint8_t, clock_data_size> clock_data_{};
+    bool has_clock_ = false;
+    // Numbers the write backs in the journal, continuing from the one replayed on open
+    uint64_t sequence_ = 0;
+
+    // One bit per page, set by the writes and cleared by the flusher before it copies the page
+    std::vector<std::atomic<uint64_t>> dirty_pages_;
+
+    // Keeps the flusher out of the RAM while writes through beginWrite are made,
+    // and guards the clock
+    std::mutex mutex_;
+    bool is_clock_dirty_ = false;
+
+    // Only one write back at a time
+    std::mutex flush_mutex_;
+
+    std::chrono::milliseconds flush_interval_;
+    std::condition_variable_any flusher_wakeup_;
+    std::jthread flusher_;
+};
+
+}  // namespace GbcEmulator
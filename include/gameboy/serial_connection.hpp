@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <vector>
 
 #include "clock.hpp"
@@ -8,6 +9,7 @@
 namespace GbcEmulator {
 
 class InterruptScheduler;
+class MemoryManagmentUnit;
 
 class SerialConnection {
 public:
@@ -27,6 +29,9 @@ public:
             serial_connection_buffer_.push_back(value);
     }
 
+    // SB and SC
+    void registerIoHandlers(MemoryManagmentUnit& mmu);
+
     constexpr TCycleCount getNextInterruptTime() { return TCycle_never; }
 
     constexpr const std::vector<Byte>& getSerialBuffer() const { return serial_connection_buffer_; }
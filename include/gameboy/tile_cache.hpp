@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#include "mmu.hpp"
+#include "types.hpp"
+
+namespace GbcEmulator {
+
+// Color indices of the 384 tiles of both VRAM banks, as is and horizontally flipped. A tile is
+// one VRAM block, it is decoded again on the first access after a write changed it.
+class TileCache {
+public:
+    using Row = std::array<Byte, 8>;
+
+    explicit TileCache(const MemoryManagmentUnit& mmu) : mmu_{mmu} {}
+
+    constexpr static std::size_t tiles_per_bank = 384;
+    constexpr static std::size_t tile_count = 2 * tiles_per_bank;
+
+    // tile_offset is the offset of the tile in VRAM, bank 1 starts at 0x2000
+    const Row& getRow(std::size_t tile_offset, unsigned row, bool is_flipped) {
+        std::size_t block = tile_offset / MemoryManagmentUnit::video_block_size;
+        std::size_t tile = (block >> 9) * tiles_per_bank + (block & 0x1FF);
+        if (mmu_.isVramBlockChangedSince(block, generations_[tile]))
+            decode(block, tile);
+        return (is_flipped ? flipped_tiles_ : tiles_)[tile][row];
+    }
+
+    // Tiles decoded since the construction, to see how much work the cache saves
+    constexpr uint64_t getDecodeCount() const { return decode_count_; }
+
+private:
+    using Tile = std::array<Row, 8>;
+
+    void decode(std::size_t block, std::size_t tile);
+
+    const MemoryManagmentUnit& mmu_;
+    std::array<Tile, tile_count> tiles_;
+    std::array<Tile, tile_count> flipped_tiles_;
+    // Generation of VRAM each tile was decoded at, every tile is older than the first one
+    std::array<MemoryManagmentUnit::VideoGeneration, tile_count> generations_{};
+    uint64_t decode_count_ = 0;
+};
+
+}  // namespace GbcEmulator
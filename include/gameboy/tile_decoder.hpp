@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include "types.hpp"
+
+namespace GbcEmulator {
+
+// Tile rows are 2 bytes, the low then the high bit of the color index of each pixel, the
+// leftmost pixel in bit 7. Decoding them gives one color index per byte, from the left.
+enum class TileDecodeKernel {
+    Scalar,  // Lookup table, portable
+    Bmi2,    // PDEP, one row at a time
+    Sse2,    // Two rows per 128-bit vector
+    Avx2,    // Four rows per 256-bit vector
+};
+
+// The kernels are only built for x86 with GCC and Clang, and only supported if CPUID has them
+bool isTileDecodeKernelSupported(TileDecodeKernel kernel);
+// AVX2, else SSE2, when supported, unless another kernel was set
+TileDecodeKernel getTileDecodeKernel();
+// Returns false, keeping the current kernel, if this one isn't supported
+bool setTileDecodeKernel(TileDecodeKernel kernel);
+
+// Decodes the planar.size() / 2 rows into 8 color indices each
+void decodeTileRows(std::span<const Byte> planar, std::span<Byte> indices);
+void decodeTileRows(TileDecodeKernel kernel, std::span<const Byte> planar, std::span<Byte> indices);
+
+namespace TileDecoding {
+
+// The 8 bits of a byte, from bit 7, spread to bit 0 of the 8 bytes from the lowest
+constexpr std::array<uint64_t, 256> makeSpreadTable()
+{
+    std::array<uint64_t, 256> table{};
+    for (unsigned value = 0; value < 256; ++value)
+        for (unsigned pixel = 0; pixel < 8; ++pixel)
+            if (value & (0x80u >> pixel))
+                table[value] |= uint64_t{1} << (8 * pixel);
+    return table;
+}
+
+inline constexpr std::array<uint64_t, 256> spread_table = makeSpreadTable();
+
+// Reverses the bits of a byte, for the horizontally flipped rows
+constexpr std::array<Byte, 256> makeReverseTable()
+{
+    std::array<Byte, 256> table{};
+    for (unsigned value = 0; value < 256; ++value)
+        for (unsigned bit = 0; bit < 8; ++bit)
+            if (value & (1u << bit))
+                table[value] = static_cast<Byte>(table[value] | (0x80u >> bit));
+    return table;
+}
+
+inline constexpr std::array<Byte, 256> reverse_table = makeReverseTable();
+
+}  // namespace TileDecoding
+
+inline Byte reverseTileRowBits(Byte bits)
+{
+    return TileDecoding::reverse_table[bits];
+}
+
+// One row with the scalar kernel, inlined where rows are decoded one by one
+inline std::array<Byte, 8> decodeTileRow(Byte low, Byte high, bool is_flipped = false)
+{
+    if (is_flipped)
+    {
+        low = reverseTileRowBits(low);
+        high = reverseTileRowBits(high);
+    }
+    uint64_t packed = TileDecoding::spread_table[low] | TileDecoding::spread_table[high] << 1;
+    std::array<Byte, 8> indices;
+    if constexpr (std::endian::native == std::endian::little)
+        std::memcpy(indices.data(), &packed, sizeof(packed));
+    else
+        for (std::size_t pixel = 0; pixel < indices.size(); ++pixel)
+            indices[pixel] = static_cast<Byte>(packed >> (8 * pixel));
+    return indices;
+}
+
+}  // namespace GbcEmulator
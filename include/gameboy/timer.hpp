@@ -6,6 +6,7 @@ namespace GbcEmulator {
 
 class Clock;
 class InterruptScheduler;
+class MemoryManagmentUnit;
 
 class Timer {
 public:
@@ -27,12 +28,27 @@ public:
 
     TCycleCount getNextInterruptTime();
 
+    // DIV, TIMA, TMA and TAC
+    void registerIoHandlers(MemoryManagmentUnit& mmu);
+
+    // Cycles at which DIV and TIMA last changed and will next change on their own
+    TCycleCount getLastDivChange();
+    TCycleCount getNextDivChange();
+    TCycleCount getLastTimaChange();
+    TCycleCount getNextTimaChange();
+
     void reset();
 
 private:
     void catchUp();
     void checkFallingEdgeTimaTrigger();
 
+    // T-cycles of the CPU to T-cycles of the clock
+    TCycleCount toClockCycles(TCycleCount t_cycles) const;
+    // Cycles since, and until, full_div_t_clock_ crosses a multiple of period
+    TCycleCount cyclesSinceDivBoundary(TCycleCount period) const;
+    TCycleCount cyclesUntilDivBoundary(TCycleCount period) const;
+
     Clock& clock_;
     InterruptScheduler& interrupt_scheduler_;
 
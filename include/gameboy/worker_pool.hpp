@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <vector>
+
+namespace GbcEmulator {
+
+// Runs jobs split in chunks on a few threads, while the threads that started them go on.
+// Jobs of several owners can run at once, their chunks are taken in the order they started.
+class WorkerPool {
+public:
+    using Task = std::function<void(std::size_t chunk)>;
+
+    // A job of an owner, which has to wait for it before destroying it
+    class Job {
+    private:
+        Task task_;
+        std::size_t chunk_count_ = 0;
+        std::size_t next_chunk_ = 0;
+        std::size_t done_chunk_count_ = 0;
+
+        friend class WorkerPool;
+    };
+
+    explicit WorkerPool(unsigned thread_count);
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    // Lets the chunks already started finish
+    ~WorkerPool() = default;
+
+    // One pool for the whole process, so the threads don't grow with the instances using it.
+    // Owners keep it alive while they use it.
+    static std::shared_ptr<WorkerPool> getShared();
+
+    // Calls task(chunk) for each chunk below chunk_count, in any order and on any thread.
+    // Waits for the previous run of job first.
+    void start(Job& job, std::size_t chunk_count, Task task);
+    // Until every chunk of job is done
+    void wait(Job& job);
+
+    std::size_t getThreadCount() const { return threads_.size(); }
+
+private:
+    void runWorker(std::stop_token stop_token);
+
+    std::mutex mutex_;
+    std::condition_variable_any job_started_;
+    std::condition_variable job_done_;
+    // Jobs with chunks not taken yet
+    std::deque<Job*> jobs_;
+
+    // Last, so the threads stop before the rest is destroyed
+    std::vector<std::jthread> threads_;
+};
+
+}  // namespace GbcEmulator
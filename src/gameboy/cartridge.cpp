@@ -1,17 +1,10 @@
 #include "cartridge.hpp"
 
+#include <chrono>
 #include <stdexcept>
-#include <algorithm>
-#include <numeric>
 
 namespace GbcEmulator {
 
-static constexpr std::array<uint8_t, 48> nintendo_logo = {
-    0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
-    0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E, 0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
-    0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
-};
-
 static constexpr std::array<size_t, 9> rom_sizes = {
     16384 * 2,  16384 * 4,   16384 * 8,   16384 * 16,  16384 * 32,
     16384 * 64, 16384 * 128, 16384 * 256, 16384 * 512
@@ -22,59 +15,128 @@ static constexpr std::array<size_t, 6> eram_sizes = {
 };
 
 Cartridge::Cartridge(std::span<uint8_t> rom, std::span<uint8_t> eram)
+: Cartridge(std::make_shared<const RomImage>(rom), eram)
 {
-    // Check nintendo logo
-    is_logo_ok_ = std::equal(nintendo_logo.cbegin(), nintendo_logo.cend(), rom.begin() + 0x0104);
-
-    // Check if has a CGB flag (not part of title), or it could be an ASCII character in the title
-    uint16_t title_end = rom[0x0143] > 0x7F ? 0x143 : 0x144;
-    name_ = std::string{rom.begin() + 0x134, rom.begin() + title_end};
-    
-    // New licensee code
-    new_licensee_code_ = { rom[0x0144], rom[0x0145] };
+}
 
-    // SGB flag
-    sgb_flag_ = rom[0x0146];
+Cartridge::Cartridge(std::shared_ptr<const RomImage> rom, std::span<uint8_t> eram)
+: rom_{std::move(rom)}
+{
+    // Setting up the mapper
+    mapper_ = Mapper::create(rom_->getData());
+    if (!mapper_)
+        throw std::invalid_argument("Cartridge type not supported");
 
-    // Setting up ROM
-    uint8_t rom_size_flag = rom[0x0148];
+    // Checking ROM, shared with the other cartridges using this image
+    uint8_t rom_size_flag = rom_->getRomSizeFlag();
     if (rom_size_flag >= rom_sizes.size())
         throw std::invalid_argument("Cartridge ROM size flag invalid");
-    if (rom.size() != rom_sizes[rom_size_flag])
+    if (rom_->getSize() != rom_sizes[rom_size_flag])
         throw std::invalid_argument("Cartridge ROM size not matching size flag");
-    rom_.assign(rom.begin(), rom.end());
-    selected_rom_bank_ = rom_.begin() + 0x4000;
 
-    // Setting up RAM
-    // TODO: Handle no external RAM (currently using 8KiB minimum)
-    uint8_t eram_size_flag = rom[0x0149];
+    // Setting up RAM, without saved content it starts empty
+    uint8_t eram_size_flag = rom_->getExternRamSizeFlag();
     if (eram_size_flag >= eram_sizes.size())
         throw std::invalid_argument("Cartridge external RAM size flag invalid");
-    if (eram.size() != eram_sizes[eram_size_flag])
+    std::size_t eram_size = mapper_->getBuiltInRamSize();
+    if (!eram_size)
+        eram_size = eram_sizes[eram_size_flag];
+    if (eram.size() && eram.size() != eram_size)
         throw std::invalid_argument("Cartridge external RAM size not matching size flag");
-    if (eram_.size())
-        eram_.assign(eram.begin(), eram.end());
+    if (eram.size())
+        eram_buffer_.assign(eram.begin(), eram.end());
+    else
+        eram_buffer_.assign(eram_size, 0xFF);
+    eram_ = eram_buffer_;
+
+    updateBanks();
+}
+
+Cartridge::~Cartridge() {
+    saveClock();
+}
+
+uint8_t Cartridge::loadFromExternRam(uint16_t address) const {
+    if (!mapper_->getBanks().eram_enabled) return 0xFF;
+    if (!mapper_->isExternRamPlain()) return mapper_->loadFromExternRam(eram_, address);
+    return selected_eram_bank_ ? selected_eram_bank_[address] : 0xFF;
+}
+
+void Cartridge::storeInRom(uint16_t address, uint8_t value) {
+    mapper_->storeRegister(address, value);
+    updateBanks();
+}
+
+void Cartridge::storeInExternRam(uint16_t address, uint8_t value) {
+    if (!mapper_->getBanks().eram_enabled) return;
+
+    // Only a game setting the clock saves it, otherwise it is saved when unloaded,
+    // and caught up from the host time when loaded again
+    if (mapper_->isClockSelected()) {
+        mapper_->storeInExternRam(eram_, address, value);
+        saveClock();
+        return;
+    }
+
+    // The mapper decides where its writes go, all of eRAM may have changed
+    if (!mapper_->isExternRamPlain()) {
+        std::unique_lock<std::mutex> lock;
+        if (save_file_) lock = save_file_->beginWrite(0, eram_.size());
+        mapper_->storeInExternRam(eram_, address, value);
+        return;
+    }
+
+    if (!selected_eram_bank_) return;
+    std::size_t offset = static_cast<std::size_t>(selected_eram_bank_ - eram_.data()) + address;
+    if (save_file_)
+        save_file_->store(offset, value);
     else
-        eram_ = std::vector<uint8_t>(0x2000, 0xFF); // Dummy eRAM
-    selected_eram_bank_ = eram_.begin() + 0x1000;
+        eram_[offset] = value;
+}
 
-    // Destination code
-    destination_code_ = rom[0x014A];
+static int64_t getUnixTime() {
+    auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+}
 
-    // Old licensee code
-    old_licensee_code_ = rom[0x014B];
+bool Cartridge::openSaveFile(const std::string& path, bool is_clock_catching_up) {
+    save_file_ = SaveFile::open(path, eram_, mapper_->hasClock());
+    if (!save_file_)
+        return false;
 
-    // ROM version number
-    rom_version_number_ = rom[0x014C];
+    eram_ = save_file_->getRam();
+    eram_buffer_.clear();
+    eram_buffer_.shrink_to_fit();
+    updateBanks();
 
-    // Check header checksum (25 bytes)
-    uint8_t header_checksum = -std::accumulate(rom.begin() + 0x0134, rom.begin() + 0x014D, static_cast<uint8_t>(25));
-    is_header_checksum_ok_ = (header_checksum == rom[0x014D]);
+    if (mapper_->hasClock())
+        mapper_->loadClockData(save_file_->getClockData(),
+                               is_clock_catching_up ? std::optional{getUnixTime()} : std::nullopt);
+    return true;
+}
+
+void Cartridge::saveClock() {
+    if (!save_file_ || !mapper_->hasClock()) return;
+    auto lock = save_file_->beginClockWrite();
+    mapper_->saveClockData(save_file_->getClockData(), getUnixTime());
+}
+
+void Cartridge::reset() {
+    mapper_->reset();
+    updateBanks();
+}
 
-    // Check full ROM checksum
-    uint16_t rom_checksum = std::accumulate(rom.begin(), rom.end(), 0) - rom[0x014E] - rom[0x014F];
-    uint16_t expected_rom_checksum = rom[0x014E] << 8 | rom[0x014F];
-    is_full_checksum_ok_ = (rom_checksum == expected_rom_checksum);
+void Cartridge::updateBanks() {
+    // Bank counts are powers of two, the unused upper bits of the registers wrap around
+    const Mapper::Banks& banks = mapper_->getBanks();
+    const uint8_t* rom = rom_->getData().data();
+    std::size_t rom_bank_mask = rom_->getSize() / 0x4000 - 1;
+    fixed_rom_bank_ = rom + (banks.fixed_rom & rom_bank_mask) * 0x4000;
+    selected_rom_bank_ = rom + (banks.selected_rom & rom_bank_mask) * 0x4000;
+
+    std::size_t eram_bank_count = eram_.size() / 0x2000;
+    selected_eram_bank_ =
+        eram_bank_count ? eram_.data() + (banks.eram % eram_bank_count) * 0x2000 : nullptr;
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,31 @@
+#include "code_cache.hpp"
+
+#include <utility>
+
+namespace GbcEmulator {
+
+const CodeCache::Block& CodeCache::insert(uint32_t key, Block&& block) {
+    code_pages_.set(block.first_page);
+    code_pages_.set(block.last_page);
+    block.first_page_generation = page_generations_[block.first_page];
+    block.last_page_generation = page_generations_[block.last_page];
+    const Block& inserted = blocks_.insert_or_assign(key, std::move(block)).first->second;
+    lookup_[key % lookup_.size()] = {key, &inserted};
+    return inserted;
+}
+
+void CodeCache::invalidatePage(Byte page) {
+    code_pages_.reset(page);
+    ++page_generations_[page];
+    ++generation_;
+}
+
+void CodeCache::clear() {
+    blocks_.clear();
+    lookup_.fill({});
+    code_pages_.reset();
+    page_generations_.fill(0);
+    ++generation_;
+}
+
+}  // namespace GbcEmulator
@@ -1,10 +1,17 @@
 #include "cpu.hpp"
 
+#include <algorithm>
 #include <cstdint>
+#include <utility>
 
+#include "interrupt_scheduler.hpp"
 #include "mmu.hpp"
 #include "types.hpp"
 
+#if GBC_HAS_JIT
+#include "jit_compiler.hpp"
+#endif
+
 namespace GbcEmulator
 {
 
@@ -31,69 +38,199 @@ static constexpr std::array<Byte, 32> interrupt_mask_table = {
     0xF8, 0xFE, 0xFC, 0xFE
 };
 
-// TODO: Handle GBC double speed mode
+// Operand encoding shared by most opcodes, index 6 is (HL) and handled separately
+static constexpr std::array<Reg8, 8> operand_registers = {
+    Reg8::B, Reg8::C, Reg8::D, Reg8::E, Reg8::H, Reg8::L, Reg8::F, Reg8::A
+};
+
+static constexpr std::array<Reg16, 4> operand_pairs = {
+    Reg16::BC, Reg16::DE, Reg16::HL, Reg16::SP
+};
+
+static constexpr std::array<Reg16, 4> stack_pairs = {
+    Reg16::BC, Reg16::DE, Reg16::HL, Reg16::AF
+};
+
+template <unsigned Features>
 void Cpu::stepTCycles(TCycleCount cycles)
 {
     if (state_.paused)
         return;
 
-    TCycleCount starting_time = clock_.get();
-    TCycleCount target_cycle = starting_time + cycles;
+    TCycleCount target_cycle = clock_.get() + cycles;
+    target_cycle_ = target_cycle;
+    switch (dispatch_mode_)
+    {
+    case DispatchMode::Switch:
+        runSwitch<Features>(target_cycle);
+        break;
+
+    case DispatchMode::Table:
+        runTable<Features>(target_cycle);
+        break;
+
+    case DispatchMode::Threaded:
+        runThreaded<Features>(target_cycle);
+        break;
+
+    case DispatchMode::Cached:
+    case DispatchMode::Jit:
+        // Decoded blocks fetch their code without the bus, where the watchpoints are
+        if constexpr (hasRunFeature(Features, RunFeature::Watchpoints))
+            runTable<Features>(target_cycle);
+        else
+            runCached<Features>(target_cycle);
+        break;
+    }
+
+    // The state can be inspected between runs
+    materializeFlags();
+}
+
+
+Cpu::RunLoop Cpu::getRunLoop(unsigned features)
+{
+    static constexpr auto run_loops =
+        []<unsigned... Features>(std::integer_sequence<unsigned, Features...>) {
+            return std::array<RunLoop, sizeof...(Features)>{&Cpu::stepTCycles<Features>...};
+        }(std::make_integer_sequence<unsigned, run_feature_combinations>{});
+
+    return run_loops[features];
+}
+
+
+// Returns true once the CPU is ready to fetch its next opcode,
+// or false if the run should stop there.
+template <unsigned Features>
+bool Cpu::prepareInstruction(TCycleCount target_cycle)
+{
     while (target_cycle > clock_.get())
     {     
-        if (breakpoints_.test(state_[Reg16::PC])
-        && starting_time != clock_.get())
-        {
+        // Resuming from a pause at this instruction runs it
+        bool is_resuming = clock_.get() == paused_cycle_ && state_[Reg16::PC] == paused_pc_;
+        auto pause = [this]() {
             state_.paused = true;
-            return;
+            paused_pc_ = state_[Reg16::PC];
+            paused_cycle_ = clock_.get();
+            return false;
+        };
+
+        if constexpr (hasRunFeature(Features, RunFeature::Breakpoints))
+        {
+            if (breakpoints_.test(state_[Reg16::PC]) && !is_resuming)
+                return pause();
+        }
+
+        // Reads and writes pause once their instruction is done, executions before it.
+        // A halted CPU isn't executing the next instruction yet.
+        if constexpr (hasRunFeature(Features, RunFeature::Watchpoints))
+        {
+            if (bus_.takeWatchpointHit()
+            || (!is_resuming && state_.mode == CpuState::Mode::Normal
+                && bus_.checkExecuteWatchpoints(state_[Reg16::PC])))
+                return pause();
         }
 
         switch (state_.mode)
         {
         // TODO: recreate HALT bug
         case CpuState::Mode::Halted:
-            if (bus_.load(0xFF0F) & bus_.load(0xFFFF) & 0x1F)
+        {
+            // A running HBlank DMA still copies its blocks at their HBlank
+            TCycleCount dma_deadline = bus_.catchUpHaltedDma();
+            if (clock_.get() >= interrupts_.getPendingDeadline() && interrupts_.getPending())
             {
                 state_.mode = CpuState::Mode::Normal;
                 break;
             }
-            clock_.add(4);
+
+            // Nothing can wake the CPU up before an enabled interrupt is requested, so the clock jumps
+            // to the first 4 T-cycles step that would notice it, or to the end of the run.
+            // A breakpoint on the HALT keeps it stepping, to pause at the same cycle.
+            if (hasRunFeature(Features, RunFeature::Breakpoints)
+            && breakpoints_.test(state_[Reg16::PC]))
+            {
+                clock_.add(4);
+            }
+            else
+            {
+                TCycleCount now = clock_.get();
+                TCycleCount wake_up =
+                    std::min({interrupts_.getPendingDeadline(), target_cycle, dma_deadline}) - 1;
+                clock_.add((clock_.toCpuCycles(wake_up - now) / 4 + 1) * 4);
+                bus_.skipHaltedCycles();
+            }
             continue;
+        }
         
         // TODO: handle STOP instruction black magic
         case CpuState::Mode::Stopped:
-            return;
+            return false;
 
         default:
             break;
         }
 
-        if (state_.ime)
+        if (state_.ime && clock_.get() >= interrupts_.getPendingDeadline()
+        && interrupts_.getPending())
         {
-            Byte interrupt = bus_.load(0xFF0F) & bus_.load(0xFFFF) & 0x1F;
-            if (interrupt)
-            {
-                state_.ime = false;
-                state_.next_ime = false;
-                bus_.store(0xFF0F, interrupt & interrupt_mask_table[interrupt]);
+            Byte interrupt = interrupts_.getPending();
+            state_.ime = false;
+            state_.next_ime = false;
+            interrupts_.setIf(interrupt & interrupt_mask_table[interrupt]);
 
-                clock_.add(4);
-                call(interrupt_jump_table[interrupt]);
-                clock_.add(4);
-            }
+            clock_.add(4);
+            call(interrupt_jump_table[interrupt]);
+            clock_.add(4);
         }
 
         state_.ime = state_.next_ime;
 
-        Byte op = readNextByte();
-        baseInstruction(op);
+        if constexpr (hasRunFeature(Features, RunFeature::Tracing))
+        {
+            materializeFlags();
+            trace_callback_(state_);
+        }
+        return true;
     }
+    return false;
+}
+
+Cpu::Cpu(MemoryManagmentUnit& bus, InterruptScheduler& interrupts)
+: bus_{bus}
+, interrupts_{interrupts}
+{
+    reset();
+}
+
+
+Cpu::~Cpu() = default;
+
+
+void Cpu::setDispatchMode(DispatchMode mode)
+{
+    dispatch_mode_ = mode;
+
+    // Blocks are only compiled when they are decoded
+    code_cache_.clear();
+#if GBC_HAS_JIT
+    if (mode == DispatchMode::Jit && !jit_)
+        jit_ = std::make_unique<JitCompiler>();
+#endif
 }
 
+
 void Cpu::reset()
 {
     clock_.reset();
     state_.reset();
+    pending_flags_ = {};
+    code_cache_.clear();
+    is_speed_switch_armed_ = false;
+    skipped_idle_cycles_ = 0;
+    last_loop_jump_ = 0;
+    last_loop_jump_time_ = 0;
+    paused_cycle_ = TCycle_never;
 }
 
 
@@ -122,6 +259,12 @@ void Cpu::writeWordAtAddr(Word address, Word value)
 
 Byte Cpu::readNextByte()
 {
+    if (prefetched_operands_)
+    {
+        clock_.add(4);
+        ++state_[Reg16::PC];
+        return *prefetched_operands_++;
+    }
     return readAtAddr(state_[Reg16::PC]++);
 }
 
@@ -136,8 +279,47 @@ Word Cpu::readNextWord()
 
 void Cpu::stop()
 {
-    state_.mode = CpuState::Mode::Stopped;
     ++state_[Reg16::PC];
+
+    // CGB speed switch, armed through KEY1
+    if (is_speed_switch_armed_)
+    {
+        is_speed_switch_armed_ = false;
+        // STOP resets DIV like a write to it, then the timer is stopped during the switch
+        bus_.storeDirect(0xFF04, 0);
+        clock_.switchSpeed(speed_switch_cycles);
+        // DIV is still 0, this only reschedules the timer at the new speed
+        bus_.storeDirect(0xFF04, 0);
+        return;
+    }
+
+    state_.mode = CpuState::Mode::Stopped;
+}
+
+
+void Cpu::resetSpeed()
+{
+    is_speed_switch_armed_ = false;
+    if (clock_.isDoubleSpeed())
+        clock_.setDoubleSpeed(false);
+}
+
+
+Byte Cpu::getKey1()
+{
+    return static_cast<Byte>(clock_.isDoubleSpeed() << 7 | is_speed_switch_armed_);
+}
+
+
+void Cpu::setKey1(Byte value)
+{
+    is_speed_switch_armed_ = value & 0x01;
+}
+
+
+void Cpu::registerCgbIoHandlers(MemoryManagmentUnit& mmu)
+{
+    mmu.registerIoHandler<&Cpu::getKey1, &Cpu::setKey1>(0xFF4D, *this, 0x7E);
 }
 
 
@@ -160,46 +342,45 @@ void Cpu::di()
 }
 
 
-void Cpu::loadAddSigned(_Reg16 regTo, Word value, Byte offset)
+void Cpu::loadAddSigned(Word& regTo, Word value, Byte offset)
 {
+    discardPendingFlags();
     clock_.add(4);
     state_[Reg8::F] = 0;
-    state_[RegFlag::C] = ((value & 0xFF) + offset > 0xFF);
-    state_[RegFlag::H] = ((value & 0xF) + (offset & 0xF) > 0xF);
+    state_.setFlag(RegFlag::C, ((value & 0xFF) + offset > 0xFF));
+    state_.setFlag(RegFlag::H, ((value & 0xF) + (offset & 0xF) > 0xF));
     // Cast to int8_t before int16_t, so sign extension works properly
     // Also, signed <=> unsigned static_cast is defined in C++20
     regTo = value + static_cast<Word>(static_cast<int16_t>(static_cast<int8_t>(offset)));
 }
 
 
-void Cpu::incAddr(_Reg16 addr)
+void Cpu::incAddr(Word addr)
 {
+    materializeFlags();
     Byte r = readAtAddr(addr) + 1;
     writeAtAddr(addr, r);
-    state_[RegFlag::H] = !(r & 0xF);
-    state_[RegFlag::N] = false;
-    state_[RegFlag::Z] = (r == 0);
+    deferFlags(FlagsOperation::Inc, 0, 0, r);
 }
 
 
-void Cpu::decAddr(_Reg16 addr)
+void Cpu::decAddr(Word addr)
 {
-    Byte r = readAtAddr(addr);
-    state_[RegFlag::H] = !(r & 0xF);
-    writeAtAddr(addr, --r);
-    state_[RegFlag::N] = true;
-    state_[RegFlag::Z] = (r == 0);
+    materializeFlags();
+    Byte r = readAtAddr(addr) - 1;
+    writeAtAddr(addr, r);
+    deferFlags(FlagsOperation::Dec, 0, 0, r);
 }
 
 
-void Cpu::incWord(_Reg16 reg)
+void Cpu::incWord(Word& reg)
 {
     clock_.add(4);
     ++reg;
 }
 
 
-void Cpu::decWord(_Reg16 reg)
+void Cpu::decWord(Word& reg)
 {
     clock_.add(4);
     --reg;
@@ -208,39 +389,37 @@ void Cpu::decWord(_Reg16 reg)
 
 void Cpu::incByte(Byte& reg)
 {
-    ++reg;
-    state_[RegFlag::H] = !(reg & 0xF);
-    state_[RegFlag::N] = false;
-    state_[RegFlag::Z] = (reg == 0);
+    materializeFlags();
+    deferFlags(FlagsOperation::Inc, 0, 0, ++reg);
 }
 
 
 void Cpu::decByte(Byte& reg)
 {
-    state_[RegFlag::H] = !(reg & 0xF);
-    --reg;
-    state_[RegFlag::Z] = (reg == 0);
-    state_[RegFlag::N] = true;
+    materializeFlags();
+    deferFlags(FlagsOperation::Dec, 0, 0, --reg);
 }
 
 
-void Cpu::addWord(_Reg16 regTo, Word value)
+void Cpu::addWord(Word& regTo, Word value)
 {
+    materializeFlags();
     clock_.add(4);
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = ((value & 0xFFF) + (regTo & 0xFFF) > 0xFFF);
+    state_.setFlag(RegFlag::N, false);
+    state_.setFlag(RegFlag::H, ((value & 0xFFF) + (regTo & 0xFFF) > 0xFFF));
     Word old_value = regTo;
     regTo += value;
-    state_[RegFlag::C] = (old_value > regTo);
+    state_.setFlag(RegFlag::C, (old_value > regTo));
 }
 
 
-void Cpu::addWordSigned(_Reg16 regTo, Byte value)
+void Cpu::addWordSigned(Word& regTo, Byte value)
 {
+    discardPendingFlags();
     clock_.add(8);
     state_[Reg8::F] = 0;
-    state_[RegFlag::C] = ((regTo & 0xFF) + value > 0xFF);
-    state_[RegFlag::H] = ((regTo & 0xF) + (value & 0xF) > 0xF);
+    state_.setFlag(RegFlag::C, ((regTo & 0xFF) + value > 0xFF));
+    state_.setFlag(RegFlag::H, ((regTo & 0xF) + (value & 0xF) > 0xF));
     // Cast to int8_t before int16_t, so sign extension works properly
     // Also, signed <=> unsigned static_cast is defined in C++20
     regTo += static_cast<Word>(static_cast<int16_t>(static_cast<int8_t>(value)));
@@ -249,149 +428,116 @@ void Cpu::addWordSigned(_Reg16 regTo, Byte value)
 
 void Cpu::add(Byte& regTo, Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = ((value & 0xF) + (regTo & 0xF) > 0xF);
     Byte old_value = regTo;
     regTo += value;
-    state_[RegFlag::C] = (old_value > regTo);
-    state_[RegFlag::Z] = (regTo == 0);
+    deferFlags(FlagsOperation::Add, old_value, value, regTo);
 }
 
 
 void Cpu::adc(Byte& regTo, Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = (state_[RegFlag::C] + (value & 0xF) + (regTo & 0xF) > 0xF);
-    if (state_[RegFlag::C])
-    {
-        if (value == 0xFF)
-        {
-            state_[RegFlag::Z] = (regTo == 0);
-            state_[RegFlag::C] = true;
-            return;
-        }
-        ++value;
-    }
+    materializeFlags();
+    bool carry = state_.getFlag(RegFlag::C);
     Byte old_value = regTo;
-    regTo += value;
-    state_[RegFlag::C] = (old_value > regTo);
-    state_[RegFlag::Z] = (regTo == 0);
+    regTo = static_cast<Byte>(old_value + value + carry);
+    deferFlags(FlagsOperation::Adc, old_value, value, regTo, carry);
 }
 
 
 void Cpu::sub(Byte& regTo, Byte value)
 {
-    state_[RegFlag::N] = true;
-    state_[RegFlag::H] = (regTo & 0xF) < (value & 0xF);
-    state_[RegFlag::C] = regTo < value;
+    Byte old_value = regTo;
     regTo -= value;
-    state_[RegFlag::Z] = (regTo == 0);
+    deferFlags(FlagsOperation::Sub, old_value, value, regTo);
 }
 
 
 void Cpu::sbc(Byte& regTo, Byte value)
 {
-    state_[RegFlag::N] = true;
-    state_[RegFlag::H] = (regTo & 0xF) < (value & 0xF) + state_[RegFlag::C];
-    if (state_[RegFlag::C])
-    {
-        if (value == 0xFF)
-        {
-            state_[RegFlag::C] = true;
-            state_[RegFlag::Z] = (regTo == 0);
-            return;
-        }
-        ++value;
-    }
-    state_[RegFlag::C] = regTo < value;
-    regTo -= value;
-    state_[RegFlag::Z] = (regTo == 0);
+    materializeFlags();
+    bool carry = state_.getFlag(RegFlag::C);
+    Byte old_value = regTo;
+    regTo = static_cast<Byte>(old_value - value - carry);
+    deferFlags(FlagsOperation::Sbc, old_value, value, regTo, carry);
 }
 
 
 void Cpu::bitwiseAnd(Byte& regTo, Byte value)
 {
     regTo &= value;
-    state_[RegFlag::Z] = (regTo == 0);
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = true;
-    state_[RegFlag::C] = false;
+    deferFlags(FlagsOperation::And, 0, 0, regTo);
 }
 
 
 void Cpu::bitwiseXor(Byte& regTo, Byte value)
 {
     regTo ^= value;
-    state_[RegFlag::Z] = (regTo == 0);
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = false;
+    deferFlags(FlagsOperation::Xor, 0, 0, regTo);
 }
 
 
 void Cpu::bitwiseOr(Byte& regTo, Byte value)
 {
     regTo |= value;
-    state_[RegFlag::Z] = (regTo == 0);
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = false;
+    deferFlags(FlagsOperation::Or, 0, 0, regTo);
 }
 
 
 void Cpu::cp(Byte regA, Byte regB)
 {
-    state_[RegFlag::N] = true;
-    state_[RegFlag::H] = (regA & 0xF) < (regB & 0xF);
-    state_[RegFlag::C] = regA < regB;
-    state_[RegFlag::Z] = (regA == regB);
+    deferFlags(FlagsOperation::Cp, regA, regB, static_cast<Byte>(regA - regB));
 }
 
 
 void Cpu::rlca()
 {
+    discardPendingFlags();
     state_[Reg8::F] = 0;
-    state_[RegFlag::C] = (1 << 7) & state_[Reg8::A];
-    state_[Reg8::A] = (state_[Reg8::A] << 1) | static_cast<Byte>(state_[RegFlag::C]);
+    state_.setFlag(RegFlag::C, (1 << 7) & state_[Reg8::A]);
+    state_[Reg8::A] = (state_[Reg8::A] << 1) | static_cast<Byte>(state_.getFlag(RegFlag::C));
 }
 
 
 void Cpu::rla()
 {
+    materializeFlags();
     bool new_carry = state_[Reg8::A] & (1 << 7);
-    state_[Reg8::A] = static_cast<Byte>(state_[RegFlag::C]) | (state_[Reg8::A] << 1);
+    state_[Reg8::A] = static_cast<Byte>(state_.getFlag(RegFlag::C)) | (state_[Reg8::A] << 1);
     state_[Reg8::F] = 0;
-    state_[RegFlag::C] = new_carry;
+    state_.setFlag(RegFlag::C, new_carry);
 }
 
 
 void Cpu::rrca()
 {
+    discardPendingFlags();
     state_[Reg8::F] = 0;
-    state_[RegFlag::C] = 1 & state_[Reg8::A];
-    state_[Reg8::A] = (state_[Reg8::A] >> 1) | (state_[RegFlag::C] << 7);
+    state_.setFlag(RegFlag::C, 1 & state_[Reg8::A]);
+    state_[Reg8::A] = (state_[Reg8::A] >> 1) | (state_.getFlag(RegFlag::C) << 7);
 }
 
 
 void Cpu::rra()
 {
+    materializeFlags();
     bool new_carry = state_[Reg8::A] & 1;
-    state_[Reg8::A] = (state_[Reg8::A] >> 1) | (static_cast<Byte>(state_[RegFlag::C]) << 7);
+    state_[Reg8::A] = (state_[Reg8::A] >> 1) | (static_cast<Byte>(state_.getFlag(RegFlag::C)) << 7);
     state_[Reg8::F] = 0;
-    state_[RegFlag::C] = new_carry;
+    state_.setFlag(RegFlag::C, new_carry);
 }
 
 
 void Cpu::daa()
 {
-    if (state_[RegFlag::N])
+    materializeFlags();
+    if (state_.getFlag(RegFlag::N))
     {
         // Sub
-        if (state_[RegFlag::C])
+        if (state_.getFlag(RegFlag::C))
         {
             state_[Reg8::A] -= 0x60;
         }
-        if (state_[RegFlag::H])
+        if (state_.getFlag(RegFlag::H))
         {
             state_[Reg8::A] -= 0x6;
         }
@@ -399,43 +545,46 @@ void Cpu::daa()
     else
     {
         // Add
-        if ((state_[Reg8::A] > 0x99) || state_[RegFlag::C])
+        if ((state_[Reg8::A] > 0x99) || state_.getFlag(RegFlag::C))
         {
             state_[Reg8::A] += 0x60;
-            state_[RegFlag::C] = true;
+            state_.setFlag(RegFlag::C, true);
         }
-        if (((state_[Reg8::A] & 0xF) > 0x9) || state_[RegFlag::H])
+        if (((state_[Reg8::A] & 0xF) > 0x9) || state_.getFlag(RegFlag::H))
         {
             state_[Reg8::A] += 0x6;
         }
     }
 
-    state_[RegFlag::H] = false;
-    state_[RegFlag::Z] = (state_[Reg8::A] == 0);
+    state_.setFlag(RegFlag::H, false);
+    state_.setFlag(RegFlag::Z, (state_[Reg8::A] == 0));
 }
 
 
 void Cpu::cpl()
 {
-    state_[RegFlag::N] = true;
-    state_[RegFlag::H] = true;
+    materializeFlags();
+    state_.setFlag(RegFlag::N, true);
+    state_.setFlag(RegFlag::H, true);
     state_[Reg8::A] ^= 0xFF;
 }
 
 
 void Cpu::scf()
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = true;
+    materializeFlags();
+    state_.setFlag(RegFlag::N, false);
+    state_.setFlag(RegFlag::H, false);
+    state_.setFlag(RegFlag::C, true);
 }
 
 
 void Cpu::ccf()
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = !state_[RegFlag::C];
+    materializeFlags();
+    state_.setFlag(RegFlag::N, false);
+    state_.setFlag(RegFlag::H, false);
+    state_.setFlag(RegFlag::C, !state_.getFlag(RegFlag::C));
 }
 
 
@@ -447,9 +596,13 @@ void Cpu::jmpRel(Byte offset, bool condition)
 
     clock_.add(4);
     
+    Word jump_end = state_[Reg16::PC];
     // Cast to int8_t before int16_t, so sign extension works properly
     // Also, signed <=> unsigned static_cast is defined in C++20
     state_[Reg16::PC] += static_cast<Word>(static_cast<int16_t>(static_cast<int8_t>(offset)));
+
+    if (idle_loop_skipping_ && (offset & 0x80))
+        skipIdleLoop(jump_end);
 }
 
 
@@ -471,7 +624,7 @@ void Cpu::push(Word value)
 }
 
 
-void Cpu::pop(_Reg16 regTo)
+void Cpu::pop(Word& regTo)
 {
     Word value = static_cast<Word>(readAtAddr(state_[Reg16::SP]++));
     value += static_cast<Word>(readAtAddr(state_[Reg16::SP]++) << 8);
@@ -514,98 +667,79 @@ void Cpu::reti()
 
 Byte Cpu::rlc(Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = value & (1 << 7);
-    Byte result = (value << 1) | static_cast<Byte>(state_[RegFlag::C]);
-    state_[RegFlag::Z] = (result == 0);
+    discardPendingFlags();
+    Byte result = static_cast<Byte>((value << 1) | (value >> 7));
+    state_.setFlags(result == 0, false, false, value & (1 << 7));
     return result;
 }
 
 
 Byte Cpu::rrc(Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = value & 1;
-    Byte result = (value >> 1) | (static_cast<Byte>(state_[RegFlag::C]) << 7);
-    state_[RegFlag::Z] = (result == 0);
+    discardPendingFlags();
+    Byte result = static_cast<Byte>((value >> 1) | (value << 7));
+    state_.setFlags(result == 0, false, false, value & 1);
     return result;
 }
 
 
 Byte Cpu::rl(Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    bool new_carry = value & (1 << 7);
-    Byte result = (value << 1) | static_cast<Byte>(state_[RegFlag::C]);
-    state_[RegFlag::Z] = (result == 0);
-    state_[RegFlag::C] = new_carry;
+    materializeFlags();
+    Byte result = (value << 1) | static_cast<Byte>(state_.getFlag(RegFlag::C));
+    state_.setFlags(result == 0, false, false, value & (1 << 7));
     return result;
 }
 
 
 Byte Cpu::rr(Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    bool new_carry = value & 1;
-    Byte result = (value >> 1) | (static_cast<Byte>(state_[RegFlag::C]) << 7);
-    state_[RegFlag::Z] = (result == 0);
-    state_[RegFlag::C] = new_carry;
+    materializeFlags();
+    Byte result = (value >> 1) | (static_cast<Byte>(state_.getFlag(RegFlag::C)) << 7);
+    state_.setFlags(result == 0, false, false, value & 1);
     return result;
 }
 
 
 Byte Cpu::sla(Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = value >> 7;
+    discardPendingFlags();
     Byte result = value << 1;
-    state_[RegFlag::Z] = (result == 0);
+    state_.setFlags(result == 0, false, false, value >> 7);
     return result;
 }
 
 
 Byte Cpu::sra(Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = value & 1;
+    discardPendingFlags();
     Byte result = (value & 0x80) | (value >> 1);
-    state_[RegFlag::Z] = (result == 0);
+    state_.setFlags(result == 0, false, false, value & 1);
     return result;
 }
 
 
 Byte Cpu::swap(Byte value)
 {
-    state_[RegFlag::Z] = (value == 0);
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = false;
+    discardPendingFlags();
+    state_.setFlags(value == 0, false, false, false);
     return (value >> 4) | (value << 4);
 }
 
 
 Byte Cpu::srl(Byte value)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = false;
-    state_[RegFlag::C] = value & 1;
+    discardPendingFlags();
     Byte result = value >> 1;
-    state_[RegFlag::Z] = (result == 0);
+    state_.setFlags(result == 0, false, false, value & 1);
     return result;
 }
 
 
 void Cpu::bit(Byte value, Byte bit)
 {
-    state_[RegFlag::N] = false;
-    state_[RegFlag::H] = true;
-    state_[RegFlag::Z] = !(value & (1 << bit));
+    materializeFlags();
+    state_.setFlags(!(value & (1 << bit)), false, true, state_.getFlag(RegFlag::C));
 }
 
 
@@ -627,578 +761,666 @@ void Cpu::undefinedInstruction()
     // TODO: log or crash or something
 }
 
+
+void Cpu::writePendingFlags()
+{
+    const auto [operation, lhs, rhs, result, carry] = pending_flags_;
+    pending_flags_.operation = FlagsOperation::None;
+
+    bool zero = (result == 0);
+    switch (operation)
+    {
+    case FlagsOperation::Add:
+        state_.setFlags(zero, false, (lhs & 0xF) + (rhs & 0xF) > 0xF, lhs > result);
+        break;
+    case FlagsOperation::Adc:
+        state_.setFlags(zero, false, carry + (lhs & 0xF) + (rhs & 0xF) > 0xF, lhs + rhs + carry > 0xFF);
+        break;
+    case FlagsOperation::Sub:
+    case FlagsOperation::Cp:
+        state_.setFlags(zero, true, (lhs & 0xF) < (rhs & 0xF), lhs < rhs);
+        break;
+    case FlagsOperation::Sbc:
+        state_.setFlags(zero, true, (lhs & 0xF) < (rhs & 0xF) + carry, lhs < rhs + carry);
+        break;
+    case FlagsOperation::And:
+        state_.setFlags(zero, false, true, false);
+        break;
+    case FlagsOperation::Xor:
+    case FlagsOperation::Or:
+        state_.setFlags(zero, false, false, false);
+        break;
+    case FlagsOperation::Inc:
+        state_.setFlags(zero, false, !(result & 0xF), state_.getFlag(RegFlag::C));
+        break;
+    case FlagsOperation::Dec:
+        state_.setFlags(zero, true, (result & 0xF) == 0xF, state_.getFlag(RegFlag::C));
+        break;
+    case FlagsOperation::None:
+        break;
+    }
+}
+
+
+bool Cpu::checkCondition(Byte condition)
+{
+    materializeFlags();
+    switch (condition & 0x3)
+    {
+        case 0: return !state_.getFlag(RegFlag::Z);
+        case 1: return state_.getFlag(RegFlag::Z);
+        case 2: return !state_.getFlag(RegFlag::C);
+        default: return state_.getFlag(RegFlag::C);
+    }
+}
+
+
+template <Byte Index>
+Byte Cpu::readOperand()
+{
+    if constexpr (Index == 6)
+        return readAtAddr(state_[Reg16::HL]);
+    else
+        return state_[operand_registers[Index]];
+}
+
+
+template <Byte Index>
+void Cpu::writeOperand(Byte value)
+{
+    if constexpr (Index == 6)
+        writeAtAddr(state_[Reg16::HL], value);
+    else
+        state_[operand_registers[Index]] = value;
+}
+
+
+template <Byte Operation>
+void Cpu::aluOperation(Byte value)
+{
+    if constexpr (Operation == 0) add(state_[Reg8::A], value);
+    else if constexpr (Operation == 1) adc(state_[Reg8::A], value);
+    else if constexpr (Operation == 2) sub(state_[Reg8::A], value);
+    else if constexpr (Operation == 3) sbc(state_[Reg8::A], value);
+    else if constexpr (Operation == 4) bitwiseAnd(state_[Reg8::A], value);
+    else if constexpr (Operation == 5) bitwiseXor(state_[Reg8::A], value);
+    else if constexpr (Operation == 6) bitwiseOr(state_[Reg8::A], value);
+    else cp(state_[Reg8::A], value);
+}
+
+
+// Opcodes are decoded at compile time from their octal layout (xx yyy zzz),
+// see https://gbdev.io/gb-opcodes/optables/octal
+template <Byte Op>
+void Cpu::baseInstruction()
+{
+    constexpr Byte x = Op >> 6;
+    constexpr Byte y = (Op >> 3) & 0x7;
+    constexpr Byte z = Op & 0x7;
+    constexpr Byte p = y >> 1;
+    constexpr Byte q = y & 0x1;
+
+    // ====== First misc block (0x00 - 0x3F) ======
+
+    if constexpr (x == 0)
+    {
+        if constexpr (z == 0)
+        {
+            if constexpr (y == 0) {} // no op
+            else if constexpr (y == 1) writeWordAtAddr(readNextWord(), state_[Reg16::SP]);
+            else if constexpr (y == 2) stop();
+            else if constexpr (y == 3) jmpRel(readNextByte());
+            else jmpRel(readNextByte(), checkCondition(y - 4));
+        }
+        else if constexpr (z == 1)
+        {
+            if constexpr (q == 0) state_[operand_pairs[p]] = readNextWord();
+            else addWord(state_[Reg16::HL], state_[operand_pairs[p]]);
+        }
+        else if constexpr (z == 2)
+        {
+            Word address;
+            if constexpr (p == 0) address = state_[Reg16::BC];
+            else if constexpr (p == 1) address = state_[Reg16::DE];
+            else if constexpr (p == 2) address = state_[Reg16::HL]++;
+            else address = state_[Reg16::HL]--;
+
+            if constexpr (q == 0) writeAtAddr(address, state_[Reg8::A]);
+            else state_[Reg8::A] = readAtAddr(address);
+        }
+        else if constexpr (z == 3)
+        {
+            if constexpr (q == 0) incWord(state_[operand_pairs[p]]);
+            else decWord(state_[operand_pairs[p]]);
+        }
+        else if constexpr (z == 4)
+        {
+            if constexpr (y == 6) incAddr(state_[Reg16::HL]);
+            else incByte(state_[operand_registers[y]]);
+        }
+        else if constexpr (z == 5)
+        {
+            if constexpr (y == 6) decAddr(state_[Reg16::HL]);
+            else decByte(state_[operand_registers[y]]);
+        }
+        else if constexpr (z == 6) writeOperand<y>(readNextByte());
+        else if constexpr (y == 0) rlca();
+        else if constexpr (y == 1) rrca();
+        else if constexpr (y == 2) rla();
+        else if constexpr (y == 3) rra();
+        else if constexpr (y == 4) daa();
+        else if constexpr (y == 5) cpl();
+        else if constexpr (y == 6) scf();
+        else ccf();
+    }
+
+    // ====== Load block (0x40 - 0x7F) ======
+
+    else if constexpr (Op == 0x76) halt();
+    else if constexpr (x == 1) writeOperand<y>(readOperand<z>());
+
+    // ====== Arithmetic block (0x80 - 0xBF) ======
+
+    else if constexpr (x == 2) aluOperation<y>(readOperand<z>());
+
+    // ====== Last misc block (0xC0 - 0xFF) ======
+
+    else if constexpr (z == 0)
+    {
+        if constexpr (y < 4) ret(checkCondition(y));
+        else if constexpr (y == 4) writeAtAddr(static_cast<Word>(readNextByte()) | 0xFF00, state_[Reg8::A]);
+        else if constexpr (y == 5) addWordSigned(state_[Reg16::SP], readNextByte());
+        else if constexpr (y == 6) state_[Reg8::A] = readAtAddr(static_cast<Word>(readNextByte()) | 0xFF00);
+        else loadAddSigned(state_[Reg16::HL], state_[Reg16::SP], readNextByte());
+    }
+    else if constexpr (z == 1)
+    {
+        if constexpr (q == 0)
+        {
+            if constexpr (p == 3) discardPendingFlags();
+            pop(state_[stack_pairs[p]]);
+            if constexpr (p == 3) state_[Reg8::F] &= 0xF0;
+        }
+        else if constexpr (p == 0) ret();
+        else if constexpr (p == 1) reti();
+        else if constexpr (p == 2) state_[Reg16::PC] = static_cast<Word>(state_[Reg16::HL]);
+        else { state_[Reg16::SP] = static_cast<Word>(state_[Reg16::HL]); clock_.add(4); }
+    }
+    else if constexpr (z == 2)
+    {
+        if constexpr (y < 4) jmp(readNextWord(), checkCondition(y));
+        else if constexpr (y == 4) writeAtAddr(state_[Reg8::C] | 0xFF00, state_[Reg8::A]);
+        else if constexpr (y == 5) writeAtAddr(readNextWord(), state_[Reg8::A]);
+        else if constexpr (y == 6) state_[Reg8::A] = readAtAddr(state_[Reg8::C] | 0xFF00);
+        else state_[Reg8::A] = readAtAddr(readNextWord());
+    }
+    else if constexpr (z == 3)
+    {
+        if constexpr (y == 0) jmp(readNextWord());
+        else if constexpr (y == 1) prefixInstruction(readNextByte());
+        else if constexpr (y == 6) di();
+        else if constexpr (y == 7) ei();
+        else undefinedInstruction();
+    }
+    else if constexpr (z == 4)
+    {
+        if constexpr (y < 4) call(readNextWord(), checkCondition(y));
+        else undefinedInstruction();
+    }
+    else if constexpr (z == 5)
+    {
+        if constexpr (q == 0)
+        {
+            if constexpr (p == 3) materializeFlags();
+            push(state_[stack_pairs[p]]);
+        }
+        else if constexpr (p == 0) call(readNextWord());
+        else undefinedInstruction();
+    }
+    else if constexpr (z == 6) aluOperation<y>(readNextByte());
+    else call(y * 8);
+}
+
+
+template <Byte Op>
+void Cpu::prefixInstruction()
+{
+    constexpr Byte x = Op >> 6;
+    constexpr Byte y = (Op >> 3) & 0x7;
+    constexpr Byte z = Op & 0x7;
+
+    // ====== Bit shifting block (0x00 - 0x3F) ======
+
+    if constexpr (x == 0)
+    {
+        Byte value = readOperand<z>();
+        if constexpr (y == 0) writeOperand<z>(rlc(value));
+        else if constexpr (y == 1) writeOperand<z>(rrc(value));
+        else if constexpr (y == 2) writeOperand<z>(rl(value));
+        else if constexpr (y == 3) writeOperand<z>(rr(value));
+        else if constexpr (y == 4) writeOperand<z>(sla(value));
+        else if constexpr (y == 5) writeOperand<z>(sra(value));
+        else if constexpr (y == 6) writeOperand<z>(swap(value));
+        else writeOperand<z>(srl(value));
+    }
+
+    // ====== Bit check block (0x40 - 0x7F) ======
+
+    else if constexpr (x == 1) bit(readOperand<z>(), y);
+
+    // ====== Bit reset block (0x80 - 0xBF) ======
+
+    else if constexpr (x == 2) writeOperand<z>(res(readOperand<z>(), y));
+
+    // ====== Bit set block (0xC0 - 0xFF) ======
+
+    else writeOperand<z>(set(readOperand<z>(), y));
+}
+
+
+// Expands X(opcode) for every opcode, from 0x00 to 0xFF
+#define GBC_OPCODE_ROW(X, high) \
+    X(high##0) X(high##1) X(high##2) X(high##3) X(high##4) X(high##5) X(high##6) X(high##7) \
+    X(high##8) X(high##9) X(high##A) X(high##B) X(high##C) X(high##D) X(high##E) X(high##F)
+
+#define GBC_FOR_EACH_OPCODE(X) \
+    GBC_OPCODE_ROW(X, 0x0) GBC_OPCODE_ROW(X, 0x1) GBC_OPCODE_ROW(X, 0x2) GBC_OPCODE_ROW(X, 0x3) \
+    GBC_OPCODE_ROW(X, 0x4) GBC_OPCODE_ROW(X, 0x5) GBC_OPCODE_ROW(X, 0x6) GBC_OPCODE_ROW(X, 0x7) \
+    GBC_OPCODE_ROW(X, 0x8) GBC_OPCODE_ROW(X, 0x9) GBC_OPCODE_ROW(X, 0xA) GBC_OPCODE_ROW(X, 0xB) \
+    GBC_OPCODE_ROW(X, 0xC) GBC_OPCODE_ROW(X, 0xD) GBC_OPCODE_ROW(X, 0xE) GBC_OPCODE_ROW(X, 0xF)
+
+
 void Cpu::baseInstruction(Byte inst)
 {
+#define GBC_BASE_CASE(op) case op: baseInstruction<op>(); break;
     switch (inst)
     {
-        // ====== First misc block (0x00 - 0x3F) ======
-
-        case 0x00: break; // no op
-        case 0x01: state_[Reg16::BC] = readNextWord(); break;
-        case 0x02: writeAtAddr(state_[Reg16::BC], state_[Reg8::A]); break;
-        case 0x03: incWord(state_[Reg16::BC]); break;
-        case 0x04: incByte(state_[Reg8::B]); break;
-        case 0x05: decByte(state_[Reg8::B]); break;
-        case 0x06: state_[Reg8::B] = readNextByte(); break;
-        case 0x07: rlca(); break;
-        case 0x08: writeWordAtAddr(readNextWord(), state_[Reg16::SP]); break;
-        case 0x09: addWord(state_[Reg16::HL], state_[Reg16::BC]); break;
-        case 0x0A: state_[Reg8::A] = readAtAddr(state_[Reg16::BC]); break;
-        case 0x0B: decWord(state_[Reg16::BC]); break;
-        case 0x0C: incByte(state_[Reg8::C]); break;
-        case 0x0D: decByte(state_[Reg8::C]); break;
-        case 0x0E: state_[Reg8::C] = readNextByte(); break;
-        case 0x0F: rrca(); break;
-
-        case 0x10: stop(); break;
-        case 0x11: state_[Reg16::DE] = readNextWord(); break;
-        case 0x12: writeAtAddr(state_[Reg16::DE], state_[Reg8::A]); break;
-        case 0x13: incWord(state_[Reg16::DE]); break;
-        case 0x14: incByte(state_[Reg8::D]); break;
-        case 0x15: decByte(state_[Reg8::D]); break;
-        case 0x16: state_[Reg8::D] = readNextByte(); break;
-        case 0x17: rla(); break;
-        case 0x18: jmpRel(readNextByte()); break;
-        case 0x19: addWord(state_[Reg16::HL], state_[Reg16::DE]); break;
-        case 0x1A: state_[Reg8::A] = readAtAddr(state_[Reg16::DE]); break;
-        case 0x1B: decWord(state_[Reg16::DE]); break;
-        case 0x1C: incByte(state_[Reg8::E]); break;
-        case 0x1D: decByte(state_[Reg8::E]); break;
-        case 0x1E: state_[Reg8::E] = readNextByte(); break;
-        case 0x1F: rra(); break;
-
-        case 0x20: jmpRel(readNextByte(), !state_[RegFlag::Z]); break;
-        case 0x21: state_[Reg16::HL] = readNextWord(); break;
-        case 0x22: writeAtAddr(state_[Reg16::HL]++, state_[Reg8::A]); break;
-        case 0x23: incWord(state_[Reg16::HL]); break;
-        case 0x24: incByte(state_[Reg8::H]); break;
-        case 0x25: decByte(state_[Reg8::H]); break;
-        case 0x26: state_[Reg8::H] = readNextByte(); break;
-        case 0x27: daa(); break;
-        case 0x28: jmpRel(readNextByte(), state_[RegFlag::Z]); break;
-        case 0x29: addWord(state_[Reg16::HL], state_[Reg16::HL]); break;
-        case 0x2A: state_[Reg8::A] = readAtAddr(state_[Reg16::HL]++); break;
-        case 0x2B: decWord(state_[Reg16::HL]); break;
-        case 0x2C: incByte(state_[Reg8::L]); break;
-        case 0x2D: decByte(state_[Reg8::L]); break;
-        case 0x2E: state_[Reg8::L] = readNextByte(); break;
-        case 0x2F: cpl(); break;
-
-        case 0x30: jmpRel(readNextByte(), !state_[RegFlag::C]); break;
-        case 0x31: state_[Reg16::SP] = readNextWord(); break;
-        case 0x32: writeAtAddr(state_[Reg16::HL]--, state_[Reg8::A]); break;
-        case 0x33: incWord(state_[Reg16::SP]); break;
-        case 0x34: incAddr(state_[Reg16::HL]); break;
-        case 0x35: decAddr(state_[Reg16::HL]); break;
-        case 0x36: writeAtAddr(state_[Reg16::HL], readNextByte()); break; 
-        case 0x37: scf(); break;
-        case 0x38: jmpRel(readNextByte(), state_[RegFlag::C]); break;
-        case 0x39: addWord(state_[Reg16::HL], state_[Reg16::SP]); break;
-        case 0x3A: state_[Reg8::A] = readAtAddr(state_[Reg16::HL]--); break;
-        case 0x3B: decWord(state_[Reg16::SP]); break;
-        case 0x3C: incByte(state_[Reg8::A]); break;
-        case 0x3D: decByte(state_[Reg8::A]); break;
-        case 0x3E: state_[Reg8::A] = readNextByte(); break;
-        case 0x3F: ccf(); break;
-
-        // ====== Load block (0x40 - 0x7F) ======
-
-        case 0x40: state_[Reg8::B] = state_[Reg8::B]; break;
-        case 0x41: state_[Reg8::B] = state_[Reg8::C]; break;
-        case 0x42: state_[Reg8::B] = state_[Reg8::D]; break;
-        case 0x43: state_[Reg8::B] = state_[Reg8::E]; break;
-        case 0x44: state_[Reg8::B] = state_[Reg8::H]; break;
-        case 0x45: state_[Reg8::B] = state_[Reg8::L]; break;
-        case 0x46: state_[Reg8::B] = readAtAddr(state_[Reg16::HL]); break;
-        case 0x47: state_[Reg8::B] = state_[Reg8::A]; break;
-        case 0x48: state_[Reg8::C] = state_[Reg8::B]; break;
-        case 0x49: state_[Reg8::C] = state_[Reg8::C]; break;
-        case 0x4A: state_[Reg8::C] = state_[Reg8::D]; break;
-        case 0x4B: state_[Reg8::C] = state_[Reg8::E]; break;
-        case 0x4C: state_[Reg8::C] = state_[Reg8::H]; break;
-        case 0x4D: state_[Reg8::C] = state_[Reg8::L]; break;
-        case 0x4E: state_[Reg8::C] = readAtAddr(state_[Reg16::HL]); break;
-        case 0x4F: state_[Reg8::C] = state_[Reg8::A]; break;
-
-        case 0x51: state_[Reg8::D] = state_[Reg8::C]; break;
-        case 0x50: state_[Reg8::D] = state_[Reg8::B]; break;
-        case 0x52: state_[Reg8::D] = state_[Reg8::D]; break;
-        case 0x53: state_[Reg8::D] = state_[Reg8::E]; break;
-        case 0x54: state_[Reg8::D] = state_[Reg8::H]; break;
-        case 0x55: state_[Reg8::D] = state_[Reg8::L]; break;
-        case 0x56: state_[Reg8::D] = readAtAddr(state_[Reg16::HL]); break;
-        case 0x57: state_[Reg8::D] = state_[Reg8::A]; break;
-        case 0x58: state_[Reg8::E] = state_[Reg8::B]; break;
-        case 0x59: state_[Reg8::E] = state_[Reg8::C]; break;
-        case 0x5A: state_[Reg8::E] = state_[Reg8::D]; break;
-        case 0x5B: state_[Reg8::E] = state_[Reg8::E]; break;
-        case 0x5C: state_[Reg8::E] = state_[Reg8::H]; break;
-        case 0x5D: state_[Reg8::E] = state_[Reg8::L]; break;
-        case 0x5E: state_[Reg8::E] = readAtAddr(state_[Reg16::HL]); break;
-        case 0x5F: state_[Reg8::E] = state_[Reg8::A]; break;
-
-        case 0x60: state_[Reg8::H] = state_[Reg8::B]; break;
-        case 0x61: state_[Reg8::H] = state_[Reg8::C]; break;
-        case 0x62: state_[Reg8::H] = state_[Reg8::D]; break;
-        case 0x63: state_[Reg8::H] = state_[Reg8::E]; break;
-        case 0x64: state_[Reg8::H] = state_[Reg8::H]; break;
-        case 0x65: state_[Reg8::H] = state_[Reg8::L]; break;
-        case 0x66: state_[Reg8::H] = readAtAddr(state_[Reg16::HL]); break;
-        case 0x67: state_[Reg8::H] = state_[Reg8::A]; break;
-        case 0x68: state_[Reg8::L] = state_[Reg8::B]; break;
-        case 0x69: state_[Reg8::L] = state_[Reg8::C]; break;
-        case 0x6A: state_[Reg8::L] = state_[Reg8::D]; break;
-        case 0x6B: state_[Reg8::L] = state_[Reg8::E]; break;
-        case 0x6C: state_[Reg8::L] = state_[Reg8::H]; break;
-        case 0x6D: state_[Reg8::L] = state_[Reg8::L]; break;
-        case 0x6E: state_[Reg8::L] = readAtAddr(state_[Reg16::HL]); break;
-        case 0x6F: state_[Reg8::L] = state_[Reg8::A]; break;
-
-        case 0x70: writeAtAddr(state_[Reg16::HL], state_[Reg8::B]); break;
-        case 0x71: writeAtAddr(state_[Reg16::HL], state_[Reg8::C]); break;
-        case 0x72: writeAtAddr(state_[Reg16::HL], state_[Reg8::D]); break;
-        case 0x73: writeAtAddr(state_[Reg16::HL], state_[Reg8::E]); break;
-        case 0x74: writeAtAddr(state_[Reg16::HL], state_[Reg8::H]); break;
-        case 0x75: writeAtAddr(state_[Reg16::HL], state_[Reg8::L]); break;
-        case 0x76: halt(); break;
-        case 0x77: writeAtAddr(state_[Reg16::HL], state_[Reg8::A]); break;
-        case 0x78: state_[Reg8::A] = state_[Reg8::B]; break;
-        case 0x79: state_[Reg8::A] = state_[Reg8::C]; break;
-        case 0x7A: state_[Reg8::A] = state_[Reg8::D]; break;
-        case 0x7B: state_[Reg8::A] = state_[Reg8::E]; break;
-        case 0x7C: state_[Reg8::A] = state_[Reg8::H]; break;
-        case 0x7D: state_[Reg8::A] = state_[Reg8::L]; break;
-        case 0x7E: state_[Reg8::A] = readAtAddr(state_[Reg16::HL]); break;
-        case 0x7F: state_[Reg8::A] = state_[Reg8::A]; break;
-
-        // ====== Arithmetic block (0x80 - 0xBF) ======
-        
-        case 0x80: add(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0x81: add(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0x82: add(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0x83: add(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0x84: add(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0x85: add(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0x86: add(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0x87: add(state_[Reg8::A], state_[Reg8::A]); break;
-        case 0x88: adc(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0x89: adc(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0x8A: adc(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0x8B: adc(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0x8C: adc(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0x8D: adc(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0x8E: adc(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0x8F: adc(state_[Reg8::A], state_[Reg8::A]); break;
-
-        case 0x90: sub(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0x91: sub(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0x92: sub(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0x93: sub(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0x94: sub(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0x95: sub(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0x96: sub(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0x97: sub(state_[Reg8::A], state_[Reg8::A]); break;
-        case 0x98: sbc(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0x99: sbc(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0x9A: sbc(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0x9B: sbc(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0x9C: sbc(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0x9D: sbc(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0x9E: sbc(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0x9F: sbc(state_[Reg8::A], state_[Reg8::A]); break;
-
-        case 0xA0: bitwiseAnd(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0xA1: bitwiseAnd(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0xA2: bitwiseAnd(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0xA3: bitwiseAnd(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0xA4: bitwiseAnd(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0xA5: bitwiseAnd(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0xA6: bitwiseAnd(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0xA7: bitwiseAnd(state_[Reg8::A], state_[Reg8::A]); break;
-        case 0xA8: bitwiseXor(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0xA9: bitwiseXor(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0xAA: bitwiseXor(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0xAB: bitwiseXor(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0xAC: bitwiseXor(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0xAD: bitwiseXor(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0xAE: bitwiseXor(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0xAF: bitwiseXor(state_[Reg8::A], state_[Reg8::A]); break;
-
-        case 0xB0: bitwiseOr(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0xB1: bitwiseOr(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0xB2: bitwiseOr(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0xB3: bitwiseOr(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0xB4: bitwiseOr(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0xB5: bitwiseOr(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0xB6: bitwiseOr(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0xB7: bitwiseOr(state_[Reg8::A], state_[Reg8::A]); break;
-        case 0xB8: cp(state_[Reg8::A], state_[Reg8::B]); break;
-        case 0xB9: cp(state_[Reg8::A], state_[Reg8::C]); break;
-        case 0xBA: cp(state_[Reg8::A], state_[Reg8::D]); break;
-        case 0xBB: cp(state_[Reg8::A], state_[Reg8::E]); break;
-        case 0xBC: cp(state_[Reg8::A], state_[Reg8::H]); break;
-        case 0xBD: cp(state_[Reg8::A], state_[Reg8::L]); break;
-        case 0xBE: cp(state_[Reg8::A], readAtAddr(state_[Reg16::HL])); break;
-        case 0xBF: cp(state_[Reg8::A], state_[Reg8::A]); break;
-
-        // ====== Last misc block (0xC0 - 0xFF) ======
-
-        case 0xC0: ret(!state_[RegFlag::Z]); break;
-        case 0xC1: pop(state_[Reg16::BC]); break;
-        case 0xC2: jmp(readNextWord(), !state_[RegFlag::Z]); break;
-        case 0xC3: jmp(readNextWord()); break;
-        case 0xC4: call(readNextWord(), !state_[RegFlag::Z]); break;
-        case 0xC5: push(state_[Reg16::BC]); break;
-        case 0xC6: add(state_[Reg8::A], readNextByte()); break;
-        case 0xC7: call(0x0000); break;
-        case 0xC8: ret(state_[RegFlag::Z]); break;
-        case 0xC9: ret(); break;
-        case 0xCA: jmp(readNextWord(), state_[RegFlag::Z]); break;
-        case 0xCB: prefixInstruction(readNextByte()); break;
-        case 0xCC: call(readNextWord(), state_[RegFlag::Z]); break;
-        case 0xCD: call(readNextWord()); break;
-        case 0xCE: adc(state_[Reg8::A], readNextByte()); break;
-        case 0xCF: call(0x0008); break;
-
-        case 0xD0: ret(!state_[RegFlag::C]); break;
-        case 0xD1: pop(state_[Reg16::DE]); break;
-        case 0xD2: jmp(readNextWord(), !state_[RegFlag::C]); break;
-        case 0xD3: undefinedInstruction(); break;
-        case 0xD4: call(readNextWord(), !state_[RegFlag::C]); break;
-        case 0xD5: push(state_[Reg16::DE]); break;
-        case 0xD6: sub(state_[Reg8::A], readNextByte()); break;
-        case 0xD7: call(0x0010); break;
-        case 0xD8: ret(state_[RegFlag::C]); break;
-        case 0xD9: reti(); break;
-        case 0xDA: jmp(readNextWord(), state_[RegFlag::C]); break;
-        case 0xDB: undefinedInstruction(); break;
-        case 0xDC: call(readNextWord(), state_[RegFlag::C]); break;
-        case 0xDD: undefinedInstruction(); break;
-        case 0xDE: sbc(state_[Reg8::A], readNextByte()); break;
-        case 0xDF: call(0x0018); break;
-
-        case 0xE0: writeAtAddr(static_cast<Word>(readNextByte()) | 0xFF00, state_[Reg8::A]); break;
-        case 0xE1: pop(state_[Reg16::HL]); break;
-        case 0xE2: writeAtAddr(state_[Reg8::C] | 0xFF00, state_[Reg8::A]); break;
-        case 0xE3: undefinedInstruction(); break;
-        case 0xE4: undefinedInstruction(); break;
-        case 0xE5: push(state_[Reg16::HL]); break;
-        case 0xE6: bitwiseAnd(state_[Reg8::A], readNextByte()); break;
-        case 0xE7: call(0x0020); break;
-        case 0xE8: addWordSigned(state_[Reg16::SP], readNextByte()); break;
-        case 0xE9: state_[Reg16::PC] = static_cast<Word>(state_[Reg16::HL]); break;
-        case 0xEA: writeAtAddr(readNextWord(), state_[Reg8::A]); break;
-        case 0xEB: undefinedInstruction(); break;
-        case 0xEC: undefinedInstruction(); break;
-        case 0xED: undefinedInstruction(); break;
-        case 0xEE: bitwiseXor(state_[Reg8::A], readNextByte()); break;
-        case 0xEF: call(0x0028); break;
-
-        case 0xF0: state_[Reg8::A] = readAtAddr(static_cast<Word>(readNextByte()) | 0xFF00); break;
-        case 0xF1: pop(state_[Reg16::AF]); state_[Reg8::F] &= 0xF0; break;
-        case 0xF2: state_[Reg8::A] = readAtAddr(state_[Reg8::C] | 0xFF00); break;
-        case 0xF3: di(); break;
-        case 0xF4: undefinedInstruction(); break;
-        case 0xF5: push(state_[Reg16::AF]); break;
-        case 0xF6: bitwiseOr(state_[Reg8::A], readNextByte()); break;
-        case 0xF7: call(0x0030); break;
-        case 0xF8: loadAddSigned(state_[Reg16::HL], state_[Reg16::SP], readNextByte()); break;
-        case 0xF9: state_[Reg16::SP] = static_cast<Word>(state_[Reg16::HL]); clock_.add(4); break;
-        case 0xFA: state_[Reg8::A] = readAtAddr(readNextWord()); break;
-        case 0xFB: ei(); break;
-        case 0xFC: undefinedInstruction(); break;
-        case 0xFD: undefinedInstruction(); break;
-        case 0xFE: cp(state_[Reg8::A], readNextByte()); break;
-        case 0xFF: call(0x0038); break;
-
-        default: break;
+        GBC_FOR_EACH_OPCODE(GBC_BASE_CASE)
     }
+#undef GBC_BASE_CASE
 }
 
+
 void Cpu::prefixInstruction(Byte inst)
 {
-    switch(inst)
+    static constexpr auto prefix_table = []<std::size_t... Ops>(std::index_sequence<Ops...>) {
+        return std::array<InstructionHandler, 256>{&prefixHandler<static_cast<Byte>(Ops)>...};
+    }(std::make_index_sequence<256>{});
+
+    prefix_table[inst](*this);
+}
+
+
+template <unsigned Features>
+void Cpu::runSwitch(TCycleCount target_cycle)
+{
+    while (prepareInstruction<Features>(target_cycle))
+        baseInstruction(readNextByte());
+}
+
+
+Cpu::InstructionHandler Cpu::getBaseHandler(Byte inst)
+{
+    static constexpr auto base_table = []<std::size_t... Ops>(std::index_sequence<Ops...>) {
+        return std::array<InstructionHandler, 256>{&baseHandler<static_cast<Byte>(Ops)>...};
+    }(std::make_index_sequence<256>{});
+
+    return base_table[inst];
+}
+
+
+template <unsigned Features>
+void Cpu::runTable(TCycleCount target_cycle)
+{
+    while (prepareInstruction<Features>(target_cycle))
+        getBaseHandler(readNextByte())(*this);
+}
+
+
+// Every handler ends with its own copy of the dispatch jump, so the branch predictor
+// gets one history per opcode instead of a single shared indirect jump.
+template <unsigned Features>
+void Cpu::runThreaded(TCycleCount target_cycle)
+{
+#if GBC_HAS_COMPUTED_GOTO
+#define GBC_LABEL_ADDRESS(op) &&base_##op,
+    static void* const labels[256] = { GBC_FOR_EACH_OPCODE(GBC_LABEL_ADDRESS) };
+#undef GBC_LABEL_ADDRESS
+
+#define GBC_DISPATCH()                                       \
+    if (!prepareInstruction<Features>(target_cycle))    \
+        return;                                              \
+    goto *labels[readNextByte()];
+
+    GBC_DISPATCH()
+
+#define GBC_LABEL(op) base_##op: baseInstruction<op>(); GBC_DISPATCH()
+    GBC_FOR_EACH_OPCODE(GBC_LABEL)
+#undef GBC_LABEL
+#undef GBC_DISPATCH
+#else
+    runTable<Features>(target_cycle);
+#endif
+}
+
+// Only the memory regions without side effects on read can be cached,
+// a block can't cross the end of its region as the next one may be banked differently.
+static constexpr uint32_t cacheableRegionEnd(Word address)
+{
+    if (address < 0x4000) return 0x4000;
+    if (address < 0x8000) return 0x8000;
+    if (address < 0xC000) return 0;
+    if (address < 0xD000) return 0xD000;
+    if (address < 0xE000) return 0xE000;
+    if (address < 0xFF80) return 0;
+    return 0xFFFF;
+}
+
+
+// Instructions that may not continue to the next address
+static constexpr bool endsBlock(Byte inst)
+{
+    switch (inst)
     {
-        // ====== Bit shifting block (0x00 - 0x3F) ======
-
-        case 0x00: state_[Reg8::B] = rlc(state_[Reg8::B]); break;
-        case 0x01: state_[Reg8::C] = rlc(state_[Reg8::C]); break;
-        case 0x02: state_[Reg8::D] = rlc(state_[Reg8::D]); break;
-        case 0x03: state_[Reg8::E] = rlc(state_[Reg8::E]); break;
-        case 0x04: state_[Reg8::H] = rlc(state_[Reg8::H]); break;
-        case 0x05: state_[Reg8::L] = rlc(state_[Reg8::L]); break;
-        case 0x06: writeAtAddr(state_[Reg16::HL], rlc(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x07: state_[Reg8::A] = rlc(state_[Reg8::A]); break;
-        case 0x08: state_[Reg8::B] = rrc(state_[Reg8::B]); break;
-        case 0x09: state_[Reg8::C] = rrc(state_[Reg8::C]); break;
-        case 0x0A: state_[Reg8::D] = rrc(state_[Reg8::D]); break;
-        case 0x0B: state_[Reg8::E] = rrc(state_[Reg8::E]); break;
-        case 0x0C: state_[Reg8::H] = rrc(state_[Reg8::H]); break;
-        case 0x0D: state_[Reg8::L] = rrc(state_[Reg8::L]); break;
-        case 0x0E: writeAtAddr(state_[Reg16::HL], rrc(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x0F: state_[Reg8::A] = rrc(state_[Reg8::A]); break;
-
-        case 0x10: state_[Reg8::B] = rl(state_[Reg8::B]); break;
-        case 0x11: state_[Reg8::C] = rl(state_[Reg8::C]); break;
-        case 0x12: state_[Reg8::D] = rl(state_[Reg8::D]); break;
-        case 0x13: state_[Reg8::E] = rl(state_[Reg8::E]); break;
-        case 0x14: state_[Reg8::H] = rl(state_[Reg8::H]); break;
-        case 0x15: state_[Reg8::L] = rl(state_[Reg8::L]); break;
-        case 0x16: writeAtAddr(state_[Reg16::HL], rl(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x17: state_[Reg8::A] = rl(state_[Reg8::A]); break;
-        case 0x18: state_[Reg8::B] = rr(state_[Reg8::B]); break;
-        case 0x19: state_[Reg8::C] = rr(state_[Reg8::C]); break;
-        case 0x1A: state_[Reg8::D] = rr(state_[Reg8::D]); break;
-        case 0x1B: state_[Reg8::E] = rr(state_[Reg8::E]); break;
-        case 0x1C: state_[Reg8::H] = rr(state_[Reg8::H]); break;
-        case 0x1D: state_[Reg8::L] = rr(state_[Reg8::L]); break;
-        case 0x1E: writeAtAddr(state_[Reg16::HL], rr(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x1F: state_[Reg8::A] = rr(state_[Reg8::A]); break;
-
-        case 0x20: state_[Reg8::B] = sla(state_[Reg8::B]); break;
-        case 0x21: state_[Reg8::C] = sla(state_[Reg8::C]); break;
-        case 0x22: state_[Reg8::D] = sla(state_[Reg8::D]); break;
-        case 0x23: state_[Reg8::E] = sla(state_[Reg8::E]); break;
-        case 0x24: state_[Reg8::H] = sla(state_[Reg8::H]); break;
-        case 0x25: state_[Reg8::L] = sla(state_[Reg8::L]); break;
-        case 0x26: writeAtAddr(state_[Reg16::HL], sla(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x27: state_[Reg8::A] = sla(state_[Reg8::A]); break;
-        case 0x28: state_[Reg8::B] = sra(state_[Reg8::B]); break;
-        case 0x29: state_[Reg8::C] = sra(state_[Reg8::C]); break;
-        case 0x2A: state_[Reg8::D] = sra(state_[Reg8::D]); break;
-        case 0x2B: state_[Reg8::E] = sra(state_[Reg8::E]); break;
-        case 0x2C: state_[Reg8::H] = sra(state_[Reg8::H]); break;
-        case 0x2D: state_[Reg8::L] = sra(state_[Reg8::L]); break;
-        case 0x2E: writeAtAddr(state_[Reg16::HL], sra(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x2F: state_[Reg8::A] = sra(state_[Reg8::A]); break;
-
-        case 0x30: state_[Reg8::B] = swap(state_[Reg8::B]); break;
-        case 0x31: state_[Reg8::C] = swap(state_[Reg8::C]); break;
-        case 0x32: state_[Reg8::D] = swap(state_[Reg8::D]); break;
-        case 0x33: state_[Reg8::E] = swap(state_[Reg8::E]); break;
-        case 0x34: state_[Reg8::H] = swap(state_[Reg8::H]); break;
-        case 0x35: state_[Reg8::L] = swap(state_[Reg8::L]); break;
-        case 0x36: writeAtAddr(state_[Reg16::HL], swap(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x37: state_[Reg8::A] = swap(state_[Reg8::A]); break;
-        case 0x38: state_[Reg8::B] = srl(state_[Reg8::B]); break;
-        case 0x39: state_[Reg8::C] = srl(state_[Reg8::C]); break;
-        case 0x3A: state_[Reg8::D] = srl(state_[Reg8::D]); break;
-        case 0x3B: state_[Reg8::E] = srl(state_[Reg8::E]); break;
-        case 0x3C: state_[Reg8::H] = srl(state_[Reg8::H]); break;
-        case 0x3D: state_[Reg8::L] = srl(state_[Reg8::L]); break;
-        case 0x3E: writeAtAddr(state_[Reg16::HL], srl(readAtAddr(state_[Reg16::HL]))); break;
-        case 0x3F: state_[Reg8::A] = srl(state_[Reg8::A]); break;
-
-        // ====== Bit check block (0x40 - 0x7F) ======
-
-        case 0x40: bit(state_[Reg8::B], 0); break;
-        case 0x41: bit(state_[Reg8::C], 0); break;
-        case 0x42: bit(state_[Reg8::D], 0); break;
-        case 0x43: bit(state_[Reg8::E], 0); break;
-        case 0x44: bit(state_[Reg8::H], 0); break;
-        case 0x45: bit(state_[Reg8::L], 0); break;
-        case 0x46: bit(readAtAddr(state_[Reg16::HL]), 0); break;
-        case 0x47: bit(state_[Reg8::A], 0); break;
-        case 0x48: bit(state_[Reg8::B], 1); break;
-        case 0x49: bit(state_[Reg8::C], 1); break;
-        case 0x4A: bit(state_[Reg8::D], 1); break;
-        case 0x4B: bit(state_[Reg8::E], 1); break;
-        case 0x4C: bit(state_[Reg8::H], 1); break;
-        case 0x4D: bit(state_[Reg8::L], 1); break;
-        case 0x4E: bit(readAtAddr(state_[Reg16::HL]), 1); break;
-        case 0x4F: bit(state_[Reg8::A], 1); break;
-
-        case 0x50: bit(state_[Reg8::B], 2); break;
-        case 0x51: bit(state_[Reg8::C], 2); break;
-        case 0x52: bit(state_[Reg8::D], 2); break;
-        case 0x53: bit(state_[Reg8::E], 2); break;
-        case 0x54: bit(state_[Reg8::H], 2); break;
-        case 0x55: bit(state_[Reg8::L], 2); break;
-        case 0x56: bit(readAtAddr(state_[Reg16::HL]), 2); break;
-        case 0x57: bit(state_[Reg8::A], 2); break;
-        case 0x58: bit(state_[Reg8::B], 3); break;
-        case 0x59: bit(state_[Reg8::C], 3); break;
-        case 0x5A: bit(state_[Reg8::D], 3); break;
-        case 0x5B: bit(state_[Reg8::E], 3); break;
-        case 0x5C: bit(state_[Reg8::H], 3); break;
-        case 0x5D: bit(state_[Reg8::L], 3); break;
-        case 0x5E: bit(readAtAddr(state_[Reg16::HL]), 3); break;
-        case 0x5F: bit(state_[Reg8::A], 3); break;
-        
-        case 0x60: bit(state_[Reg8::B], 4); break;
-        case 0x61: bit(state_[Reg8::C], 4); break;
-        case 0x62: bit(state_[Reg8::D], 4); break;
-        case 0x63: bit(state_[Reg8::E], 4); break;
-        case 0x64: bit(state_[Reg8::H], 4); break;
-        case 0x65: bit(state_[Reg8::L], 4); break;
-        case 0x66: bit(readAtAddr(state_[Reg16::HL]), 4); break;
-        case 0x67: bit(state_[Reg8::A], 4); break;
-        case 0x68: bit(state_[Reg8::B], 5); break;
-        case 0x69: bit(state_[Reg8::C], 5); break;
-        case 0x6A: bit(state_[Reg8::D], 5); break;
-        case 0x6B: bit(state_[Reg8::E], 5); break;
-        case 0x6C: bit(state_[Reg8::H], 5); break;
-        case 0x6D: bit(state_[Reg8::L], 5); break;
-        case 0x6E: bit(readAtAddr(state_[Reg16::HL]), 5); break;
-        case 0x6F: bit(state_[Reg8::A], 5); break;
-
-        case 0x70: bit(state_[Reg8::B], 6); break;
-        case 0x71: bit(state_[Reg8::C], 6); break;
-        case 0x72: bit(state_[Reg8::D], 6); break;
-        case 0x73: bit(state_[Reg8::E], 6); break;
-        case 0x74: bit(state_[Reg8::H], 6); break;
-        case 0x75: bit(state_[Reg8::L], 6); break;
-        case 0x76: bit(readAtAddr(state_[Reg16::HL]), 6); break;
-        case 0x77: bit(state_[Reg8::A], 6); break;
-        case 0x78: bit(state_[Reg8::B], 7); break;
-        case 0x79: bit(state_[Reg8::C], 7); break;
-        case 0x7A: bit(state_[Reg8::D], 7); break;
-        case 0x7B: bit(state_[Reg8::E], 7); break;
-        case 0x7C: bit(state_[Reg8::H], 7); break;
-        case 0x7D: bit(state_[Reg8::L], 7); break;
-        case 0x7E: bit(readAtAddr(state_[Reg16::HL]), 7); break;
-        case 0x7F: bit(state_[Reg8::A], 7); break;
-
-        // ====== Bit reset block (0x80 - 0xBF) ======
-
-        case 0x80: state_[Reg8::B] = res(state_[Reg8::B], 0); break;
-        case 0x81: state_[Reg8::C] = res(state_[Reg8::C], 0); break;
-        case 0x82: state_[Reg8::D] = res(state_[Reg8::D], 0); break;
-        case 0x83: state_[Reg8::E] = res(state_[Reg8::E], 0); break;
-        case 0x84: state_[Reg8::H] = res(state_[Reg8::H], 0); break;
-        case 0x85: state_[Reg8::L] = res(state_[Reg8::L], 0); break;
-        case 0x86: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 0)); break;
-        case 0x87: state_[Reg8::A] = res(state_[Reg8::A], 0); break;
-        case 0x88: state_[Reg8::B] = res(state_[Reg8::B], 1); break;
-        case 0x89: state_[Reg8::C] = res(state_[Reg8::C], 1); break;
-        case 0x8A: state_[Reg8::D] = res(state_[Reg8::D], 1); break;
-        case 0x8B: state_[Reg8::E] = res(state_[Reg8::E], 1); break;
-        case 0x8C: state_[Reg8::H] = res(state_[Reg8::H], 1); break;
-        case 0x8D: state_[Reg8::L] = res(state_[Reg8::L], 1); break;
-        case 0x8E: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 1)); break;
-        case 0x8F: state_[Reg8::A] = res(state_[Reg8::A], 1); break;
-
-        case 0x90: state_[Reg8::B] = res(state_[Reg8::B], 2); break;
-        case 0x91: state_[Reg8::C] = res(state_[Reg8::C], 2); break;
-        case 0x92: state_[Reg8::D] = res(state_[Reg8::D], 2); break;
-        case 0x93: state_[Reg8::E] = res(state_[Reg8::E], 2); break;
-        case 0x94: state_[Reg8::H] = res(state_[Reg8::H], 2); break;
-        case 0x95: state_[Reg8::L] = res(state_[Reg8::L], 2); break;
-        case 0x96: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 2)); break;
-        case 0x97: state_[Reg8::A] = res(state_[Reg8::A], 2); break;
-        case 0x98: state_[Reg8::B] = res(state_[Reg8::B], 3); break;
-        case 0x99: state_[Reg8::C] = res(state_[Reg8::C], 3); break;
-        case 0x9A: state_[Reg8::D] = res(state_[Reg8::D], 3); break;
-        case 0x9B: state_[Reg8::E] = res(state_[Reg8::E], 3); break;
-        case 0x9C: state_[Reg8::H] = res(state_[Reg8::H], 3); break;
-        case 0x9D: state_[Reg8::L] = res(state_[Reg8::L], 3); break;
-        case 0x9E: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 3)); break;
-        case 0x9F: state_[Reg8::A] = res(state_[Reg8::A], 3); break;
-        
-        case 0xA0: state_[Reg8::B] = res(state_[Reg8::B], 4); break;
-        case 0xA1: state_[Reg8::C] = res(state_[Reg8::C], 4); break;
-        case 0xA2: state_[Reg8::D] = res(state_[Reg8::D], 4); break;
-        case 0xA3: state_[Reg8::E] = res(state_[Reg8::E], 4); break;
-        case 0xA4: state_[Reg8::H] = res(state_[Reg8::H], 4); break;
-        case 0xA5: state_[Reg8::L] = res(state_[Reg8::L], 4); break;
-        case 0xA6: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 4)); break;
-        case 0xA7: state_[Reg8::A] = res(state_[Reg8::A], 4); break;
-        case 0xA8: state_[Reg8::B] = res(state_[Reg8::B], 5); break;
-        case 0xA9: state_[Reg8::C] = res(state_[Reg8::C], 5); break;
-        case 0xAA: state_[Reg8::D] = res(state_[Reg8::D], 5); break;
-        case 0xAB: state_[Reg8::E] = res(state_[Reg8::E], 5); break;
-        case 0xAC: state_[Reg8::H] = res(state_[Reg8::H], 5); break;
-        case 0xAD: state_[Reg8::L] = res(state_[Reg8::L], 5); break;
-        case 0xAE: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 5)); break;
-        case 0xAF: state_[Reg8::A] = res(state_[Reg8::A], 5); break;
-
-        case 0xB0: state_[Reg8::B] = res(state_[Reg8::B], 6); break;
-        case 0xB1: state_[Reg8::C] = res(state_[Reg8::C], 6); break;
-        case 0xB2: state_[Reg8::D] = res(state_[Reg8::D], 6); break;
-        case 0xB3: state_[Reg8::E] = res(state_[Reg8::E], 6); break;
-        case 0xB4: state_[Reg8::H] = res(state_[Reg8::H], 6); break;
-        case 0xB5: state_[Reg8::L] = res(state_[Reg8::L], 6); break;
-        case 0xB6: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 6)); break;
-        case 0xB7: state_[Reg8::A] = res(state_[Reg8::A], 6); break;
-        case 0xB8: state_[Reg8::B] = res(state_[Reg8::B], 7); break;
-        case 0xB9: state_[Reg8::C] = res(state_[Reg8::C], 7); break;
-        case 0xBA: state_[Reg8::D] = res(state_[Reg8::D], 7); break;
-        case 0xBB: state_[Reg8::E] = res(state_[Reg8::E], 7); break;
-        case 0xBC: state_[Reg8::H] = res(state_[Reg8::H], 7); break;
-        case 0xBD: state_[Reg8::L] = res(state_[Reg8::L], 7); break;
-        case 0xBE: writeAtAddr(state_[Reg16::HL], res(readAtAddr(state_[Reg16::HL]), 7)); break;
-        case 0xBF: state_[Reg8::A] = res(state_[Reg8::A], 7); break;
-
-        // ====== Bit set block (0xC0 - 0xFF) ======
-
-        case 0xC0: state_[Reg8::B] = set(state_[Reg8::B], 0); break;
-        case 0xC1: state_[Reg8::C] = set(state_[Reg8::C], 0); break;
-        case 0xC2: state_[Reg8::D] = set(state_[Reg8::D], 0); break;
-        case 0xC3: state_[Reg8::E] = set(state_[Reg8::E], 0); break;
-        case 0xC4: state_[Reg8::H] = set(state_[Reg8::H], 0); break;
-        case 0xC5: state_[Reg8::L] = set(state_[Reg8::L], 0); break;
-        case 0xC6: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 0)); break;
-        case 0xC7: state_[Reg8::A] = set(state_[Reg8::A], 0); break;
-        case 0xC8: state_[Reg8::B] = set(state_[Reg8::B], 1); break;
-        case 0xC9: state_[Reg8::C] = set(state_[Reg8::C], 1); break;
-        case 0xCA: state_[Reg8::D] = set(state_[Reg8::D], 1); break;
-        case 0xCB: state_[Reg8::E] = set(state_[Reg8::E], 1); break;
-        case 0xCC: state_[Reg8::H] = set(state_[Reg8::H], 1); break;
-        case 0xCD: state_[Reg8::L] = set(state_[Reg8::L], 1); break;
-        case 0xCE: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 1)); break;
-        case 0xCF: state_[Reg8::A] = set(state_[Reg8::A], 1); break;
-
-        case 0xD0: state_[Reg8::B] = set(state_[Reg8::B], 2); break;
-        case 0xD1: state_[Reg8::C] = set(state_[Reg8::C], 2); break;
-        case 0xD2: state_[Reg8::D] = set(state_[Reg8::D], 2); break;
-        case 0xD3: state_[Reg8::E] = set(state_[Reg8::E], 2); break;
-        case 0xD4: state_[Reg8::H] = set(state_[Reg8::H], 2); break;
-        case 0xD5: state_[Reg8::L] = set(state_[Reg8::L], 2); break;
-        case 0xD6: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 2)); break;
-        case 0xD7: state_[Reg8::A] = set(state_[Reg8::A], 2); break;
-        case 0xD8: state_[Reg8::B] = set(state_[Reg8::B], 3); break;
-        case 0xD9: state_[Reg8::C] = set(state_[Reg8::C], 3); break;
-        case 0xDA: state_[Reg8::D] = set(state_[Reg8::D], 3); break;
-        case 0xDB: state_[Reg8::E] = set(state_[Reg8::E], 3); break;
-        case 0xDC: state_[Reg8::H] = set(state_[Reg8::H], 3); break;
-        case 0xDD: state_[Reg8::L] = set(state_[Reg8::L], 3); break;
-        case 0xDE: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 3)); break;
-        case 0xDF: state_[Reg8::A] = set(state_[Reg8::A], 3); break;
-        
-        case 0xE0: state_[Reg8::B] = set(state_[Reg8::B], 4); break;
-        case 0xE1: state_[Reg8::C] = set(state_[Reg8::C], 4); break;
-        case 0xE2: state_[Reg8::D] = set(state_[Reg8::D], 4); break;
-        case 0xE3: state_[Reg8::E] = set(state_[Reg8::E], 4); break;
-        case 0xE4: state_[Reg8::H] = set(state_[Reg8::H], 4); break;
-        case 0xE5: state_[Reg8::L] = set(state_[Reg8::L], 4); break;
-        case 0xE6: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 4)); break;
-        case 0xE7: state_[Reg8::A] = set(state_[Reg8::A], 4); break;
-        case 0xE8: state_[Reg8::B] = set(state_[Reg8::B], 5); break;
-        case 0xE9: state_[Reg8::C] = set(state_[Reg8::C], 5); break;
-        case 0xEA: state_[Reg8::D] = set(state_[Reg8::D], 5); break;
-        case 0xEB: state_[Reg8::E] = set(state_[Reg8::E], 5); break;
-        case 0xEC: state_[Reg8::H] = set(state_[Reg8::H], 5); break;
-        case 0xED: state_[Reg8::L] = set(state_[Reg8::L], 5); break;
-        case 0xEE: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 5)); break;
-        case 0xEF: state_[Reg8::A] = set(state_[Reg8::A], 5); break;
-
-        case 0xF0: state_[Reg8::B] = set(state_[Reg8::B], 6); break;
-        case 0xF1: state_[Reg8::C] = set(state_[Reg8::C], 6); break;
-        case 0xF2: state_[Reg8::D] = set(state_[Reg8::D], 6); break;
-        case 0xF3: state_[Reg8::E] = set(state_[Reg8::E], 6); break;
-        case 0xF4: state_[Reg8::H] = set(state_[Reg8::H], 6); break;
-        case 0xF5: state_[Reg8::L] = set(state_[Reg8::L], 6); break;
-        case 0xF6: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 6)); break;
-        case 0xF7: state_[Reg8::A] = set(state_[Reg8::A], 6); break;
-        case 0xF8: state_[Reg8::B] = set(state_[Reg8::B], 7); break;
-        case 0xF9: state_[Reg8::C] = set(state_[Reg8::C], 7); break;
-        case 0xFA: state_[Reg8::D] = set(state_[Reg8::D], 7); break;
-        case 0xFB: state_[Reg8::E] = set(state_[Reg8::E], 7); break;
-        case 0xFC: state_[Reg8::H] = set(state_[Reg8::H], 7); break;
-        case 0xFD: state_[Reg8::L] = set(state_[Reg8::L], 7); break;
-        case 0xFE: writeAtAddr(state_[Reg16::HL], set(readAtAddr(state_[Reg16::HL]), 7)); break;
-        case 0xFF: state_[Reg8::A] = set(state_[Reg8::A], 7); break;
+        case 0x10: case 0x76:                                  // stop, halt
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // jr
+        case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: // jp
+        case 0xE9:                                             // jp hl
+        case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // call
+        case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: // ret
+        case 0xD9:                                             // reti
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF:            // rst
+        case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: // undefined
+        case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC:
+        case 0xFD:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+static constexpr std::array<Byte, 256> instruction_length = {
+    1,3,1,1, 1,1,2,1, 3,1,1,1, 1,1,2,1,
+    2,3,1,1, 1,1,2,1, 2,1,1,1, 1,1,2,1,
+    2,3,1,1, 1,1,2,1, 2,1,1,1, 1,1,2,1,
+    2,3,1,1, 1,1,2,1, 2,1,1,1, 1,1,2,1,
+
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+    1,1,1,1, 1,1,1,1, 1,1,1,1, 1,1,1,1,
+
+    1,1,3,3, 3,1,2,1, 1,1,3,2, 3,3,2,1,
+    1,1,3,1, 3,1,2,1, 1,1,3,1, 3,1,2,1,
+    2,1,1,1, 1,1,2,1, 2,1,3,1, 1,1,2,1,
+    2,1,1,1, 1,1,2,1, 2,1,3,1, 1,1,2,1
+};
+
+static constexpr size_t max_block_length = 64;
+
+
+const CodeCache::Block* Cpu::decodeBlock(Word address)
+{
+    uint32_t region_end = cacheableRegionEnd(address);
+    if (!region_end)
+        return nullptr;
+
+    uint32_t key = CodeCache::makeKey(address, bus_.getBank(address));
+    if (const CodeCache::Block* block = code_cache_.find(key))
+        return block;
+
+    // Decoding reads memory without going through the clock, it has no side effects here
+    CodeCache::Block block;
+    uint32_t next_address = address;
+    while (block.instructions.size() < max_block_length)
+    {
+        Byte inst = bus_.loadDirect(static_cast<Word>(next_address));
+        Byte length = instruction_length[inst];
+        if (next_address + length > region_end)
+            break;
+
+        CodeCache::DecodedInstruction decoded{getBaseHandler(inst), static_cast<Word>(next_address), inst, {}};
+        for (Byte i = 1; i < length; ++i)
+            decoded.operands[i - 1] = bus_.loadDirect(static_cast<Word>(next_address + i));
+        block.instructions.push_back(decoded);
+
+        next_address += length;
+        if (endsBlock(inst))
+            break;
+    }
+
+    if (block.instructions.empty())
+        return nullptr;
+
+    block.first_page = static_cast<Byte>(address >> 8);
+    block.last_page = static_cast<Byte>((next_address - 1) >> 8);
+    if (dispatch_mode_ == DispatchMode::Jit)
+        compileBlock(block);
+    return &code_cache_.insert(key, std::move(block));
+}
+
+
+// Compiles every run of at least two register-only instructions of the block
+void Cpu::compileBlock([[maybe_unused]] CodeCache::Block& block)
+{
+#if GBC_HAS_JIT
+    if (!jit_)
+        return;
+
+    auto& instructions = block.instructions;
+    for (size_t start = 0; start < instructions.size();)
+    {
+        size_t end = start;
+        unsigned cycles = 0;
+        while (end < instructions.size())
+        {
+            unsigned inst_cycles = JitCompiler::getCompiledCycles(instructions[end]);
+            if (!inst_cycles)
+                break;
+            cycles += inst_cycles;
+            ++end;
+        }
+
+        if (end - start >= 2)
+        {
+            std::span<const CodeCache::DecodedInstruction> run{&instructions[start], end - start};
+            CodeCache::NativeRun native = jit_->compile(run);
+            if (!native)
+            {
+                // The code buffer is full, everything compiled so far goes with it
+                code_cache_.clear();
+                jit_->reset();
+                native = jit_->compile(run);
+            }
+
+            const CodeCache::DecodedInstruction& last = instructions[end - 1];
+            instructions[start].native = native;
+            instructions[start].native_length = static_cast<Byte>(end - start);
+            instructions[start].native_cycles = static_cast<uint16_t>(cycles);
+            instructions[start].native_end_address =
+                static_cast<Word>(last.address + instruction_length[last.opcode]);
+        }
+        start = end + 1;
     }
+#endif
 }
 
+
+// A compiled run can't stop halfway, so it only runs when the interpreter
+// wouldn't have stopped or been interrupted before its end either.
+template <unsigned Features>
+bool Cpu::canRunNative(TCycleCount cycles, TCycleCount target_cycle)
+{
+    // Native runs don't stop between instructions
+    if constexpr (Features != 0)
+        return false;
+
+    TCycleCount end_cycle = clock_.get() + clock_.fromCpuCycles(cycles);
+    if (end_cycle > target_cycle)
+        return false;
+    // No instruction of the run may start once an interrupt is pending
+    return !state_.ime || end_cycle <= interrupts_.getPendingDeadline();
+}
+
+
+// Opcodes are fetched from decoded blocks instead of the bus, the clock still
+// advances for every fetch so timings are unchanged.
+template <unsigned Features>
+void Cpu::runCached(TCycleCount target_cycle)
+{
+    bool is_ready = prepareInstruction<Features>(target_cycle);
+    while (is_ready)
+    {
+        const CodeCache::Block* block = decodeBlock(state_[Reg16::PC]);
+        if (!block)
+        {
+            getBaseHandler(readNextByte())(*this);
+            is_ready = prepareInstruction<Features>(target_cycle);
+            continue;
+        }
+
+        uint32_t generation = code_cache_.getGeneration();
+        const auto& instructions = block->instructions;
+        for (size_t i = 0; i < instructions.size(); ++i)
+        {
+            const CodeCache::DecodedInstruction& inst = instructions[i];
+
+            // Interrupts, jumps not taken by the block or writes to its code end it early
+            if (state_[Reg16::PC] != inst.address || code_cache_.getGeneration() != generation)
+                break;
+
+            if (inst.native && canRunNative<Features>(inst.native_cycles, target_cycle))
+            {
+                materializeFlags();
+                inst.native(state_.data());
+                clock_.add(inst.native_cycles);
+                state_[Reg16::PC] = inst.native_end_address;
+                i += inst.native_length - 1u;
+            }
+            else
+            {
+                clock_.add(4);
+                ++state_[Reg16::PC];
+                prefetched_operands_ = inst.operands.data();
+                inst.handler(*this);
+                prefetched_operands_ = nullptr;
+            }
+
+            is_ready = prepareInstruction<Features>(target_cycle);
+            if (!is_ready)
+                return;
+        }
+    }
+}
+
+
+// Recognizes loops made of a single I/O register load into A, followed by operations only
+// reading A and constant registers, and the backward jump:
+//     ldh a, (n) / ld a, (nn)
+//     cp/and/or/xor d8, cp/and/or/xor r, bit b, a (up to the jump)
+//     jr cc, loop
+// When the register hasn't changed since the previous iteration, each iteration ends in the
+// same state, so the clock can skip whole iterations until the register changes.
+void Cpu::skipIdleLoop(Word jump_end)
+{
+    TCycleCount now = clock_.get();
+    bool is_full_iteration = last_loop_jump_ == jump_end;
+    TCycleCount iteration_start = last_loop_jump_time_;
+    last_loop_jump_ = jump_end;
+    last_loop_jump_time_ = now;
+
+    if (!is_full_iteration || breakpoint_count_ || trace_callback_ || has_watchpoints_)
+        return;
+
+    Word address = state_[Reg16::PC];
+    uint32_t region_end = cacheableRegionEnd(address);
+    if (!region_end || jump_end > region_end || jump_end < address + 4)
+        return;
+
+    // The register load comes first, reading on its last M-cycle
+    Word io_address;
+    TCycleCount read_offset;
+    switch (bus_.loadDirect(address))
+    {
+    case 0xF0:
+        io_address = 0xFF00 | bus_.loadDirect(address + 1);
+        read_offset = 12;
+        address += 2;
+        break;
+
+    case 0xFA:
+        io_address = static_cast<Word>(bus_.loadDirect(address + 1)
+                                     | (bus_.loadDirect(address + 2) << 8));
+        read_offset = 16;
+        address += 3;
+        break;
+
+    default:
+        return;
+    }
+    TCycleCount length = read_offset + 12;
+
+    Word jump_address = jump_end - 2;
+    while (address < jump_address)
+    {
+        Byte inst = bus_.loadDirect(address);
+        if (inst == 0xFE || inst == 0xE6 || inst == 0xF6 || inst == 0xEE)
+        {
+            length += 8;
+            address += 2;
+        }
+        else if (inst >= 0xA0 && inst <= 0xBF && (inst & 0x7) != 6)
+        {
+            length += 4;
+            address += 1;
+        }
+        else if (inst == 0xCB && (bus_.loadDirect(address + 1) & 0xC7) == 0x47)
+        {
+            length += 8;
+            address += 2;
+        }
+        else
+            return;
+    }
+
+    // The previous iteration must have run on its own, from the start of the loop
+    length = clock_.fromCpuCycles(length);
+    read_offset = clock_.fromCpuCycles(read_offset);
+    if (address != jump_address || now - iteration_start != length)
+        return;
+
+    // The previous iteration must have read the current value, the skipped ones have to as well
+    auto window = bus_.getIoValueWindow(io_address);
+    if (window.since > now - length + read_offset || window.until <= now + read_offset)
+        return;
+
+    TCycleCount iterations = (window.until - 1 - now - read_offset) / length + 1;
+
+    // The skipped iterations also have to end before the run does, before an interrupt,
+    // and before the next block of an HBlank DMA
+    TCycleCount end_cycle = std::min(target_cycle_, bus_.getDmaDeadline());
+    if (state_.ime || state_.next_ime)
+        end_cycle = std::min(end_cycle, interrupts_.getPendingDeadline());
+    if (end_cycle <= now)
+        return;
+    iterations = std::min(iterations, (end_cycle - now) / length);
+
+    TCycleCount skipped_cycles = iterations * length;
+    clock_.add(clock_.toCpuCycles(skipped_cycles));
+    bus_.countSkippedPolling(io_address, iterations);
+    skipped_idle_cycles_ += skipped_cycles;
+    last_loop_jump_time_ += skipped_cycles;
+}
+
+
+#undef GBC_FOR_EACH_OPCODE
+#undef GBC_OPCODE_ROW
+
 }
@@ -0,0 +1,179 @@
+#include "dma.hpp"
+
+#include <algorithm>
+
+#include "clock.hpp"
+#include "mmu.hpp"
+#include "ppu.hpp"
+
+namespace GbcEmulator {
+
+void Dma::registerIoHandlers(MemoryManagmentUnit& mmu) {
+    mmu.registerIoHandler<&Dma::getOamDmaSource, &Dma::startOamDma>(0xFF46, *this);
+}
+
+void Dma::registerCgbIoHandlers(MemoryManagmentUnit& mmu) {
+    // The source and destination can't be read back
+    mmu.registerIoHandler<nullptr, &Dma::setHdma1>(0xFF51, *this, 0xFF);
+    mmu.registerIoHandler<nullptr, &Dma::setHdma2>(0xFF52, *this, 0xFF);
+    mmu.registerIoHandler<nullptr, &Dma::setHdma3>(0xFF53, *this, 0xFF);
+    mmu.registerIoHandler<nullptr, &Dma::setHdma4>(0xFF54, *this, 0xFF);
+    mmu.registerIoHandler<&Dma::getHdma5, &Dma::setHdma5>(0xFF55, *this);
+}
+
+void Dma::startOamDma(Byte value) {
+    catchUp();
+    oam_source_ = static_cast<Word>(value << 8);
+    // Runs at the CPU speed
+    oam_dma_start_ = clock_.get() + clock_.fromCpuCycles(oam_dma_setup);
+    oam_dma_byte_length_ = clock_.fromCpuCycles(oam_dma_byte);
+    oam_copied_ = 0;
+    is_oam_dma_active_ = true;
+    updateMmuRouting();
+}
+
+// Sources past WRAM read its echo
+Word Dma::getOamDmaSourceAddress(Word offset) const {
+    Word address = oam_source_ + offset;
+    return address >= 0xE000 ? address - 0x2000 : address;
+}
+
+void Dma::setHdma1(Byte value) {
+    vram_source_ = static_cast<Word>((vram_source_ & 0x00F0) | value << 8);
+}
+
+void Dma::setHdma2(Byte value) {
+    vram_source_ = static_cast<Word>((vram_source_ & 0xFF00) | (value & 0xF0));
+}
+
+void Dma::setHdma3(Byte value) {
+    vram_destination_ = static_cast<Word>((vram_destination_ & 0x00F0) | (value & 0x1F) << 8);
+}
+
+void Dma::setHdma4(Byte value) {
+    vram_destination_ = static_cast<Word>((vram_destination_ & 0x1F00) | (value & 0xF0));
+}
+
+Byte Dma::getHdma5() {
+    catchUp();
+    Byte length = (vram_blocks_left_ - 1) & 0x7F;
+    return is_hdma_active_ ? length : (0x80 | length);
+}
+
+void Dma::setHdma5(Byte value) {
+    catchUp();
+
+    // Writing bit 7 cleared stops a running HBlank DMA
+    if (is_hdma_active_ && !(value & 0x80)) {
+        is_hdma_active_ = false;
+        updateMmuRouting();
+        return;
+    }
+
+    vram_blocks_left_ = static_cast<Byte>((value & 0x7F) + 1);
+    if (value & 0x80) {
+        is_hdma_active_ = true;
+        next_hblank_ = ppu_.getNextHBlank(clock_.get());
+        updateMmuRouting();
+        return;
+    }
+
+    // General purpose DMA, the CPU is halted until it is done
+    while (vram_blocks_left_)
+        transferVramBlock(clock_.get());
+}
+
+void Dma::transferVramBlock(TCycleCount start, bool is_stalling) {
+    mmu_.copyDirect(0x8000 | vram_destination_, vram_source_, vram_dma_block_size);
+    vram_source_ += vram_dma_block_size;
+    vram_destination_ = (vram_destination_ + vram_dma_block_size) & 0x1FF0;
+    --vram_blocks_left_;
+
+    // A block caught up late already spent part of its stall
+    TCycleCount stall_end = start + vram_dma_block_stall;
+    if (is_stalling && stall_end > clock_.get())
+        clock_.add(clock_.toCpuCycles(stall_end - clock_.get()));
+}
+
+void Dma::catchUp(bool is_cpu_halted) {
+    TCycleCount now = clock_.get();
+
+    if (is_oam_dma_active_ && now >= oam_dma_start_) {
+        Word due = static_cast<Word>(
+            std::min<TCycleCount>(oam_size, (now - oam_dma_start_) / oam_dma_byte_length_));
+        if (due > oam_copied_) {
+            // Stops at the end of a page, sources past WRAM wrap to its echo
+            Word offset = oam_copied_;
+            while (offset < due) {
+                Word source = getOamDmaSourceAddress(offset);
+                Word size = std::min<Word>(due - offset, 0x100 - (source & 0xFF));
+                mmu_.copyDirect(0xFE00 + offset, source, size);
+                offset += size;
+            }
+            oam_copied_ = due;
+        }
+        if (oam_copied_ == oam_size) {
+            is_oam_dma_active_ = false;
+            updateMmuRouting();
+        }
+    }
+
+    while (is_hdma_active_ && next_hblank_ <= now) {
+        transferVramBlock(next_hblank_, !is_cpu_halted);
+        if (!vram_blocks_left_) {
+            is_hdma_active_ = false;
+            updateMmuRouting();
+            break;
+        }
+        next_hblank_ = ppu_.getNextHBlank(next_hblank_);
+        now = clock_.get();
+    }
+}
+
+// DMG buses: VRAM has its own, the cartridge and WRAM share the external one
+bool Dma::isOamDmaBus(Word address) const {
+    if (address >= 0xFE00) return false;
+    bool is_vram = address >= 0x8000 && address < 0xA000;
+    Word source = getOamDmaSourceAddress(0);
+    bool is_source_vram = source >= 0x8000 && source < 0xA000;
+    return is_vram == is_source_vram;
+}
+
+std::optional<Byte> Dma::getConflictingLoad(Word address) const {
+    TCycleCount now = clock_.get();
+    if (!is_oam_dma_active_ || now < oam_dma_start_) return std::nullopt;
+
+    if (address >= 0xFE00 && address < 0xFF00) return 0xFF;
+    // The byte the DMA is reading at the same time
+    if (isOamDmaBus(address)) {
+        Word offset = static_cast<Word>((now - oam_dma_start_) / oam_dma_byte_length_);
+        return mmu_.loadDirect(getOamDmaSourceAddress(offset));
+    }
+    return std::nullopt;
+}
+
+bool Dma::isStoreBlocked(Word address) const {
+    if (!is_oam_dma_active_ || clock_.get() < oam_dma_start_) return false;
+    return (address >= 0xFE00 && address < 0xFF00) || isOamDmaBus(address);
+}
+
+void Dma::updateMmuRouting() {
+    mmu_.setDmaRouting(isActive());
+}
+
+void Dma::reset() {
+    is_oam_dma_active_ = false;
+    oam_source_ = 0xFF00;
+    oam_dma_start_ = 0;
+    oam_dma_byte_length_ = oam_dma_byte;
+    oam_copied_ = 0;
+
+    vram_source_ = 0;
+    vram_destination_ = 0;
+    vram_blocks_left_ = 0;
+    is_hdma_active_ = false;
+    next_hblank_ = TCycle_never;
+    updateMmuRouting();
+}
+
+}  // namespace GbcEmulator
@@ -1,6 +1,6 @@
 #include "gameboy.hpp"
 
-#include <fstream>
+#include <filesystem>
 
 #include "cartridge.hpp"
 
@@ -22,42 +22,68 @@ static constexpr CpuState createPostBootState()
 }
 
 GameBoy::GameBoy()
-: mmu_{*this}
-, cpu_{mmu_}
+: mmu_{*this, cpu_}
+, cpu_{mmu_, interrupt_}
 , interrupt_{cpu_.getClock(), *this}
 , timer_{cpu_.getClock(), interrupt_}
 , serial_{cpu_.getClock(), interrupt_}
-, ppu_{cpu_.getClock(), interrupt_}
+, ppu_{cpu_.getClock(), interrupt_, mmu_}
+, dma_{cpu_.getClock(), mmu_, ppu_}
 {
+    registerIoHandlers();
     reset();
 }
 
-void GameBoy::runFor(TCycleCount t_cycles) { cpu_.stepTCycles(t_cycles); }
+// Components serve their own I/O registers, the CGB ones only exist in CGB mode
+void GameBoy::registerIoHandlers() {
+    mmu_.clearIoHandlers();
+    interrupt_.registerIoHandlers(mmu_);
+    timer_.registerIoHandlers(mmu_);
+    serial_.registerIoHandlers(mmu_);
+    ppu_.registerIoHandlers(mmu_);
+    dma_.registerIoHandlers(mmu_);
 
-bool GameBoy::loadRomFile(const std::string& path) {
-    std::ifstream test_rom_file(path, std::ios::binary);
-    if (!test_rom_file.is_open())
-        return false;
-
-    test_rom_file.seekg(0, std::ios::end);
-    std::streampos file_size = test_rom_file.tellg();
-    test_rom_file.seekg(0, std::ios::beg);
+    ppu_.setCgbMode(is_cgb_mode_);
+    if (is_cgb_mode_) {
+        mmu_.registerCgbIoHandlers();
+        cpu_.registerCgbIoHandlers(mmu_);
+        ppu_.registerCgbIoHandlers(mmu_);
+        dma_.registerCgbIoHandlers(mmu_);
+    }
+}
 
-    std::vector<uint8_t> data;
-    data.reserve(static_cast<std::size_t>(file_size));
-    data.insert(data.cbegin(),
-                (std::istreambuf_iterator<char>(test_rom_file)),
-                std::istreambuf_iterator<char>());
+void GameBoy::runFor(TCycleCount t_cycles) {
+    // Debugging features not in use are compiled out of the run loop
+    (cpu_.*Cpu::getRunLoop(cpu_.getRunFeatures()))(t_cycles);
+    // Draws the lines up to now, nothing may have caught up the PPU for a while
+    ppu_.catchUp();
+}
 
-    if (test_rom_file.fail())
+bool GameBoy::loadRomFile(const std::string& path) {
+    // Instances running the same file share its mapping
+    std::shared_ptr<const RomImage> rom = RomImage::open(path);
+    if (!rom)
         return false;
-    test_rom_file.close();
 
-    Cartridge cartridge{data};
+    Cartridge cartridge{std::move(rom)};
     if (!cartridge.isRomBootable())
         return false;
 
+    // Without its save file the game still runs, from a blank eRAM
+    if (battery_saves_ && cartridge.hasBattery())
+        cartridge.openSaveFile(std::filesystem::path{path}.replace_extension(".sav").string(),
+                               clock_catch_up_);
+
+    // Games for both run in CGB mode too
+    is_cgb_mode_ = cartridge.getRomImage()->getCgbFlag() & 0x80;
+    registerIoHandlers();
+    // The CGB banks and speed of the previous game don't carry over
+    mmu_.setVbk(0);
+    mmu_.setSvbk(0);
+    cpu_.resetSpeed();
+
     mmu_.loadCartridge(std::move(cartridge));
+    cpu_.clearCodeCache();
     return true;
 }
 
@@ -69,6 +95,7 @@ void GameBoy::reset()
     timer_.reset();
     serial_.reset();
     ppu_.reset();
+    dma_.reset();
     
     cpu_.restoreStateSnapshot(createPostBootState());
     setPause(true);
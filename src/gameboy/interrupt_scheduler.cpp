@@ -2,28 +2,60 @@
 
 #include "clock.hpp"
 #include "gameboy.hpp"
+#include "mmu.hpp"
 
 namespace GbcEmulator {
 
+void InterruptScheduler::registerIoHandlers(MemoryManagmentUnit& mmu) {
+    mmu.registerIoHandler<&InterruptScheduler::getIf, &InterruptScheduler::setIf>(0xFF0F, *this,
+                                                                                  0xE0);
+}
+
 void InterruptScheduler::recalculateClosestInterrupt() {
     auto min = std::min_element(interrupt_times_.cbegin(), interrupt_times_.cend());
-    assert(*min > clock_.get());
+    // An interrupt scheduled now is requested once the clock moves on
+    assert(*min >= clock_.get());
     closest_interrupt_type_ =
         static_cast<InterruptType>(std::distance(interrupt_times_.cbegin(), min));
     closest_interrupt_time_ = *min;
 }
 
+void InterruptScheduler::updatePendingDeadline() {
+    if (if_ & ie_ & 0x1F) {
+        pending_deadline_ = 0;
+        return;
+    }
+
+    TCycleCount next_enabled_time = TCycle_never;
+    for (std::size_t i = 0; i < interrupt_times_.size(); ++i) {
+        if (ie_ & interrupt_masks[i])
+            next_enabled_time = std::min(next_enabled_time, interrupt_times_[i]);
+    }
+
+    // Interrupts are requested once the clock is past their scheduled cycle
+    pending_deadline_ = next_enabled_time == TCycle_never ? TCycle_never : next_enabled_time + 1;
+}
+
 void InterruptScheduler::catchUp() {
     TCycleCount current_cycle = clock_.get();
+    if (closest_interrupt_time_ >= current_cycle)
+        return;
+
     while (closest_interrupt_time_ < current_cycle) {
         auto casted_type = toUnderlying(closest_interrupt_type_);
-        if_ |= interrupt_masks[casted_type];
+        bool is_requested = true;
 
         switch (closest_interrupt_type_) {
             case InterruptType::Joypad:
                 break;
+
+            // Scheduled wherever the STAT line may rise, the PPU tells whether it did
             case InterruptType::LCD:
+                is_requested = gb_.getPpu().takeStatInterrupt();
+                interrupt_times_[toUnderlying(InterruptType::LCD)] =
+                    gb_.getPpu().getNextStatInterrupt();
                 break;
+
             case InterruptType::Serial:
                 break;
 
@@ -33,18 +65,25 @@ void InterruptScheduler::catchUp() {
                 break;
 
             case InterruptType::VBlank:
+                interrupt_times_[toUnderlying(InterruptType::VBlank)] =
+                    gb_.getPpu().getNextVBlankInterrupt();
                 break;
         }
 
+        if (is_requested)
+            if_ |= interrupt_masks[casted_type];
         recalculateClosestInterrupt();
     }
+    updatePendingDeadline();
 }
 
 void InterruptScheduler::reset()
 {
     if_ = 0xE0;
+    ie_ = 0;
     closest_interrupt_time_ = TCycle_never;
     interrupt_times_.fill(TCycle_never);
+    pending_deadline_ = TCycle_never;
 }
 
 }  // namespace GbcEmulator
\ No newline at end of file
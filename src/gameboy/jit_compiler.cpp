@@ -0,0 +1,331 @@
+#include "jit_compiler.hpp"
+
+#include <sys/mman.h>
+
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <vector>
+
+#include "cpu_state.hpp"
+
+namespace GbcEmulator {
+
+// Generated code follows the System V ABI: the register file comes in rdi,
+// and only the caller-saved rax, rcx and rdx are used as scratch.
+namespace {
+
+constexpr Byte offsetOf(Reg8 r) { return static_cast<Byte>(r); }
+constexpr Byte offsetOf(Reg16 rr) { return static_cast<Byte>(rr); }
+
+// Same order as the operand index of an opcode, 6 is (HL) which isn't compiled
+constexpr std::array<Reg8, 8> operand_registers = {
+    Reg8::B, Reg8::C, Reg8::D, Reg8::E, Reg8::H, Reg8::L, Reg8::F, Reg8::A
+};
+
+constexpr std::array<Reg16, 4> operand_pairs = {
+    Reg16::BC, Reg16::DE, Reg16::HL, Reg16::SP
+};
+
+// T-cycles of the compiled opcodes: opcode fetch, operand fetches and
+// the internal cycle of 16-bit inc/dec. 0 for opcodes left to the interpreter.
+constexpr std::array<Byte, 256> compiled_cycles = [] {
+    std::array<Byte, 256> cycles{};
+    for (unsigned op = 0; op < 0x100; ++op)
+    {
+        const unsigned x = op >> 6, y = (op >> 3) & 0x7, z = op & 0x7;
+        if (op == 0x00) cycles[op] = 4;                                  // nop
+        else if (x == 0 && z == 1 && !(y & 1)) cycles[op] = 12;          // ld rr, d16
+        else if (x == 0 && z == 3) cycles[op] = 8;                       // inc/dec rr
+        else if (x == 0 && (z == 4 || z == 5) && y != 6) cycles[op] = 4; // inc/dec r
+        else if (x == 0 && z == 6 && y != 6) cycles[op] = 8;             // ld r, d8
+        else if (x == 0 && z == 7 && y != 4) cycles[op] = 4;             // rotations, cpl, scf, ccf
+        else if (x == 1 && y != 6 && z != 6) cycles[op] = 4;             // ld r, r
+        else if (x == 2 && z != 6) cycles[op] = 4;                       // alu a, r
+        else if (x == 3 && z == 6) cycles[op] = 8;                       // alu a, d8
+    }
+    return cycles;
+}();
+
+class Emitter {
+public:
+    void emit(std::initializer_list<Byte> bytes) { code_.insert(code_.end(), bytes); }
+
+    // mov al, [rdi+r] / mov [rdi+r], al
+    void loadAl(Reg8 r) { emit({0x8A, 0x47, offsetOf(r)}); }
+    void storeAl(Reg8 r) { emit({0x88, 0x47, offsetOf(r)}); }
+
+    // CF = GB carry, by shifting bit 4 of F out of cl
+    void loadCarry() { emit({0x8A, 0x4F, offsetOf(Reg8::F), 0xC0, 0xE9, 0x05}); }
+
+    // pushfq; pop rcx, has to follow the instruction whose flags are needed
+    void captureFlags() { emit({0x9C, 0x59}); }
+
+    // Builds Z, H and C from the captured host flags
+    void storeArithmeticFlags(bool subtract, Byte kept_flags)
+    {
+        emit({0x88, 0xCA});                          // mov dl, cl
+        emit({0x80, 0xE1, 0x50});                    // and cl, ZF | AF
+        emit({0xD0, 0xE1});                          // shl cl, 1
+        if (!(kept_flags & static_cast<Byte>(RegFlag::C)))
+        {
+            emit({0x80, 0xE2, 0x01});                // and dl, CF
+            emit({0xC0, 0xE2, 0x04});                // shl dl, 4
+            emit({0x08, 0xD1});                      // or cl, dl
+        }
+        emit({0x8A, 0x57, offsetOf(Reg8::F)});       // mov dl, [rdi+F]
+        storeFlags(subtract ? static_cast<Byte>(RegFlag::N) : 0, kept_flags);
+    }
+
+    // Builds Z from the captured host flags
+    void storeLogicFlags(Byte constant_flags)
+    {
+        emit({0x80, 0xE1, 0x40});                    // and cl, ZF
+        emit({0xD0, 0xE1});                          // shl cl, 1
+        emit({0x8A, 0x57, offsetOf(Reg8::F)});       // mov dl, [rdi+F]
+        storeFlags(constant_flags, 0x0F);
+    }
+
+    // F = cl | constant_flags | (dl & kept_flags)
+    void storeFlags(Byte constant_flags, Byte kept_flags)
+    {
+        if (constant_flags)
+            emit({0x80, 0xC9, constant_flags});      // or cl, imm8
+        emit({0x80, 0xE2, kept_flags});              // and dl, imm8
+        emit({0x08, 0xD1});                          // or cl, dl
+        emit({0x88, 0x4F, offsetOf(Reg8::F)});       // mov [rdi+F], cl
+    }
+
+    // Rotation through the host carry, F only keeps the new carry
+    void rotateA(Byte modrm, bool through_carry)
+    {
+        if (through_carry)
+            loadCarry();
+        loadAl(Reg8::A);
+        emit({0xD0, modrm});                         // rol/ror/rcl/rcr al, 1
+        emit({0x0F, 0x92, 0xC1});                    // setc cl
+        emit({0xC0, 0xE1, 0x04});                    // shl cl, 4
+        storeAl(Reg8::A);
+        emit({0x88, 0x4F, offsetOf(Reg8::F)});       // mov [rdi+F], cl
+    }
+
+    bool compile(const CodeCache::DecodedInstruction& inst);
+
+    const std::vector<Byte>& getCode() const { return code_; }
+
+private:
+    void compileAlu(Byte operation, const CodeCache::DecodedInstruction& inst, bool immediate);
+
+    std::vector<Byte> code_;
+};
+
+// Host opcodes of the 8 ALU operations, with a memory operand then with an immediate
+constexpr std::array<Byte, 8> alu_register_opcodes = {0x02, 0x12, 0x2A, 0x1A, 0x22, 0x32, 0x0A, 0x3A};
+constexpr std::array<Byte, 8> alu_immediate_opcodes = {0x04, 0x14, 0x2C, 0x1C, 0x24, 0x34, 0x0C, 0x3C};
+
+void Emitter::compileAlu(Byte operation, const CodeCache::DecodedInstruction& inst, bool immediate)
+{
+    if (operation == 1 || operation == 3)
+        loadCarry();
+    loadAl(Reg8::A);
+    if (immediate)
+        emit({alu_immediate_opcodes[operation], inst.operands[0]});
+    else
+        emit({alu_register_opcodes[operation], 0x47, offsetOf(operand_registers[inst.opcode & 0x7])});
+
+    captureFlags();
+
+    // cp only sets the flags
+    if (operation != 7)
+        storeAl(Reg8::A);
+
+    if (operation == 4)
+        storeLogicFlags(static_cast<Byte>(RegFlag::H));
+    else if (operation == 5 || operation == 6)
+        storeLogicFlags(0);
+    else
+        storeArithmeticFlags(operation >= 2, 0x0F);
+}
+
+bool Emitter::compile(const CodeCache::DecodedInstruction& inst)
+{
+    const Byte op = inst.opcode;
+    const Byte x = op >> 6;
+    const Byte y = (op >> 3) & 0x7;
+    const Byte z = op & 0x7;
+    const Byte p = y >> 1;
+    const Byte q = y & 0x1;
+
+    if (x == 0)
+    {
+        if (op == 0x00)
+            return true;
+
+        if (z == 1 && q == 0)
+        {
+            // mov word [rdi+rr], imm16
+            emit({0x66, 0xC7, 0x47, offsetOf(operand_pairs[p]), inst.operands[0], inst.operands[1]});
+            return true;
+        }
+
+        if (z == 3)
+        {
+            // inc/dec word [rdi+rr]
+            emit({0x66, 0xFF, static_cast<Byte>(q ? 0x4F : 0x47), offsetOf(operand_pairs[p])});
+            return true;
+        }
+
+        if ((z == 4 || z == 5) && y != 6)
+        {
+            Reg8 r = operand_registers[y];
+            loadAl(r);
+            emit({0xFE, static_cast<Byte>(z == 4 ? 0xC0 : 0xC8)});  // inc/dec al
+            captureFlags();
+            storeAl(r);
+            storeArithmeticFlags(z == 5, 0x1F);
+            return true;
+        }
+
+        if (z == 6 && y != 6)
+        {
+            // mov byte [rdi+r], imm8
+            emit({0xC6, 0x47, offsetOf(operand_registers[y]), inst.operands[0]});
+            return true;
+        }
+
+        if (z == 7)
+        {
+            switch (y)
+            {
+            case 0: rotateA(0xC0, false); return true;  // rlca
+            case 1: rotateA(0xC8, false); return true;  // rrca
+            case 2: rotateA(0xD0, true); return true;   // rla
+            case 3: rotateA(0xD8, true); return true;   // rra
+            case 5:                                     // cpl
+                emit({0xF6, 0x57, offsetOf(Reg8::A)});
+                emit({0x80, 0x4F, offsetOf(Reg8::F), 0x60});
+                return true;
+            case 6:                                     // scf
+                emit({0x80, 0x67, offsetOf(Reg8::F), 0x8F});
+                emit({0x80, 0x4F, offsetOf(Reg8::F), 0x10});
+                return true;
+            case 7:                                     // ccf
+                emit({0x80, 0x67, offsetOf(Reg8::F), 0x9F});
+                emit({0x80, 0x77, offsetOf(Reg8::F), 0x10});
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+    if (x == 1)
+    {
+        if (y == 6 || z == 6)
+            return false;
+        if (y != z)
+        {
+            loadAl(operand_registers[z]);
+            storeAl(operand_registers[y]);
+        }
+        return true;
+    }
+
+    if (x == 2)
+    {
+        if (z == 6)
+            return false;
+        compileAlu(y, inst, false);
+        return true;
+    }
+
+    if (z == 6 && x == 3)
+    {
+        compileAlu(y, inst, true);
+        return true;
+    }
+
+    if (op == 0xCB)
+    {
+        const Byte cb = inst.operands[0];
+        const Byte cb_x = cb >> 6;
+        const Byte cb_z = cb & 0x7;
+        const Byte mask = static_cast<Byte>(1 << ((cb >> 3) & 0x7));
+        if (cb_x == 0 || cb_z == 6)
+            return false;
+
+        const Byte r = offsetOf(operand_registers[cb_z]);
+        if (cb_x == 1)
+        {
+            emit({0xF6, 0x47, r, mask});          // test byte [rdi+r], imm8
+            emit({0x0F, 0x94, 0xC1});             // sete cl
+            emit({0xC0, 0xE1, 0x07});             // shl cl, 7
+            emit({0x8A, 0x57, offsetOf(Reg8::F)});
+            storeFlags(static_cast<Byte>(RegFlag::H), 0x1F);
+        }
+        else if (cb_x == 2)
+        {
+            emit({0x80, 0x67, r, static_cast<Byte>(~mask)});  // and byte [rdi+r], imm8
+        }
+        else
+        {
+            emit({0x80, 0x4F, r, mask});          // or byte [rdi+r], imm8
+        }
+        return true;
+    }
+
+    return false;
+}
+
+}  // namespace
+
+
+JitCompiler::JitCompiler()
+{
+    void* buffer = mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        throw std::bad_alloc();
+    buffer_ = static_cast<Byte*>(buffer);
+}
+
+JitCompiler::~JitCompiler()
+{
+    munmap(buffer_, buffer_size);
+}
+
+unsigned JitCompiler::getCompiledCycles(const CodeCache::DecodedInstruction& inst)
+{
+    if (inst.opcode == 0xCB)
+    {
+        // Rotations and shifts aren't compiled, nor anything on (HL)
+        const Byte cb = inst.operands[0];
+        return (cb >> 6) != 0 && (cb & 0x7) != 6 ? 8 : 0;
+    }
+    return compiled_cycles[inst.opcode];
+}
+
+JitCompiler::NativeRun JitCompiler::compile(
+    std::span<const CodeCache::DecodedInstruction> instructions)
+{
+    Emitter emitter;
+    for (const CodeCache::DecodedInstruction& inst : instructions)
+    {
+        if (!emitter.compile(inst))
+            return nullptr;
+    }
+    emitter.emit({0xC3});  // ret
+
+    const std::vector<Byte>& code = emitter.getCode();
+    if (used_ + code.size() > buffer_size)
+        return nullptr;
+
+    Byte* start = buffer_ + used_;
+    std::memcpy(start, code.data(), code.size());
+    used_ += (code.size() + 15) & ~std::size_t{15};
+    return reinterpret_cast<NativeRun>(start);
+}
+
+}  // namespace GbcEmulator
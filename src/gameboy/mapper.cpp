@@ -0,0 +1,290 @@
+#include "mapper.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "clock.hpp"
+#include "rom_image.hpp"
+
+namespace GbcEmulator {
+
+namespace {
+
+constexpr bool isRamEnableValue(uint8_t value) { return (value & 0x0F) == 0x0A; }
+
+// ROM only, optionally with RAM always enabled
+class NoMapper final : public Mapper {
+public:
+    NoMapper() { reset(); }
+
+    void storeRegister(uint16_t, uint8_t) override {}
+    void reset() override { banks_ = Banks{0, 1, 0, true}; }
+};
+
+class Mbc1 final : public Mapper {
+public:
+    // Multicarts wire the upper bank bits one bit lower, to pick one of four 256KiB games
+    explicit Mbc1(bool is_multicart) : bank1_shift_{is_multicart ? 4u : 5u} { reset(); }
+
+    void storeRegister(uint16_t address, uint8_t value) override {
+        switch (address >> 13) {
+            case 0: banks_.eram_enabled = isRamEnableValue(value); return;
+            case 1: bank1_ = std::max<uint8_t>(value & 0x1F, 1); break;
+            case 2: bank2_ = value & 0x03; break;
+            case 3: mode_ = value & 0x01; break;
+        }
+        updateBanks();
+    }
+
+    void reset() override {
+        bank1_ = 1;
+        bank2_ = 0;
+        mode_ = false;
+        banks_.eram_enabled = false;
+        updateBanks();
+    }
+
+private:
+    void updateBanks() {
+        uint16_t low_bits_mask = static_cast<uint16_t>((1u << bank1_shift_) - 1);
+        uint16_t high_bits = static_cast<uint16_t>(bank2_ << bank1_shift_);
+        banks_.selected_rom = high_bits | (bank1_ & low_bits_mask);
+        // Mode 1 also applies the upper bits to 0x0000-0x3FFF and selects the RAM bank
+        banks_.fixed_rom = mode_ ? high_bits : 0;
+        banks_.eram = mode_ ? bank2_ : 0;
+    }
+
+    unsigned bank1_shift_;
+    uint8_t bank1_, bank2_;
+    bool mode_;
+};
+
+class Mbc2 final : public Mapper {
+public:
+    Mbc2() { reset(); }
+
+    void storeRegister(uint16_t address, uint8_t value) override {
+        if (address >= 0x4000) return;
+        // Bit 8 of the address selects the register
+        if (address & 0x100)
+            banks_.selected_rom = std::max<uint8_t>(value & 0x0F, 1);
+        else
+            banks_.eram_enabled = isRamEnableValue(value);
+    }
+
+    void reset() override { banks_ = Banks{}; }
+
+    // 512 half-bytes, repeated over the whole eRAM region
+    bool isExternRamPlain() const override { return false; }
+    uint8_t loadFromExternRam(std::span<const uint8_t> eram, uint16_t address) const override {
+        return eram[address & 0x1FF] | 0xF0;
+    }
+    void storeInExternRam(std::span<uint8_t> eram, uint16_t address, uint8_t value) override {
+        eram[address & 0x1FF] = value & 0x0F;
+    }
+
+    std::size_t getBuiltInRamSize() const override { return 0x200; }
+};
+
+class Mbc3 final : public Mapper {
+public:
+    explicit Mbc3(bool has_clock) : has_clock_{has_clock} { reset(); }
+
+    void storeRegister(uint16_t address, uint8_t value) override {
+        switch (address >> 13) {
+            case 0: banks_.eram_enabled = isRamEnableValue(value); return;
+            case 1: banks_.selected_rom = std::max<uint8_t>(value & 0x7F, 1); return;
+            case 2: banks_.eram = value & 0x0F; return;
+            // Writing 0 then 1 latches the clock registers
+            case 3:
+                if (has_clock_ && latch_value_ == 0x00 && value == 0x01)
+                    latched_ = getRegisters();
+                latch_value_ = value;
+                return;
+        }
+    }
+
+    // The clock keeps counting, the Clock starts over at 0 along with the rest of the Game Boy
+    void reset() override {
+        banks_ = Banks{};
+        latch_value_ = 0xFF;
+        catchUpClock();
+        anchor_ = 0;
+    }
+
+    // RAM banks 0x08-0x0C select the clock registers
+    bool isExternRamPlain() const override { return banks_.eram < 0x08; }
+    uint8_t loadFromExternRam(std::span<const uint8_t>, uint16_t) const override {
+        return isClockSelected() ? latched_[banks_.eram - 0x08] : 0xFF;
+    }
+    void storeInExternRam(std::span<uint8_t>, uint16_t, uint8_t value) override {
+        if (!isClockSelected()) return;
+        catchUpClock();
+        std::size_t index = banks_.eram - 0x08;
+        Registers registers = getRegisters();
+        registers[index] = value & register_masks[index];
+        // Writing the seconds also restarts the current second
+        setRegisters(registers, index == 0 ? 0 : clock_cycles_ % Clock::cycles_per_second);
+    }
+
+    bool hasClock() const override { return has_clock_; }
+    bool isClockSelected() const override {
+        return has_clock_ && banks_.eram >= 0x08 && banks_.eram <= 0x0C;
+    }
+
+    void connectClock(const Clock& clock) override {
+        catchUpClock();
+        clock_ = &clock;
+        anchor_ = clock.get();
+    }
+
+    void saveClockData(std::span<uint8_t> data, int64_t unix_time) const override {
+        // Little endian, registers on 4 bytes
+        auto put = [data](std::size_t offset, uint64_t value, std::size_t size) {
+            for (std::size_t i = 0; i < size; ++i)
+                data[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+        };
+        Registers registers = getRegisters();
+        for (std::size_t i = 0; i < registers.size(); ++i) {
+            put(4 * i, registers[i], 4);
+            put(20 + 4 * i, latched_[i], 4);
+        }
+        put(40, static_cast<uint64_t>(unix_time), 8);
+    }
+
+    void loadClockData(std::span<const uint8_t> data, std::optional<int64_t> unix_time) override {
+        auto get = [data](std::size_t offset, std::size_t size) {
+            uint64_t value = 0;
+            for (std::size_t i = 0; i < size; ++i)
+                value |= static_cast<uint64_t>(data[offset + i]) << (8 * i);
+            return value;
+        };
+        // Saves without a clock leave it zeroed
+        auto saved_time = static_cast<int64_t>(get(40, 8));
+        if (!saved_time) return;
+
+        Registers registers;
+        for (std::size_t i = 0; i < registers.size(); ++i) {
+            registers[i] = static_cast<uint8_t>(get(4 * i, 1)) & register_masks[i];
+            latched_[i] = static_cast<uint8_t>(get(20 + 4 * i, 1)) & register_masks[i];
+        }
+        setRegisters(registers, 0);
+        if (unix_time && *unix_time > saved_time && !is_halted_)
+            clock_cycles_ +=
+                static_cast<TCycleCount>(*unix_time - saved_time) * Clock::cycles_per_second;
+        catchUpClock();
+    }
+
+private:
+    // Seconds, minutes, hours, lower 8 bits of the day, then DH: bit 0 the upper bit of
+    // the day, bit 6 halt and bit 7 the day carry
+    using Registers = std::array<uint8_t, 5>;
+    inline static constexpr Registers register_masks = {0x3F, 0x3F, 0x1F, 0xFF, 0xC1};
+    inline static constexpr TCycleCount cycles_per_day = 86400 * Clock::cycles_per_second;
+    inline static constexpr TCycleCount day_counter_cycles = 512 * cycles_per_day;
+
+    TCycleCount now() const { return clock_ ? clock_->get() : anchor_; }
+    // Cycles counted since day 0, the day carry left aside
+    TCycleCount getClockCycles() const {
+        return is_halted_ ? clock_cycles_ : clock_cycles_ + (now() - anchor_);
+    }
+
+    // Moves the anchor to now, the day counter overflows into the carry
+    void catchUpClock() {
+        clock_cycles_ = getClockCycles();
+        anchor_ = now();
+        if (clock_cycles_ >= day_counter_cycles) {
+            clock_cycles_ %= day_counter_cycles;
+            is_day_carry_ = true;
+        }
+    }
+
+    Registers getRegisters() const {
+        TCycleCount cycles = getClockCycles();
+        TCycleCount seconds = cycles / Clock::cycles_per_second;
+        TCycleCount days = cycles / cycles_per_day;
+        bool is_day_carry = is_day_carry_ || days >= 512;
+        days %= 512;
+        return {static_cast<uint8_t>(seconds % 60), static_cast<uint8_t>(seconds / 60 % 60),
+                static_cast<uint8_t>(seconds / 3600 % 24), static_cast<uint8_t>(days & 0xFF),
+                static_cast<uint8_t>((days >> 8) | (is_halted_ << 6) | (is_day_carry << 7))};
+    }
+
+    void setRegisters(const Registers& registers, TCycleCount subsecond_cycles) {
+        auto days = static_cast<TCycleCount>(registers[3] | (registers[4] & 0x01) << 8);
+        auto seconds =
+            static_cast<TCycleCount>(registers[0] + 60 * registers[1] + 3600 * registers[2]);
+        clock_cycles_ = days * cycles_per_day + seconds * Clock::cycles_per_second
+                      + subsecond_cycles;
+        is_halted_ = registers[4] & 0x40;
+        is_day_carry_ = registers[4] & 0x80;
+        anchor_ = now();
+    }
+
+    bool has_clock_;
+    uint8_t latch_value_;
+    Registers latched_{};
+
+    // The clock counted clock_cycles_ at the cycle anchor_ of the Clock
+    const Clock* clock_ = nullptr;
+    TCycleCount clock_cycles_ = 0;
+    TCycleCount anchor_ = 0;
+    bool is_halted_ = false;
+    bool is_day_carry_ = false;
+};
+
+class Mbc5 final : public Mapper {
+public:
+    explicit Mbc5(bool has_rumble) : has_rumble_{has_rumble} { reset(); }
+
+    void storeRegister(uint16_t address, uint8_t value) override {
+        switch (address >> 12) {
+            case 0: case 1: banks_.eram_enabled = isRamEnableValue(value); return;
+            // Unlike the other controllers, bank 0 can be selected at 0x4000-0x7FFF
+            case 2: banks_.selected_rom = (banks_.selected_rom & 0x100) | value; return;
+            case 3: banks_.selected_rom = static_cast<uint16_t>((banks_.selected_rom & 0xFF) |
+                                                                (value & 0x01) << 8); return;
+            // Bit 3 drives the motor of rumble cartridges
+            case 4: case 5: banks_.eram = value & (has_rumble_ ? 0x07 : 0x0F); return;
+        }
+    }
+
+    void reset() override { banks_ = Banks{}; }
+
+private:
+    bool has_rumble_;
+};
+
+// MBC1 multicarts are only told apart from regular 1MiB MBC1 cartridges by the
+// logo of the game in the second 256KiB slot
+bool isMbc1Multicart(std::span<const uint8_t> rom) {
+    constexpr std::size_t multicart_size = 0x100000;
+    constexpr std::size_t second_game_logo = 0x40000 + 0x104;
+    const auto& logo = RomImage::nintendo_logo;
+    return rom.size() == multicart_size &&
+           std::equal(logo.cbegin(), logo.cend(), rom.begin() + second_game_logo);
+}
+
+}  // namespace
+
+std::unique_ptr<Mapper> Mapper::create(std::span<const uint8_t> rom) {
+    switch (rom[0x0147]) {
+        case 0x00: case 0x08: case 0x09:
+            return std::make_unique<NoMapper>();
+        case 0x01: case 0x02: case 0x03:
+            return std::make_unique<Mbc1>(isMbc1Multicart(rom));
+        case 0x05: case 0x06:
+            return std::make_unique<Mbc2>();
+        case 0x0F: case 0x10:
+            return std::make_unique<Mbc3>(true);
+        case 0x11: case 0x12: case 0x13:
+            return std::make_unique<Mbc3>(false);
+        case 0x19: case 0x1A: case 0x1B:
+            return std::make_unique<Mbc5>(false);
+        case 0x1C: case 0x1D: case 0x1E:
+            return std::make_unique<Mbc5>(true);
+    }
+    return nullptr;
+}
+
+}  // namespace GbcEmulator
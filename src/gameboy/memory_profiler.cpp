@@ -0,0 +1,54 @@
+#include "memory_profiler.hpp"
+
+#include <iomanip>
+#include <ostream>
+
+namespace GbcEmulator {
+
+namespace {
+
+// Calls f(address, counts) for the entries accessed at least once
+template <typename AllCounts, typename F>
+void forEachAccessed(const AllCounts& all_counts, Word base, int shift, F f) {
+    for (std::size_t i = 0; i < all_counts.size(); ++i) {
+        const MemoryProfiler::Counts& counts = all_counts[i];
+        if (counts.reads || counts.writes)
+            f(static_cast<Word>(base + (i << shift)), counts);
+    }
+}
+
+}  // namespace
+
+void MemoryProfiler::writeCsv(std::ostream& out) const {
+    out << "region,address,reads,writes,read_cycles,write_cycles\n";
+    auto write_rows = [&out](const char* region) {
+        return [&out, region](Word address, const Counts& counts) {
+            out << region << ",0x" << std::hex << std::uppercase << std::setw(4)
+                << std::setfill('0') << address << std::dec << ',' << counts.reads << ','
+                << counts.writes << ',' << counts.read_cycles << ',' << counts.write_cycles << '\n';
+        };
+    };
+    forEachAccessed(pages_, 0x0000, 8, write_rows("page"));
+    forEachAccessed(io_registers_, 0xFF00, 0, write_rows("io"));
+}
+
+void MemoryProfiler::writeJson(std::ostream& out) const {
+    auto write_array = [&out](const char* name, const auto& all_counts, Word base, int shift) {
+        out << "  \"" << name << "\": [";
+        const char* separator = "\n";
+        forEachAccessed(all_counts, base, shift, [&](Word address, const Counts& counts) {
+            out << separator << "    {\"address\": " << address << ", \"reads\": " << counts.reads
+                << ", \"writes\": " << counts.writes << ", \"read_cycles\": " << counts.read_cycles
+                << ", \"write_cycles\": " << counts.write_cycles << '}';
+            separator = ",\n";
+        });
+        out << "\n  ]";
+    };
+    out << "{\n";
+    write_array("pages", pages_, 0x0000, 8);
+    out << ",\n";
+    write_array("io_registers", io_registers_, 0xFF00, 0);
+    out << "\n}\n";
+}
+
+}  // namespace GbcEmulator
@@ -1,155 +1,423 @@
 #include "mmu.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
 #include "cartridge.hpp"
 #include "gameboy.hpp"
 
 namespace GbcEmulator {
 
-MemoryManagmentUnit::MemoryManagmentUnit(GameBoy& gb) : gb_(gb)
+// Bits that always read as 1 (DMG), until a component registers its own handler.
+// Registers missing from the hardware read as 0xFF.
+static constexpr std::array<Byte, 0x80> io_read_masks = {
+    // P1,  SB,   SC,         DIV,  TIMA, TMA,  TAC
+    0xCF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    //                                              IF
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    // NR10 - NR24
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00,
+    0xFF, 0xBF, 0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF,
+    // NR41 - NR52
+    0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    // Wave RAM
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    // LCDC, STAT, SCY, SCX, LY, LYC, DMA, BGP, OBP0, OBP1, WY, WX
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+MemoryManagmentUnit::MemoryManagmentUnit(GameBoy& gb, Cpu& cpu) : gb_(gb), cpu_(cpu)
 {
+    clearIoHandlers();
     reset();
 }
 
+void MemoryManagmentUnit::clearIoHandlers() {
+    for (std::size_t i = 0; i < io_handlers_.size(); ++i)
+        io_handlers_[i] = {nullptr, nullptr, nullptr, io_read_masks[i]};
+}
+
+void MemoryManagmentUnit::registerCgbIoHandlers() {
+    registerIoHandler<&MemoryManagmentUnit::getVbk, &MemoryManagmentUnit::setVbk>(0xFF4F, *this,
+                                                                                0xFE);
+    registerIoHandler<&MemoryManagmentUnit::getSvbk, &MemoryManagmentUnit::setSvbk>(0xFF70, *this,
+                                                                                  0xF8);
+}
+
+Byte MemoryManagmentUnit::getVbk() {
+    return static_cast<Byte>((selected_vram_bank_ - vram_.begin()) / 0x2000);
+}
+
+void MemoryManagmentUnit::setVbk(Byte value) {
+    selected_vram_bank_ = vram_.begin() + (value & 0x01) * 0x2000;
+    mapPages(0x8000, 0x2000, &*selected_vram_bank_, nullptr);
+    cpu_.notifyBankSwitch();
+}
+
+Byte MemoryManagmentUnit::getSvbk() {
+    return static_cast<Byte>((selected_wram_bank_ - wram_.begin()) / 0x1000);
+}
+
+// Bank 0 can't be selected there, it selects bank 1
+void MemoryManagmentUnit::setSvbk(Byte value) {
+    selected_wram_bank_ = wram_.begin() + std::max(value & 0x07, 1) * 0x1000;
+    mapPages(0xD000, 0x1000, &*selected_wram_bank_, &*selected_wram_bank_);
+    mapPages(0xF000, 0x0E00, &*selected_wram_bank_, nullptr);
+    cpu_.notifyBankSwitch();
+}
+
 MemoryManagmentUnit::~MemoryManagmentUnit() = default;
 
-uint8_t MemoryManagmentUnit::load(uint16_t address) {
-    if (address < 0x8000) return cartridge_->loadFromRom(address);
-    if (address < 0xA000) return selected_vram_bank_[address - 0x8000];
-    if (address < 0xC000) return cartridge_->loadFromExternRam(address - 0xA000);
-    if (address < 0xD000) return wram_[address - 0xC000];
-    if (address < 0xE000) return selected_wram_bank_[address - 0xD000];
-    if (address < 0xFE00) return wram_[address - 0xE000];
+// Only reached for the pages without an entry in read_pages_
+Byte MemoryManagmentUnit::loadFromHandler(Word address) {
+    std::optional<Byte> value;
+    if (is_dma_routing_) {
+        Dma& dma = gb_.getDma();
+        dma.catchUp();
+        value = dma.getConflictingLoad(address);
+    }
+    if (!value)
+        value = loadDirect(address);
+
+    if (watched_pages_[address >> 8] & Watchpoint::Read)
+        checkWatchpoints(address, *value, Watchpoint::Read);
+#if GBC_HAS_MEMORY_PROFILER
+    if (is_profiling_)
+        profiler_.countRead(address, cpu_.getClock().get());
+#endif
+    return *value;
+}
+
+// Only reached for the pages without an entry in write_pages_
+void MemoryManagmentUnit::storeToHandler(Word address, Byte value) {
+#if GBC_HAS_MEMORY_PROFILER
+    if (is_profiling_)
+        profiler_.countWrite(address, cpu_.getClock().get());
+#endif
+    if (watched_pages_[address >> 8] & Watchpoint::Write)
+        checkWatchpoints(address, value, Watchpoint::Write);
+
+    if (is_dma_routing_) {
+        Dma& dma = gb_.getDma();
+        dma.catchUp();
+        if (dma.isStoreBlocked(address))
+            return;
+    }
+    storeDirect(address, value);
+}
+
+Byte MemoryManagmentUnit::loadDirect(Word address) {
+    if (const Byte* page = memory_read_pages_[address >> 8])
+        return page[address & 0xFF];
+    if (address < 0xC000) {
+        // eRAM disabled or handled by the mapper
+        if (address >= 0xA000 && cartridge_) return cartridge_->loadFromExternRam(address - 0xA000);
+        return 0xFF;  // No cartridge
+    }
     if (address < 0xFEA0) return oam_[address - 0xFE00];
     // [CGB rev E]: 0xFEA0-0xFEFF: returns high nibble of the lower address twice
     if (address < 0xFF00) return ((address >> 4) & 0xF) * 0x11;
-    if (address == 0xFFFF) return ie_;
+    if (address == 0xFFFF) return gb_.getInterrupt().getIe();
     if (address > 0xFF7F) return hram_[address - 0xFF80];
 
-    switch (address & 0xFF) {
-        case 0x01:
-            return gb_.getSerial().getSb();
-        case 0x02:
-            return gb_.getSerial().getSc();
-
-        case 0x04:
-            return gb_.getTimer().getDiv();
-        case 0x05:
-            return gb_.getTimer().getTima();
-        case 0x06:
-            return gb_.getTimer().getTma();
-        case 0x07:
-            return gb_.getTimer().getTac();
-
-        case 0x0F:
-            return gb_.getInterrupt().getIf();
-
-        case 0x40:
-            return gb_.getPpu().getLcdc();
-        case 0x41:
-            return gb_.getPpu().getStat();
-        case 0x42:
-            return gb_.getPpu().getScy();
-        case 0x43:
-            return gb_.getPpu().getScx();
-        case 0x44:
-            return gb_.getPpu().getLy();
-        case 0x45:
-            return gb_.getPpu().getLyc();
-    }
-
-    return 0xFF;
-}
-
-void MemoryManagmentUnit::store(uint16_t address, uint8_t value) {
+    const IoHandler& handler = io_handlers_[address & 0x7F];
+    Byte value = handler.read ? handler.read(handler.component) : io_[address & 0x7F];
+    return value | handler.read_mask;
+}
+
+void MemoryManagmentUnit::storeDirect(Word address, Byte value) {
+    if (Byte* page = memory_write_pages_[address >> 8]) {
+        page[address & 0xFF] = value;
+        cpu_.notifyCodeWrite(address);
+        return;
+    }
     if (address < 0x8000) {
+        if (!cartridge_) return;
         cartridge_->storeInRom(address, value);
+        updateCartridgePages();
+        cpu_.notifyBankSwitch();
         return;
     }
     if (address < 0xA000) {
-        selected_vram_bank_[address - 0x8000] = value;
+        // The lines drawn before the write still see the old value
+        gb_.getPpu().catchUp();
+        std::size_t offset = getVramOffset(address);
+        vram_[offset] = value;
+        markVramWrite(offset, 1);
+        cpu_.notifyCodeWrite(address);
         return;
     }
     if (address < 0xC000) {
-        cartridge_->storeInExternRam(address - 0xA000, value);
-        return;
-    }
-    if (address < 0xD000) {
-        wram_[address - 0xC000] = value;
-        return;
-    }
-    if (address < 0xE000) {
-        selected_wram_bank_[address - 0xD000] = value;
+        if (address >= 0xA000 && cartridge_) cartridge_->storeInExternRam(address - 0xA000, value);
         return;
     }
     if (address < 0xFE00) {
-        wram_[address - 0xE000] = value;
+        // Echo RAM, the code cache only knows the addresses of the original
+        if (address < 0xF000)
+            wram_[address - 0xE000] = value;
+        else
+            selected_wram_bank_[address - 0xF000] = value;
+        cpu_.notifyCodeWrite(address - 0x2000);
         return;
     }
     if (address < 0xFEA0) {
+        gb_.getPpu().catchUp();
         oam_[address - 0xFE00] = value;
+        markOamWrite(address - 0xFE00, 1);
         return;
     }
     if (address < 0xFF00) return;
     if (address == 0xFFFF) {
-        ie_ = value;
+        gb_.getInterrupt().setIe(value);
         return;
     }
     if (address > 0xFF7F) {
         hram_[address - 0xFF80] = value;
+        cpu_.notifyCodeWrite(address);
         return;
     }
 
-    switch (address & 0xFF) {
-        case 0x01:
-            gb_.getSerial().setSb(value);
-            return;
-        case 0x02:
-            gb_.getSerial().setSc(value);
-            return;
+    const IoHandler& handler = io_handlers_[address & 0x7F];
+    if (handler.write)
+        handler.write(handler.component, value);
+    else
+        io_[address & 0x7F] = value;
+}
 
-        case 0x04:
-            gb_.getTimer().setDiv(value);
-            return;
-        case 0x05:
-            gb_.getTimer().setTima(value);
-            return;
-        case 0x06:
-            gb_.getTimer().setTma(value);
-            return;
-        case 0x07:
-            gb_.getTimer().setTac(value);
-            return;
+void MemoryManagmentUnit::copyDirect(Word destination, Word source, Word size) {
+    while (size) {
+        // Up to the end of the source or destination page
+        Word chunk = std::min<Word>({size, static_cast<Word>(0x100 - (source & 0xFF)),
+                                     static_cast<Word>(0x100 - (destination & 0xFF))});
+        const Byte* from = memory_read_pages_[source >> 8];
+        Byte* to = memory_write_pages_[destination >> 8];
+        // Video memory isn't mapped for writes, to keep its generations
+        bool is_vram = !to && destination >= 0x8000 && destination < 0xA000;
+        bool is_oam = !to && destination >= 0xFE00 && destination + chunk <= 0xFEA0;
+        if (is_vram)
+            to = &vram_[getVramOffset(destination & 0xFF00)];
+        else if (is_oam)
+            to = oam_.data();
 
-        case 0x0F:
-            gb_.getInterrupt().setIf(value);
-            return;
+        if (from && to) {
+            if (is_vram || is_oam)
+                gb_.getPpu().catchUp();
+            std::memcpy(to + (destination & 0xFF), from + (source & 0xFF), chunk);
+            cpu_.notifyCodeWrite(destination);
+            if (is_vram)
+                markVramWrite(getVramOffset(destination), chunk);
+            else if (is_oam)
+                markOamWrite(destination - 0xFE00, chunk);
+        } else {
+            for (Word i = 0; i < chunk; ++i)
+                storeDirect(destination + i, loadDirect(source + i));
+        }
+        destination += chunk;
+        source += chunk;
+        size -= chunk;
+    }
+}
 
-        case 0x40:
-            gb_.getPpu().setLcdc(value);
-            return;
-        case 0x41:
-            gb_.getPpu().setStat(value);
-            return;
-        case 0x42:
-            gb_.getPpu().setScy(value);
-            return;
-        case 0x43:
-            gb_.getPpu().setScx(value);
-            return;
-        case 0x44:
-            gb_.getPpu().setLy(value);
-            return;
-        case 0x45:
-            gb_.getPpu().setLyc(value);
-            return;
+std::size_t MemoryManagmentUnit::getVramOffset(Word address) const {
+    return static_cast<std::size_t>(selected_vram_bank_ - vram_.cbegin()) + (address - 0x8000);
+}
+
+void MemoryManagmentUnit::markVramWrite(std::size_t offset, std::size_t size) {
+    ++video_generation_;
+    for (std::size_t block = offset / video_block_size;
+         block <= (offset + size - 1) / video_block_size; ++block)
+        vram_block_generations_[block] = video_generation_;
+    gb_.getPpu().recordVramWrite(offset, size);
+}
+
+void MemoryManagmentUnit::markOamWrite(std::size_t offset, std::size_t size) {
+    ++video_generation_;
+    for (std::size_t block = offset / video_block_size;
+         block <= (offset + size - 1) / video_block_size; ++block)
+        oam_block_generations_[block] = video_generation_;
+    gb_.getPpu().recordOamWrite(offset, size);
+}
+
+void MemoryManagmentUnit::addWatchpoint(const Watchpoint& watchpoint) {
+    if (!watchpoint.isValid())
+        throw std::invalid_argument("Watchpoint watches nothing");
+    watchpoints_.push_back(watchpoint);
+    updateWatchedPages();
+}
+
+void MemoryManagmentUnit::setWatchpoint(std::size_t index, const Watchpoint& watchpoint) {
+    if (!watchpoint.isValid())
+        throw std::invalid_argument("Watchpoint watches nothing");
+    watchpoints_.at(index) = watchpoint;
+    updateWatchedPages();
+}
+
+void MemoryManagmentUnit::removeWatchpoint(std::size_t index) {
+    if (index >= watchpoints_.size())
+        throw std::out_of_range("Watchpoint index out of range");
+    watchpoints_.erase(watchpoints_.begin() + static_cast<std::ptrdiff_t>(index));
+    updateWatchedPages();
+}
+
+void MemoryManagmentUnit::clearAllWatchpoints() {
+    watchpoints_.clear();
+    updateWatchedPages();
+}
+
+void MemoryManagmentUnit::updateWatchedPages() {
+    watched_pages_.fill(0);
+    for (const Watchpoint& watchpoint : watchpoints_) {
+        for (unsigned page = watchpoint.first >> 8; page <= (watchpoint.last >> 8); ++page)
+            watched_pages_[page] |= watchpoint.access;
+    }
+    cpu_.setWatchpointsEnabled(!watchpoints_.empty());
+    updatePages();
+}
 
-        default:
+void MemoryManagmentUnit::checkWatchpoints(Word address, Byte value, Watchpoint::Access access) {
+    for (std::size_t i = 0; i < watchpoints_.size(); ++i) {
+        const Watchpoint& watchpoint = watchpoints_[i];
+        if (address >= watchpoint.first && address <= watchpoint.last &&
+            (watchpoint.access & access) && (!watchpoint.value || *watchpoint.value == value)) {
+            has_watchpoint_hit_ = true;
+            last_watchpoint_hit_ = WatchpointHit{i, address, value, access};
             return;
+        }
+    }
+}
+
+bool MemoryManagmentUnit::takeWatchpointHit() {
+    bool has_hit = has_watchpoint_hit_;
+    has_watchpoint_hit_ = false;
+    return has_hit;
+}
+
+bool MemoryManagmentUnit::checkExecuteWatchpoints(Word address) {
+    if (!(watched_pages_[address >> 8] & Watchpoint::Execute))
+        return false;
+    checkWatchpoints(address, loadDirect(address), Watchpoint::Execute);
+    return takeWatchpointHit();
+}
+
+uint16_t MemoryManagmentUnit::getBank(Word address) const {
+    if (address < 0x4000) return cartridge_ ? cartridge_->getFixedRomBank() : 0;
+    if (address < 0x8000) return cartridge_ ? cartridge_->getSelectedRomBank() : 0;
+    if (address < 0xA000)
+        return static_cast<uint16_t>((selected_vram_bank_ - vram_.cbegin()) / 0x2000);
+    if (address < 0xC000)
+        return cartridge_ ? cartridge_->getSelectedExternRamBank() : 0;
+    if (address >= 0xD000 && address < 0xE000)
+        return static_cast<uint16_t>((selected_wram_bank_ - wram_.cbegin()) / 0x1000);
+    return 0;
+}
+
+MemoryManagmentUnit::IoValueWindow MemoryManagmentUnit::getIoValueWindow(Word address) {
+    switch (address) {
+        // Only changed by writes, STAT is not as its mode bits follow the PPU
+        case 0xFF06: case 0xFF07:
+        case 0xFF40: case 0xFF42: case 0xFF43: case 0xFF45:
+        case 0xFFFF:
+            return {0, TCycle_never};
+
+        case 0xFF04:
+            return {gb_.getTimer().getLastDivChange(), gb_.getTimer().getNextDivChange()};
+        case 0xFF05:
+            return {gb_.getTimer().getLastTimaChange(), gb_.getTimer().getNextTimaChange()};
+        case 0xFF41:
+            return {gb_.getPpu().getLastStatChange(), gb_.getPpu().getNextStatChange()};
+        case 0xFF44:
+            return {gb_.getPpu().getLastLyChange(), gb_.getPpu().getNextLyChange()};
     }
+
+    return {TCycle_never, 0};
 }
 
 void MemoryManagmentUnit::loadCartridge(Cartridge&& cartridge) {
     cartridge_ = std::make_unique<Cartridge>(std::move(cartridge));
+    cartridge_->connectClock(cpu_.getClock());
+    updateBankPages();
+}
+
+void MemoryManagmentUnit::mapPages(Word address, std::size_t size, const Byte* readable,
+                                   Byte* writable) {
+    for (std::size_t offset = 0; offset < size; offset += 0x100) {
+        memory_read_pages_[(address + offset) >> 8] = readable ? readable + offset : nullptr;
+        memory_write_pages_[(address + offset) >> 8] = writable ? writable + offset : nullptr;
+    }
+    updatePages(address >> 8, (address + size) >> 8);
+}
+
+void MemoryManagmentUnit::updatePages(std::size_t first_page, std::size_t end_page) {
+    bool needs_every_access = is_dma_routing_;
+#if GBC_HAS_MEMORY_PROFILER
+    needs_every_access |= is_profiling_;
+#endif
+    for (std::size_t page = first_page; page < end_page; ++page) {
+        bool is_read_watched = needs_every_access || (watched_pages_[page] & Watchpoint::Read);
+        bool is_write_watched = needs_every_access || (watched_pages_[page] & Watchpoint::Write);
+        read_pages_[page] = is_read_watched ? nullptr : memory_read_pages_[page];
+        write_pages_[page] = is_write_watched ? nullptr : memory_write_pages_[page];
+    }
+}
+
+void MemoryManagmentUnit::setDmaRouting(bool enabled) {
+    if (is_dma_routing_ == enabled) return;
+    is_dma_routing_ = enabled;
+    updatePages();
+}
+
+TCycleCount MemoryManagmentUnit::catchUpHaltedDma() {
+    if (!is_dma_routing_) return TCycle_never;
+    gb_.getDma().catchUp(true);
+    return getDmaDeadline();
+}
+
+TCycleCount MemoryManagmentUnit::getDmaDeadline() const {
+    return is_dma_routing_ ? gb_.getDma().getNextHdmaBlock() : TCycle_never;
+}
+
+#if GBC_HAS_MEMORY_PROFILER
+void MemoryManagmentUnit::setProfiling(bool enabled) {
+    if (is_profiling_ == enabled) return;
+    is_profiling_ = enabled;
+    profiler_.resume(cpu_.getClock().get());
+    updatePages();
+}
+#endif
+
+void MemoryManagmentUnit::updateCartridgePages() {
+    // Writes to ROM go to the mapper. The fixed bank only moves in MBC1 mode 1
+    if (memory_read_pages_[0x00] != cartridge_->getFixedRomBankMemory())
+        mapPages(0x0000, 0x4000, cartridge_->getFixedRomBankMemory(), nullptr);
+    mapPages(0x4000, 0x4000, cartridge_->getSelectedRomBankMemory(), nullptr);
+    mapPages(0xA000, 0x2000, cartridge_->getSelectedExternRamMemory(),
+             cartridge_->getWritableExternRamMemory());
+}
+
+void MemoryManagmentUnit::updateBankPages() {
+    if (cartridge_) {
+        mapPages(0x0000, 0x4000, cartridge_->getFixedRomBankMemory(), nullptr);
+        updateCartridgePages();
+    } else {
+        mapPages(0x0000, 0x8000, nullptr, nullptr);
+        mapPages(0xA000, 0x2000, nullptr, nullptr);
+    }
+
+    // VRAM writes go through storeDirect, for its generations
+    mapPages(0x8000, 0x2000, &*selected_vram_bank_, nullptr);
+    mapPages(0xD000, 0x1000, &*selected_wram_bank_, &*selected_wram_bank_);
+    // Echo RAM is only mapped for reads, see storeToHandler
+    mapPages(0xF000, 0x0E00, &*selected_wram_bank_, nullptr);
 }
 
 void MemoryManagmentUnit::reset()
@@ -161,10 +429,31 @@ void MemoryManagmentUnit::reset()
     selected_wram_bank_ = wram_.begin() + 0x1000;
 
     oam_.fill(0);
-    io_.fill(0);
+    // Generations keep increasing, so consumers notice the reset
+    ++video_generation_;
+    vram_block_generations_.fill(video_generation_);
+    oam_block_generations_.fill(video_generation_);
+    io_.fill(0xFF);
     hram_.fill(0);
 
-    ie_ = 0;
+    // Watchpoints are kept
+    has_watchpoint_hit_ = false;
+    last_watchpoint_hit_.reset();
+
+    // OAM, unusable memory, I/O and HRAM always need a handler
+    is_dma_routing_ = false;
+#if GBC_HAS_MEMORY_PROFILER
+    // Profiling stays enabled, for the new run
+    profiler_.reset();
+#endif
+    memory_read_pages_.fill(nullptr);
+    memory_write_pages_.fill(nullptr);
+    updatePages();
+    mapPages(0xC000, 0x1000, wram_.data(), wram_.data());
+    mapPages(0xE000, 0x1000, wram_.data(), nullptr);
+    if (cartridge_)
+        cartridge_->reset();
+    updateBankPages();
 }
 
 }  // namespace GbcEmulator
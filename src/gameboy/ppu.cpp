@@ -1,38 +1,970 @@
 #include "ppu.hpp"
 
+#include <algorithm>
+#include <vector>
+
 #include "clock.hpp"
+#include "interrupt_scheduler.hpp"
+#include "mmu.hpp"
+#include "tile_decoder.hpp"
+#include "worker_pool.hpp"
 
 namespace GbcEmulator {
 
+namespace {
+
+// Shades of the DMG, from the lightest
+constexpr std::array<uint16_t, 4> dmg_shades = {0xFFFF, 0xAD6B, 0x5295, 0x0001};
+constexpr uint16_t blank_color = dmg_shades[0];
+
+// Tile rows decoded from a copy of VRAM, for the workers that can't share the tile cache
+class VramTileRows {
+public:
+    explicit VramTileRows(std::span<const Byte> vram) : vram_{vram} {}
+
+    std::array<Byte, 8> getRow(std::size_t tile_offset, unsigned row, bool is_flipped) const {
+        std::size_t offset = tile_offset + 2 * row;
+        return decodeTileRow(vram_[offset], vram_[offset + 1], is_flipped);
+    }
+
+private:
+    std::span<const Byte> vram_;
+};
+
+}  // namespace
+
+// Draws a visible line from its registers and video memory
+template <typename TileRows>
+class Ppu::LineRenderer {
+public:
+    LineRenderer(const LineState& state, std::span<const Byte> vram, std::span<const Byte> oam,
+                 TileRows& tile_rows, uint16_t* line)
+    : state_{state}, vram_{vram}, oam_{oam}, tile_rows_{tile_rows}, line_{line} {}
+
+    void render();
+
+private:
+    // Draws the tiles of a map from screen_x to end_x, map_x and map_y being the pixel of
+    // the map at screen_x
+    void renderTiles(int screen_x, int end_x, Word map_address, Byte map_x, Byte map_y);
+    void renderSprites();
+
+    const LineState& state_;
+    std::span<const Byte> vram_;
+    std::span<const Byte> oam_;
+    TileRows& tile_rows_;
+    uint16_t* line_;
+
+    // BG and window: color index, and the CGB BG priority attribute
+    std::array<Byte, screen_width> bg_color_indices_;
+    std::array<bool, screen_width> bg_priorities_;
+};
+
+// The frames of Deferred mode, one recorded by the emulation while the workers draw the other
+class Ppu::DeferredRenderer {
+public:
+    // A byte of VRAM, or of OAM from vram_size, written before the line of that index is drawn
+    struct VideoWrite {
+        uint16_t offset;
+        Byte value;
+        Byte line;
+    };
+
+    struct Frame {
+        // VRAM then OAM, at the start of the frame
+        std::array<Byte, vram_size + oam_size> memory;
+        std::vector<VideoWrite> writes;
+        std::array<LineState, screen_height> lines;
+        std::size_t line_count = 0;
+        std::array<uint16_t, screen_width*screen_height> pixels;
+    };
+
+    DeferredRenderer()
+    : recording_{std::make_unique<Frame>()}, rendering_{std::make_unique<Frame>()},
+      workers_{WorkerPool::getShared()},
+      chunk_memories_(std::min(workers_->getThreadCount(), max_chunk_count))
+    {}
+    DeferredRenderer(const DeferredRenderer&) = delete;
+    DeferredRenderer& operator=(const DeferredRenderer&) = delete;
+    // The workers may still be drawing the frame submitted
+    ~DeferredRenderer() { workers_->wait(job_); }
+
+    Frame& getRecordingFrame() { return *recording_; }
+
+    // Hands the recorded frame to the workers, and records into the other one
+    void submit();
+    constexpr bool isPending() const { return is_pending_; }
+    // Waits for the workers to be done with the frame submitted
+    const Frame& finish();
+
+    // Draws the recorded lines from first_line to end_line into pixels, replaying the writes
+    // on memory, which starts as the memory of the frame
+    static void renderLines(const Frame& frame, std::size_t first_line, std::size_t end_line,
+                            std::span<Byte> memory, uint16_t* pixels);
+
+private:
+    // A frame takes well under a millisecond to draw, more chunks would mostly copy memory
+    inline static constexpr std::size_t max_chunk_count = 4;
+
+    std::unique_ptr<Frame> recording_;
+    std::unique_ptr<Frame> rendering_;
+    bool is_pending_ = false;
+
+    // Shared by every Ppu of the process
+    std::shared_ptr<WorkerPool> workers_;
+    WorkerPool::Job job_;
+    // Each chunk of lines replays the writes on its own copy of the memory
+    std::vector<std::array<Byte, vram_size + oam_size>> chunk_memories_;
+};
+
+Ppu::Ppu(Clock& clock, InterruptScheduler& interrupt_scheduler, MemoryManagmentUnit& mmu)
+: clock_{clock}, interrupt_scheduler_{interrupt_scheduler}, mmu_{mmu}, tile_cache_{mmu}
+{
+    reset();
+}
+
+Ppu::~Ppu() = default;
+
+void Ppu::registerIoHandlers(MemoryManagmentUnit& mmu)
+{
+    mmu.registerIoHandler<&Ppu::getLcdc, &Ppu::setLcdc>(0xFF40, *this);
+    mmu.registerIoHandler<&Ppu::getStat, &Ppu::setStat>(0xFF41, *this, 0x80);
+    mmu.registerIoHandler<&Ppu::getScy, &Ppu::setScy>(0xFF42, *this);
+    mmu.registerIoHandler<&Ppu::getScx, &Ppu::setScx>(0xFF43, *this);
+    mmu.registerIoHandler<&Ppu::getLy, &Ppu::setLy>(0xFF44, *this);
+    mmu.registerIoHandler<&Ppu::getLyc, &Ppu::setLyc>(0xFF45, *this);
+    mmu.registerIoHandler<&Ppu::getBgp, &Ppu::setBgp>(0xFF47, *this);
+    mmu.registerIoHandler<&Ppu::getObp0, &Ppu::setObp0>(0xFF48, *this);
+    mmu.registerIoHandler<&Ppu::getObp1, &Ppu::setObp1>(0xFF49, *this);
+    mmu.registerIoHandler<&Ppu::getWy, &Ppu::setWy>(0xFF4A, *this);
+    mmu.registerIoHandler<&Ppu::getWx, &Ppu::setWx>(0xFF4B, *this);
+}
+
+void Ppu::registerCgbIoHandlers(MemoryManagmentUnit& mmu)
+{
+    mmu.registerIoHandler<&Ppu::getBcps, &Ppu::setBcps>(0xFF68, *this, 0x40);
+    mmu.registerIoHandler<&Ppu::getBcpd, &Ppu::setBcpd>(0xFF69, *this);
+    mmu.registerIoHandler<&Ppu::getOcps, &Ppu::setOcps>(0xFF6A, *this, 0x40);
+    mmu.registerIoHandler<&Ppu::getOcpd, &Ppu::setOcpd>(0xFF6B, *this);
+}
+
+void Ppu::setCgbMode(bool is_cgb_mode)
+{
+    catchUp();
+    is_cgb_mode_ = is_cgb_mode;
+    updatePalettes();
+}
+
+void Ppu::setRenderMode(RenderMode mode)
+{
+    catchUp();
+    if (mode == RenderMode::Deferred && !deferred_)
+        deferred_ = std::make_unique<DeferredRenderer>();
+    if (mode != RenderMode::Deferred)
+    {
+        flushRecordedLines();
+        publishDeferredFrame();
+    }
+    render_mode_ = mode;
+    // No mode draws anything before the end of the OAM scan
+    if (scanline_x < oam_scan_dot_count)
+    {
+        startScanline();
+        rescheduleInterrupts();
+    }
+}
+
+void Ppu::updatePalettes()
+{
+    for (std::size_t palette = 0; palette < bg_palettes_.size(); ++palette)
+    {
+        bg_palettes_[palette] = is_cgb_mode_ ? decodeCgbPalette(&bg_palette_memory_[8 * palette])
+                                             : decodeDmgPalette(bgp);
+        obj_palettes_[palette] = is_cgb_mode_ ? decodeCgbPalette(&obj_palette_memory_[8 * palette])
+                                              : decodeDmgPalette(palette & 1 ? obp1 : obp0);
+    }
+}
+
+void Ppu::setBgp(Byte byte)
+{
+    catchUp();
+    bgp = byte;
+    if (!is_cgb_mode_)
+        bg_palettes_[0] = decodeDmgPalette(bgp);
+}
+
+void Ppu::setObp0(Byte byte)
+{
+    catchUp();
+    obp0 = byte;
+    if (!is_cgb_mode_)
+        obj_palettes_[0] = decodeDmgPalette(obp0);
+}
+
+void Ppu::setObp1(Byte byte)
+{
+    catchUp();
+    obp1 = byte;
+    if (!is_cgb_mode_)
+        obj_palettes_[1] = decodeDmgPalette(obp1);
+}
+
+void Ppu::setBcpd(Byte byte)
+{
+    catchUp();
+    Byte index = bcps_ & 0x3F;
+    bg_palette_memory_[index] = byte;
+    bg_palettes_[index / 8] = decodeCgbPalette(&bg_palette_memory_[index & 0x38]);
+    if (bcps_ & 0x80)
+        bcps_ = 0x80 | ((index + 1) & 0x3F);
+}
+
+void Ppu::setOcpd(Byte byte)
+{
+    catchUp();
+    Byte index = ocps_ & 0x3F;
+    obj_palette_memory_[index] = byte;
+    obj_palettes_[index / 8] = decodeCgbPalette(&obj_palette_memory_[index & 0x38]);
+    if (ocps_ & 0x80)
+        ocps_ = 0x80 | ((index + 1) & 0x3F);
+}
+
+Ppu::Palette Ppu::decodeDmgPalette(Byte value)
+{
+    return {dmg_shades[value & 0x3], dmg_shades[(value >> 2) & 0x3],
+            dmg_shades[(value >> 4) & 0x3], dmg_shades[(value >> 6) & 0x3]};
+}
+
+// BGR 555 little endian colors to RGBA 5551
+Ppu::Palette Ppu::decodeCgbPalette(const Byte* memory)
+{
+    Palette palette;
+    for (std::size_t i = 0; i < palette.size(); ++i)
+    {
+        unsigned color = memory[2 * i] | memory[2 * i + 1] << 8;
+        unsigned red = color & 0x1F, green = (color >> 5) & 0x1F, blue = (color >> 10) & 0x1F;
+        palette[i] = static_cast<uint16_t>(red << 11 | green << 6 | blue << 1 | 1);
+    }
+    return palette;
+}
+
 void Ppu::catchUp()
 {
     TCycleCount now = clock_.get();
     TCycleCount delta = now - last_timestamp_;
     last_timestamp_ = now;
 
-    while (delta >= scanline_dot_count)
+    // Stops at the line ends, and on the visible lines at the end of the pixel transfer in
+    // Scanline mode to draw them, at the end of the OAM scan in PixelFifo mode to go dot by dot
+    while (delta)
+    {
+        bool is_line_pending = ly < screen_height && !is_line_drawn_;
+        bool is_fifo_line = line_render_mode_ == RenderMode::PixelFifo;
+        if (is_line_pending && is_fifo_line && scanline_x >= oam_scan_dot_count)
+        {
+            TCycleCount step = runPixelFifo(delta);
+            delta -= step;
+            scanline_x = static_cast<uint16_t>(scanline_x + step);
+            updateStatLine();
+            continue;
+        }
+
+        int line_boundary = is_fifo_line ? oam_scan_dot_count : hblank_start_dot;
+        int boundary = is_line_pending ? line_boundary : scanline_dot_count;
+        // The end of the OAM scan lowers the STAT line when it was raised by it
+        if ((stat & 0x20) && ly < screen_height && scanline_x < oam_scan_dot_count)
+            boundary = oam_scan_dot_count;
+        TCycleCount step =
+            std::min<TCycleCount>(delta, static_cast<TCycleCount>(boundary - scanline_x));
+        delta -= step;
+        scanline_x = static_cast<uint16_t>(scanline_x + step);
+
+        if (scanline_x == line_boundary && is_line_pending)
+        {
+            if (is_fifo_line)
+                startPixelFifo();
+            else
+            {
+                renderScanline();
+                is_line_drawn_ = true;
+            }
+        }
+
+        if (scanline_x == scanline_dot_count)
+        {
+            scanline_x = 0;
+            if (++ly >= scanline_count)
+            {
+                ly = 0;
+                is_window_triggered_ = false;
+                window_line_ = 0;
+            }
+            else if (ly == screen_height)
+                finishFrame();
+            startScanline();
+        }
+        updateStatLine();
+    }
+}
+
+void Ppu::startScanline()
+{
+    line_render_mode_ = render_mode_;
+    is_line_drawn_ = false;
+    // Unknown until the pixel transfer ends in PixelFifo mode
+    hblank_dot_ = line_render_mode_ == RenderMode::PixelFifo ? scanline_dot_count : hblank_start_dot;
+    if (ly == 0 && line_render_mode_ == RenderMode::Deferred)
+        startRecordingFrame();
+}
+
+Byte Ppu::getMode() const
+{
+    if (!(lcdc & 0x80))
+        return 0;
+    if (ly >= screen_height)
+        return 1;
+    if (scanline_x < oam_scan_dot_count)
+        return 2;
+    return scanline_x < hblank_dot_ ? 3 : 0;
+}
+
+bool Ppu::isStatLineHigh() const
+{
+    if (!(lcdc & 0x80))
+        return false;
+    // HBlank, VBlank and OAM scan are the bits 3 to 5, LY=LYC the bit 6
+    Byte mode = getMode();
+    return (mode != 3 && (stat & (0x08 << mode))) || ((stat & 0x40) && ly == lyc);
+}
+
+void Ppu::updateStatLine()
+{
+    bool is_high = isStatLineHigh();
+    has_stat_risen_ |= is_high && !is_stat_line_high_;
+    is_stat_line_high_ = is_high;
+}
+
+void Ppu::rescheduleInterrupts()
+{
+    // What was due before the write is requested first
+    interrupt_scheduler_.catchUp();
+    updateStatLine();
+    interrupt_scheduler_.reschedule(InterruptType::VBlank, getNextVBlankInterrupt());
+    interrupt_scheduler_.reschedule(InterruptType::LCD, getNextStatInterrupt());
+}
+
+Ppu::LineState Ppu::captureLine()
+{
+    LineState state{ly, lcdc, scx, scy, screen_width, window_line_, is_cgb_mode_,
+                    bg_palettes_, obj_palettes_};
+
+    // Without LCDC bit 0, the DMG has neither BG nor window, the CGB draws them under the sprites
+    bool is_bg_shown = is_cgb_mode_ || (lcdc & 0x01);
+    if ((lcdc & 0x80) && is_bg_shown)
     {
-        delta -= scanline_dot_count;
-        if (++ly >= scanline_count)
-            ly -= scanline_count;
+        if (ly == wy)
+            is_window_triggered_ = true;
+        if ((lcdc & 0x20) && is_window_triggered_ && wx <= 166)
+        {
+            state.window_x = wx - 7;
+            ++window_line_;
+        }
     }
-    
-    scanline_x += delta;
-    if (scanline_x >= scanline_dot_count)
+    return state;
+}
+
+void Ppu::renderScanline()
+{
+    LineState state = captureLine();
+    if (is_recording_frame_)
+    {
+        DeferredRenderer::Frame& frame = deferred_->getRecordingFrame();
+        frame.lines[frame.line_count++] = state;
+        return;
+    }
+
+    LineRenderer renderer{state, mmu_.getVram(), mmu_.getOam(), tile_cache_,
+                          &pixel_data_[ly * screen_width]};
+    renderer.render();
+}
+
+std::size_t Ppu::getBgTileOffset(Byte lcdc, Byte tile_index)
+{
+    // Either 0x8000 + unsigned index, or 0x9000 + signed index
+    return lcdc & 0x10 ? tile_index * 16u
+                       : static_cast<std::size_t>(0x1000 + static_cast<int8_t>(tile_index) * 16);
+}
+
+std::size_t Ppu::scanOam(std::span<const Byte> oam, Byte ly, Byte lcdc, SpriteList& sprites)
+{
+    int height = lcdc & 0x04 ? 16 : 8;
+    std::size_t sprite_count = 0;
+    for (std::size_t sprite = 0; sprite < 40 && sprite_count < sprites.size(); ++sprite)
     {
-        scanline_x -= scanline_dot_count;
-        if (++ly >= scanline_count)
-            ly -= scanline_count;
+        int row = ly + 16 - oam[4 * sprite];
+        if (row >= 0 && row < height)
+            sprites[sprite_count++] = sprite;
     }
+    return sprite_count;
+}
+
+template <typename TileRows>
+std::array<Byte, 8> Ppu::decodeSpriteRow(const Byte* entry, Byte ly, Byte lcdc,
+                                         bool is_cgb_mode, TileRows& tile_rows)
+{
+    int height = lcdc & 0x04 ? 16 : 8;
+    Byte attributes = entry[3];
+    // LCDC can shrink the sprites after the OAM scan
+    int row = (ly + 16 - entry[0]) & (height - 1);
+    if (attributes & 0x40)
+        row = height - 1 - row;
+    Byte tile_index = height == 16 ? entry[2] & 0xFE : entry[2];
+    // The bottom half of 16 pixels high sprites is the next tile
+    std::size_t tile_offset = (tile_index + static_cast<unsigned>(row) / 8u) * 16u
+                            + (is_cgb_mode && (attributes & 0x08) ? 0x2000 : 0);
+    return tile_rows.getRow(tile_offset, static_cast<unsigned>(row) % 8u, attributes & 0x20);
+}
+
+template <typename TileRows>
+void Ppu::LineRenderer<TileRows>::render()
+{
+    Byte lcdc = state_.lcdc;
+    if (!(lcdc & 0x80))
+    {
+        std::fill_n(line_, screen_width, blank_color);
+        return;
+    }
+
+    if (state_.is_cgb_mode || (lcdc & 0x01))
+    {
+        // BG is only drawn left of the window
+        Byte map_y = static_cast<Byte>(state_.scy + state_.ly);
+        renderTiles(0, state_.window_x, lcdc & 0x08 ? 0x9C00 : 0x9800, state_.scx, map_y);
+        if (state_.window_x < screen_width)
+            renderTiles(state_.window_x, screen_width, lcdc & 0x40 ? 0x9C00 : 0x9800, 0,
+                        state_.window_line);
+    }
+    else
+    {
+        std::fill_n(line_, screen_width, blank_color);
+        bg_color_indices_.fill(0);
+        bg_priorities_.fill(false);
+    }
+
+    if (lcdc & 0x02)
+        renderSprites();
+}
+
+template <typename TileRows>
+void Ppu::LineRenderer<TileRows>::renderTiles(int screen_x, int end_x, Word map_address,
+                                              Byte map_x, Byte map_y)
+{
+    std::size_t map_row = (map_address - 0x8000u) + (map_y / 8u) * 32u;
+
+    // The window can start left of the screen
+    if (screen_x < 0)
+        map_x = static_cast<Byte>(map_x - screen_x);
+    std::size_t x = static_cast<std::size_t>(std::max(screen_x, 0));
+    auto end = static_cast<std::size_t>(std::max(end_x, 0));
+
+    while (x < end)
+    {
+        std::size_t map_offset = map_row + map_x / 8u;
+        Byte tile_index = vram_[map_offset];
+        // CGB attributes: palette, VRAM bank, flips and priority over the sprites
+        Byte attributes = state_.is_cgb_mode ? vram_[0x2000 + map_offset] : 0;
+
+        unsigned tile_y = map_y % 8u;
+        if (attributes & 0x40)
+            tile_y = 7 - tile_y;
+        std::size_t tile_offset =
+            getBgTileOffset(state_.lcdc, tile_index) + (attributes & 0x08 ? 0x2000 : 0);
+        const auto& indices = tile_rows_.getRow(tile_offset, tile_y, attributes & 0x20);
+        const Palette& palette = state_.bg_palettes[attributes & 0x07];
+        bool has_priority = attributes & 0x80;
+
+        std::size_t first_pixel = map_x % 8u;
+        std::size_t pixel_count = std::min<std::size_t>(8 - first_pixel, end - x);
+        for (std::size_t pixel = first_pixel; pixel < first_pixel + pixel_count; ++pixel, ++x)
+        {
+            bg_color_indices_[x] = indices[pixel];
+            bg_priorities_[x] = has_priority;
+            line_[x] = palette[indices[pixel]];
+        }
+        map_x = static_cast<Byte>(map_x + pixel_count);
+    }
+}
+
+template <typename TileRows>
+void Ppu::LineRenderer<TileRows>::renderSprites()
+{
+    // The first 10 sprites on the line, the DMG favors the leftmost one, then the first in OAM,
+    // the CGB only the first in OAM
+    SpriteList sprites;
+    std::size_t sprite_count = scanOam(oam_, state_.ly, state_.lcdc, sprites);
+    if (!state_.is_cgb_mode)
+        std::stable_sort(sprites.begin(), sprites.begin() + sprite_count,
+                         [this](std::size_t a, std::size_t b) {
+                             return oam_[4 * a + 1] < oam_[4 * b + 1];
+                         });
+
+    // The pixel of the sprite with the highest priority is the one compared to BG,
+    // even when BG then hides it
+    std::array<bool, screen_width> is_pixel_taken{};
+    // Without LCDC bit 0, the CGB draws the sprites over everything
+    bool has_bg_priority = !state_.is_cgb_mode || (state_.lcdc & 0x01);
+
+    for (std::size_t i = 0; i < sprite_count; ++i)
+    {
+        const Byte* sprite = &oam_[4 * sprites[i]];
+        Byte attributes = sprite[3];
+        auto indices = decodeSpriteRow(sprite, state_.ly, state_.lcdc, state_.is_cgb_mode,
+                                       tile_rows_);
+        const Palette& palette =
+            state_.obj_palettes[state_.is_cgb_mode ? attributes & 0x07 : (attributes >> 4) & 1];
+
+        // Sprites are 8 pixels to the left of their X, so they can be partly shown
+        for (std::size_t pixel = 0; pixel < 8; ++pixel)
+        {
+            std::size_t x = sprite[1] + pixel - 8;
+            if (x >= screen_width || !indices[pixel] || is_pixel_taken[x])
+                continue;
+            is_pixel_taken[x] = true;
+            bool is_behind_bg = has_bg_priority && bg_color_indices_[x]
+                             && ((attributes & 0x80) || bg_priorities_[x]);
+            if (!is_behind_bg)
+                line_[x] = palette[indices[pixel]];
+        }
+    }
+}
+
+void Ppu::startRecordingFrame()
+{
+    flushRecordedLines();
+
+    DeferredRenderer::Frame& frame = deferred_->getRecordingFrame();
+    std::span<const Byte> vram = mmu_.getVram();
+    std::span<const Byte> oam = mmu_.getOam();
+    std::copy(vram.begin(), vram.end(), frame.memory.begin());
+    std::copy(oam.begin(), oam.end(), frame.memory.begin() + vram_size);
+    frame.writes.clear();
+    frame.line_count = 0;
+    is_recording_frame_ = true;
+}
+
+void Ppu::recordVideoWrite(std::size_t offset, std::size_t size)
+{
+    DeferredRenderer::Frame& frame = deferred_->getRecordingFrame();
+    std::span<const Byte> memory = offset < vram_size ? mmu_.getVram()
+                                                      : mmu_.getOam().subspan(offset - vram_size);
+    std::size_t memory_offset = offset < vram_size ? offset : 0;
+    for (std::size_t i = 0; i < size; ++i)
+        frame.writes.push_back({static_cast<uint16_t>(offset + i), memory[memory_offset + i],
+                                static_cast<Byte>(frame.line_count)});
+}
+
+void Ppu::flushRecordedLines()
+{
+    if (!is_recording_frame_)
+        return;
+    is_recording_frame_ = false;
+
+    // Nothing else reads the memory of the recorded frame, the writes are replayed on it
+    DeferredRenderer::Frame& frame = deferred_->getRecordingFrame();
+    DeferredRenderer::renderLines(frame, 0, frame.line_count, frame.memory, pixel_data_.data());
+}
+
+void Ppu::finishFrame()
+{
+    publishDeferredFrame();
+    if (is_recording_frame_ && deferred_->getRecordingFrame().line_count == screen_height)
+    {
+        is_recording_frame_ = false;
+        deferred_->submit();
+        return;
+    }
+
+    flushRecordedLines();
+    screen_ = pixel_data_;
+    ++frame_count_;
+}
+
+void Ppu::publishDeferredFrame()
+{
+    if (!deferred_ || !deferred_->isPending())
+        return;
+    screen_ = deferred_->finish().pixels;
+    ++frame_count_;
+}
+
+void Ppu::DeferredRenderer::submit()
+{
+    std::swap(recording_, rendering_);
+    is_pending_ = true;
+
+    // Contiguous lines per chunk, each starting from the memory at the start of the frame
+    std::size_t chunk_count = chunk_memories_.size();
+    workers_->start(job_, chunk_count, [this, chunk_count](std::size_t chunk) {
+        Frame& frame = *rendering_;
+        auto& memory = chunk_memories_[chunk];
+        std::size_t first_line = chunk * frame.line_count / chunk_count;
+        std::size_t end_line = (chunk + 1) * frame.line_count / chunk_count;
+        memory = frame.memory;
+        renderLines(frame, first_line, end_line, memory, frame.pixels.data());
+    });
+}
+
+const Ppu::DeferredRenderer::Frame& Ppu::DeferredRenderer::finish()
+{
+    workers_->wait(job_);
+    is_pending_ = false;
+    return *rendering_;
+}
+
+void Ppu::DeferredRenderer::renderLines(const Frame& frame, std::size_t first_line,
+                                        std::size_t end_line, std::span<Byte> memory,
+                                        uint16_t* pixels)
+{
+    std::span<const Byte> vram = memory.first(vram_size);
+    std::span<const Byte> oam = memory.subspan(vram_size, oam_size);
+    VramTileRows tile_rows{vram};
+
+    auto write = frame.writes.begin();
+    for (std::size_t line = 0; line < end_line; ++line)
+    {
+        // The writes made before the line was drawn
+        for (; write != frame.writes.end() && write->line <= line; ++write)
+            memory[write->offset] = write->value;
+        if (line < first_line)
+            continue;
+
+        const LineState& state = frame.lines[line];
+        LineRenderer renderer{state, vram, oam, tile_rows, &pixels[state.ly * screen_width]};
+        renderer.render();
+    }
+}
+
+void Ppu::startPixelFifo()
+{
+    if (!(lcdc & 0x80))
+    {
+        std::fill_n(&pixel_data_[ly * screen_width], screen_width, blank_color);
+        is_line_drawn_ = true;
+        hblank_dot_ = hblank_start_dot;
+        return;
+    }
+
+    if ((is_cgb_mode_ || (lcdc & 0x01)) && ly == wy)
+        is_window_triggered_ = true;
+
+    // Sprites are fetched as the FIFO reaches them, from the left, then in OAM order
+    std::span<const Byte> oam = mmu_.getOam();
+    line_sprite_count_ = scanOam(oam, ly, lcdc, line_sprites_);
+    std::stable_sort(line_sprites_.begin(), line_sprites_.begin() + line_sprite_count_,
+                     [oam](std::size_t a, std::size_t b) {
+                         return oam[4 * a + 1] < oam[4 * b + 1];
+                     });
+    next_sprite_ = 0;
+    is_sprite_pending_ = false;
+    sprite_fetch_dots_ = 0;
+
+    bg_fifo_head_ = bg_fifo_.size();
+    obj_fifo_.fill({});
+    fetch_step_ = -6;
+    fetch_x_ = 0;
+    is_fetching_window_ = false;
+    discarded_pixel_count_ = scx % 8;
+    fifo_x_ = 0;
+}
+
+TCycleCount Ppu::runPixelFifo(TCycleCount dot_count)
+{
+    TCycleCount dot = 0;
+    while (dot < dot_count && fifo_x_ < screen_width)
+    {
+        ++dot;
+        if (sprite_fetch_dots_)
+        {
+            --sprite_fetch_dots_;
+            continue;
+        }
+        if (!is_sprite_pending_)
+            shiftPixelOut();
+        // A sprite waits for the BG fetcher to have its tile data, then stops it for 6 dots
+        if (is_sprite_pending_ && fetch_step_ >= 5)
+            fetchSprite();
+        else
+            stepFetcher();
+    }
+
+    if (fifo_x_ == screen_width)
+    {
+        is_line_drawn_ = true;
+        hblank_dot_ = static_cast<uint16_t>(scanline_x + dot);
+        if (is_fetching_window_)
+            ++window_line_;
+    }
+    return dot;
+}
+
+void Ppu::stepFetcher()
+{
+    if (fetch_step_ < 6)
+    {
+        std::span<const Byte> vram = mmu_.getVram();
+        switch (++fetch_step_)
+        {
+            case 1:
+            {
+                Word map_address = is_fetching_window_ ? (lcdc & 0x40 ? 0x9C00 : 0x9800)
+                                                       : (lcdc & 0x08 ? 0x9C00 : 0x9800);
+                unsigned map_x = is_fetching_window_ ? fetch_x_ : scx / 8u + fetch_x_;
+                Byte map_y = is_fetching_window_ ? window_line_ : static_cast<Byte>(scy + ly);
+                std::size_t map_offset = (map_address - 0x8000u) + (map_y / 8u) * 32u + map_x % 32u;
+                fetch_tile_index_ = vram[map_offset];
+                fetch_attributes_ = is_cgb_mode_ ? vram[0x2000 + map_offset] : 0;
+                break;
+            }
+            case 3:
+            {
+                Byte map_y = is_fetching_window_ ? window_line_ : static_cast<Byte>(scy + ly);
+                unsigned tile_y = map_y % 8u;
+                if (fetch_attributes_ & 0x40)
+                    tile_y = 7 - tile_y;
+                fetch_row_offset_ = getBgTileOffset(lcdc, fetch_tile_index_) + 2 * tile_y
+                                  + (fetch_attributes_ & 0x08 ? 0x2000 : 0);
+                fetch_low_ = vram[fetch_row_offset_];
+                break;
+            }
+            case 5:
+                fetch_high_ = vram[fetch_row_offset_ + 1];
+                break;
+        }
+    }
+
+    if (fetch_step_ == 6 && bg_fifo_head_ == bg_fifo_.size())
+    {
+        auto indices = decodeTileRow(fetch_low_, fetch_high_, fetch_attributes_ & 0x20);
+        for (std::size_t pixel = 0; pixel < bg_fifo_.size(); ++pixel)
+            bg_fifo_[pixel] = {indices[pixel], static_cast<Byte>(fetch_attributes_ & 0x07),
+                               (fetch_attributes_ & 0x80) != 0, 0};
+        bg_fifo_head_ = 0;
+        fetch_step_ = 0;
+        ++fetch_x_;
+    }
+}
+
+void Ppu::shiftPixelOut()
+{
+    // Waits for the first tile, or the first window tile
+    if (bg_fifo_head_ == bg_fifo_.size())
+        return;
+
+    bool is_bg_shown = is_cgb_mode_ || (lcdc & 0x01);
+    if (!is_fetching_window_ && is_bg_shown && (lcdc & 0x20) && is_window_triggered_
+        && fifo_x_ + 7 >= wx)
+    {
+        // The fetcher starts over from the first tile of the window
+        is_fetching_window_ = true;
+        bg_fifo_head_ = bg_fifo_.size();
+        fetch_step_ = 0;
+        fetch_x_ = 0;
+        discarded_pixel_count_ = wx < 7 ? 7 - wx : 0;
+        return;
+    }
+
+    std::span<const Byte> oam = mmu_.getOam();
+    for (; next_sprite_ < line_sprite_count_; ++next_sprite_)
+    {
+        if (oam[4 * line_sprites_[next_sprite_] + 1] > fifo_x_ + 8)
+            break;
+        // Without LCDC bit 1, the sprites are skipped
+        if (lcdc & 0x02)
+        {
+            is_sprite_pending_ = true;
+            return;
+        }
+    }
+
+    FifoPixel bg = bg_fifo_[bg_fifo_head_++];
+    if (discarded_pixel_count_)
+    {
+        --discarded_pixel_count_;
+        return;
+    }
+
+    FifoPixel obj = obj_fifo_[fifo_x_ % 8];
+    obj_fifo_[fifo_x_ % 8] = {};
+    Byte bg_color_index = is_bg_shown ? bg.color_index : 0;
+    uint16_t color = is_bg_shown ? bg_palettes_[bg.palette][bg.color_index] : blank_color;
+    // Without LCDC bit 0, the CGB draws the sprites over everything
+    bool has_bg_priority = !is_cgb_mode_ || (lcdc & 0x01);
+    bool is_behind_bg = has_bg_priority && bg_color_index && (obj.has_priority || bg.has_priority);
+    if (obj.color_index && (lcdc & 0x02) && !is_behind_bg)
+        color = obj_palettes_[obj.palette][obj.color_index];
+    pixel_data_[ly * screen_width + fifo_x_++] = color;
+}
+
+void Ppu::fetchSprite()
+{
+    std::size_t sprite = line_sprites_[next_sprite_++];
+    const Byte* entry = &mmu_.getOam()[4 * sprite];
+    Byte attributes = entry[3];
+    auto indices = decodeSpriteRow(entry, ly, lcdc, is_cgb_mode_, tile_cache_);
+    auto palette = static_cast<Byte>(is_cgb_mode_ ? attributes & 0x07 : (attributes >> 4) & 1);
+
+    // Only fills the pixels no sprite took yet, or on CGB took with a later OAM entry
+    for (std::size_t pixel = 0; pixel < 8; ++pixel)
+    {
+        std::size_t x = entry[1] + pixel - 8;
+        if (x < fifo_x_ || x >= screen_width || !indices[pixel])
+            continue;
+        FifoPixel& fifo_pixel = obj_fifo_[x % 8];
+        if (fifo_pixel.color_index && !(is_cgb_mode_ && sprite < fifo_pixel.oam_index))
+            continue;
+        fifo_pixel = {indices[pixel], palette, (attributes & 0x80) != 0, sprite};
+    }
+
+    is_sprite_pending_ = false;
+    sprite_fetch_dots_ = 5;
+}
+
+TCycleCount Ppu::getLastLyChange()
+{
+    catchUp();
+    return clock_.get() - scanline_x;
+}
+
+TCycleCount Ppu::getNextLyChange()
+{
+    catchUp();
+    return clock_.get() + (scanline_dot_count - scanline_x);
+}
+
+TCycleCount Ppu::getLastStatChange()
+{
+    catchUp();
+    TCycleCount line_start = clock_.get() - scanline_x;
+    if (!(lcdc & 0x80) || ly >= screen_height || scanline_x < oam_scan_dot_count)
+        return line_start;
+    return line_start + (scanline_x < hblank_dot_ ? oam_scan_dot_count : hblank_dot_);
+}
+
+TCycleCount Ppu::getNextStatChange()
+{
+    catchUp();
+    TCycleCount line_start = clock_.get() - scanline_x;
+    if (!(lcdc & 0x80) || ly >= screen_height || scanline_x >= hblank_dot_)
+        return line_start + scanline_dot_count;
+    if (scanline_x < oam_scan_dot_count)
+        return line_start + oam_scan_dot_count;
+    return is_line_drawn_ ? line_start + hblank_dot_ : clock_.get() + 1;
+}
+
+int Ppu::getHBlankDot(bool is_current_line) const
+{
+    if (!is_current_line)
+        return render_mode_ == RenderMode::PixelFifo ? hblank_start_dot + scx % 8 : hblank_start_dot;
+    if (is_line_drawn_ || line_render_mode_ != RenderMode::PixelFifo)
+        return hblank_dot_;
+    return std::max(hblank_start_dot + scx % 8, scanline_x + 1);
+}
+
+TCycleCount Ppu::getNextHBlank(TCycleCount since)
+{
+    if (!(lcdc & 0x80)) return TCycle_never;
+
+    catchUp();
+    int64_t frame_start = static_cast<int64_t>(clock_.get() - scanline_x) - ly * scanline_dot_count;
+    int64_t frame_offset = (static_cast<int64_t>(since) - frame_start) % full_frame_dot_count;
+    if (frame_offset < 0)
+        frame_offset += full_frame_dot_count;
+    TCycleCount since_frame_start = since - static_cast<TCycleCount>(frame_offset);
+    bool is_current_frame = static_cast<int64_t>(since_frame_start) == frame_start;
+
+    int line = static_cast<int>(frame_offset / scanline_dot_count);
+    int dot = static_cast<int>(frame_offset % scanline_dot_count);
+    if (line >= screen_height || dot >= getHBlankDot(is_current_frame && line == ly))
+        ++line;
+    // Past the last visible line, the next HBlank is on line 0 of the next frame
+    if (line >= screen_height)
+        line = scanline_count;
+    int hblank_dot = getHBlankDot(is_current_frame && line == ly);
+    return since_frame_start + static_cast<TCycleCount>(line * scanline_dot_count + hblank_dot);
+}
+
+TCycleCount Ppu::getNextVBlankInterrupt()
+{
+    if (!(lcdc & 0x80)) return TCycle_never;
+
+    catchUp();
+    // The next start of line 144, the one of the next frame if it is now
+    int line_count = ly < screen_height ? screen_height - ly : scanline_count - ly + screen_height;
+    TCycleCount vblank_start = clock_.get() - scanline_x
+                             + static_cast<TCycleCount>(line_count * scanline_dot_count);
+    return vblank_start - 1;
+}
+
+TCycleCount Ppu::getNextStatInterrupt()
+{
+    catchUp();
+    // Not requested yet, it is requested right away
+    if (has_stat_risen_)
+        return clock_.get();
+    if (!(lcdc & 0x80) || !(stat & 0x78))
+        return TCycle_never;
+    // LY=LYC only changes with LY, the mode sources with the mode
+    TCycleCount next_change = stat & 0x38 ? getNextStatChange() : getNextLyChange();
+    return next_change - 1;
+}
+
+bool Ppu::takeStatInterrupt()
+{
+    catchUp();
+    bool has_risen = has_stat_risen_;
+    has_stat_risen_ = false;
+    return has_risen;
 }
 
 void Ppu::reset()
 {
+    // The frames of Deferred mode belong to the previous run
+    if (deferred_ && deferred_->isPending())
+        deferred_->finish();
+    is_recording_frame_ = false;
+
     last_timestamp_ = 0;
-    pixel_data_.fill(0);
+    pixel_data_.fill(blank_color);
+    screen_.fill(blank_color);
+    frame_count_ = 0;
     scanline_x = 0;
+    // Values left by the boot ROM
+    lcdc = 0x91;
+    stat = 0x85;
+    scy = 0;
+    scx = 0;
     lyc = 0;
     ly = 0;
+    bgp = 0xFC;
+    obp0 = 0xFF;
+    obp1 = 0xFF;
+    wy = 0;
+    wx = 0;
+
+    is_window_triggered_ = false;
+    window_line_ = 0;
+    startScanline();
+
+    is_stat_line_high_ = false;
+    has_stat_risen_ = false;
+    rescheduleInterrupts();
+
+    // The CGB boot ROM leaves white palettes
+    bcps_ = 0;
+    ocps_ = 0;
+    bg_palette_memory_.fill(0xFF);
+    obj_palette_memory_.fill(0xFF);
+    updatePalettes();
 }
 
 }  // namespace GbcEmulator
@@ -0,0 +1,144 @@
+#include "rom_image.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define GBC_HAS_MMAP 1
+#endif
+
+namespace GbcEmulator {
+
+static constexpr std::size_t header_end = 0x0150;
+
+RomImage::RomImage(std::span<const uint8_t> rom) : copy_(rom.begin(), rom.end())
+{
+    data_ = copy_;
+    parseHeader();
+}
+
+RomImage::~RomImage()
+{
+#ifdef GBC_HAS_MMAP
+    if (mapping_)
+        munmap(mapping_, mapping_size_);
+#endif
+}
+
+void RomImage::parseHeader()
+{
+    if (data_.size() < header_end)
+        throw std::invalid_argument("ROM too small to have a header");
+
+    // Check nintendo logo
+    is_logo_ok_ = std::equal(nintendo_logo.cbegin(), nintendo_logo.cend(), data_.begin() + 0x0104);
+
+    // Check if has a CGB flag (not part of title), or it could be an ASCII character in the title
+    cgb_flag_ = data_[0x0143];
+    uint16_t title_end = cgb_flag_ > 0x7F ? 0x143 : 0x144;
+    name_ = std::string{data_.begin() + 0x134, data_.begin() + title_end};
+
+    // New licensee code
+    new_licensee_code_ = { data_[0x0144], data_[0x0145] };
+
+    // SGB flag
+    sgb_flag_ = data_[0x0146];
+
+    // Destination code
+    destination_code_ = data_[0x014A];
+
+    // Old licensee code
+    old_licensee_code_ = data_[0x014B];
+
+    // ROM version number
+    rom_version_number_ = data_[0x014C];
+
+    // Check header checksum (25 bytes)
+    uint8_t header_checksum = -std::accumulate(data_.begin() + 0x0134, data_.begin() + 0x014D, static_cast<uint8_t>(25));
+    is_header_checksum_ok_ = (header_checksum == data_[0x014D]);
+
+    // Check full ROM checksum
+    auto rom_checksum = static_cast<uint16_t>(
+        std::accumulate(data_.begin(), data_.end(), 0) - data_[0x014E] - data_[0x014F]);
+    auto expected_rom_checksum = static_cast<uint16_t>(data_[0x014E] << 8 | data_[0x014F]);
+    is_full_checksum_ok_ = (rom_checksum == expected_rom_checksum);
+}
+
+bool RomImage::hasBattery() const
+{
+    switch (getCartridgeType()) {
+        case 0x03: case 0x06: case 0x09: case 0x0D: case 0x0F: case 0x10: case 0x13:
+        case 0x1B: case 0x1E: case 0x22: case 0xFF:
+            return true;
+    }
+    return false;
+}
+
+// Images still in use, by canonical path. An image is only reused while the
+// file keeps the same modification time.
+namespace {
+
+struct RegistryEntry {
+    std::weak_ptr<const RomImage> image;
+    std::filesystem::file_time_type write_time;
+};
+
+std::mutex registry_mutex;
+std::unordered_map<std::string, RegistryEntry> registry;
+
+}  // namespace
+
+std::shared_ptr<const RomImage> RomImage::open(const std::string& path)
+{
+    std::error_code error;
+    std::filesystem::path canonical_path = std::filesystem::canonical(path, error);
+    if (error) return nullptr;
+    std::filesystem::file_time_type write_time =
+        std::filesystem::last_write_time(canonical_path, error);
+    if (error) return nullptr;
+
+    std::lock_guard lock{registry_mutex};
+    std::erase_if(registry, [](const auto& entry) { return entry.second.image.expired(); });
+
+    RegistryEntry& entry = registry[canonical_path.string()];
+    if (auto image = entry.image.lock(); image && entry.write_time == write_time)
+        return image;
+
+    // The constructor is private, make_shared can't be used
+    std::shared_ptr<RomImage> image{new RomImage};
+#ifdef GBC_HAS_MMAP
+    int fd = ::open(canonical_path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    void* mapping = file_size > 0
+        ? mmap(nullptr, static_cast<std::size_t>(file_size), PROT_READ, MAP_PRIVATE, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) return nullptr;
+
+    image->mapping_ = mapping;
+    image->mapping_size_ = static_cast<std::size_t>(file_size);
+    image->data_ = {static_cast<const uint8_t*>(mapping), image->mapping_size_};
+#else
+    std::ifstream rom_file(canonical_path, std::ios::binary);
+    if (!rom_file.is_open()) return nullptr;
+    image->copy_.assign(std::istreambuf_iterator<char>(rom_file), std::istreambuf_iterator<char>());
+    if (rom_file.bad()) return nullptr;
+    image->data_ = image->copy_;
+#endif
+    image->parseHeader();
+
+    entry = {image, write_time};
+    return image;
+}
+
+}  // namespace GbcEmulator
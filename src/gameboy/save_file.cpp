@@ -0,0 +1,274 @@
+#include "save_file.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GBC_HAS_POSIX_FILES 1
+#endif
+
+namespace GbcEmulator {
+
+// Journal: a header, then the parts of the file changed by one write back as
+// (offset, size, bytes). It is only complete once the write back can be replayed, and emptied
+// once the file has it, so a complete journal is never older than the file.
+struct JournalHeader {
+    std::array<char, 4> magic;
+    uint32_t entry_count;
+    uint64_t sequence;
+    uint32_t checksum;
+    uint32_t size;
+};
+
+struct JournalEntry {
+    uint32_t offset;
+    uint32_t size;
+};
+
+static constexpr std::array<char, 4> journal_magic = {'G', 'B', 'C', 'J'};
+
+// FNV-1a
+static uint32_t checksum(std::span<const uint8_t> data) {
+    uint32_t hash = 2166136261u;
+    for (uint8_t byte : data)
+        hash = (hash ^ byte) * 16777619u;
+    return hash;
+}
+
+#ifdef GBC_HAS_POSIX_FILES
+static bool writeAll(int fd, const void* data, std::size_t size, std::size_t offset) {
+    return pwrite(fd, data, size, static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+}
+#endif
+
+std::unique_ptr<SaveFile> SaveFile::open(const std::string& path, std::span<const uint8_t> initial,
+                                         bool has_clock, std::chrono::milliseconds flush_interval)
+{
+#ifdef GBC_HAS_POSIX_FILES
+    // The constructor is private, make_unique can't be used
+    std::unique_ptr<SaveFile> save{new SaveFile};
+
+    // Another instance running the same game would overwrite its saves
+    save->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (save->fd_ < 0 || flock(save->fd_, LOCK_EX | LOCK_NB) != 0)
+        return nullptr;
+
+    // Bytes the file doesn't have yet come from initial, or are a stopped clock
+    save->ram_.assign(initial.begin(), initial.end());
+    save->has_clock_ = has_clock;
+    ssize_t ram_read = pread(save->fd_, save->ram_.data(), save->ram_.size(), 0);
+    if (ram_read < 0)
+        return nullptr;
+    auto old_size = static_cast<std::size_t>(ram_read);
+    if (has_clock && old_size == save->ram_.size()) {
+        ssize_t clock_read = pread(save->fd_, save->clock_data_.data(), clock_data_size,
+                                   static_cast<off_t>(old_size));
+        if (clock_read < 0)
+            return nullptr;
+        if (static_cast<std::size_t>(clock_read) < clock_data_size)
+            save->clock_data_.fill(0);
+        else
+            old_size += clock_data_size;
+    }
+
+    save->journal_path_ = path + ".journal";
+    save->journal_fd_ = ::open(save->journal_path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (save->journal_fd_ < 0 || !save->recoverJournal())
+        return nullptr;
+    if (old_size < save->getFileSize() && !save->writeToFile(old_size))
+        return nullptr;
+
+    std::size_t page_count = (save->ram_.size() + page_size - 1) / page_size;
+    save->dirty_pages_ = std::vector<std::atomic<uint64_t>>((page_count + 63) / 64);
+    save->flush_interval_ = flush_interval;
+    save->flusher_ = std::jthread([s = save.get()](std::stop_token stop_token) {
+        s->runFlusher(stop_token);
+    });
+    return save;
+#else
+    (void)path, (void)initial, (void)has_clock, (void)flush_interval;
+    return nullptr;
+#endif
+}
+
+SaveFile::~SaveFile()
+{
+    if (flusher_.joinable()) {
+        flusher_.request_stop();
+        flusher_.join();
+    }
+#ifdef GBC_HAS_POSIX_FILES
+    // The journal is only left behind if the last write back failed
+    bool is_saved = fd_ >= 0 && journal_fd_ >= 0 && flush();
+    if (journal_fd_ >= 0) {
+        close(journal_fd_);
+        if (is_saved)
+            unlink(journal_path_.c_str());
+    }
+    if (fd_ >= 0)
+        close(fd_);
+#endif
+}
+
+std::unique_lock<std::mutex> SaveFile::beginWrite(std::size_t offset, std::size_t size) {
+    std::unique_lock lock{mutex_};
+    if (!size || ram_.empty())
+        return lock;
+    std::size_t last_page = (std::min(offset + size, ram_.size()) - 1) / page_size;
+    for (std::size_t page = offset / page_size; page <= last_page; ++page)
+        dirty_pages_[page / 64].fetch_or(uint64_t{1} << (page % 64), std::memory_order_relaxed);
+    return lock;
+}
+
+std::unique_lock<std::mutex> SaveFile::beginClockWrite() {
+    std::unique_lock lock{mutex_};
+    is_clock_dirty_ = true;
+    return lock;
+}
+
+void SaveFile::runFlusher(std::stop_token stop_token) {
+    std::mutex wakeup_mutex;
+    std::unique_lock lock{wakeup_mutex};
+    while (!stop_token.stop_requested()) {
+        flusher_wakeup_.wait_for(lock, stop_token, flush_interval_, [] { return false; });
+        flush();
+    }
+}
+
+bool SaveFile::writeToFile(std::size_t offset) {
+#ifdef GBC_HAS_POSIX_FILES
+    if (offset < ram_.size() && !writeAll(fd_, ram_.data() + offset, ram_.size() - offset, offset))
+        return false;
+    if (has_clock_) {
+        std::size_t clock_offset = std::max(offset, ram_.size()) - ram_.size();
+        return writeAll(fd_, clock_data_.data() + clock_offset, clock_data_size - clock_offset,
+                        ram_.size() + clock_offset);
+    }
+    return true;
+#else
+    (void)offset;
+    return false;
+#endif
+}
+
+bool SaveFile::flush() {
+#ifdef GBC_HAS_POSIX_FILES
+    std::lock_guard flush_lock{flush_mutex_};
+
+    // Copy the dirty pages, a page written meanwhile is dirty again for the next write back
+    std::vector<uint8_t> journal(sizeof(JournalHeader));
+    uint32_t entry_count = 0;
+    auto append = [&](std::size_t offset, std::size_t size, auto load_byte) {
+        JournalEntry entry{static_cast<uint32_t>(offset), static_cast<uint32_t>(size)};
+        const auto* entry_bytes = reinterpret_cast<const uint8_t*>(&entry);
+        journal.insert(journal.end(), entry_bytes, entry_bytes + sizeof(entry));
+        for (std::size_t i = offset; i < offset + size; ++i)
+            journal.push_back(load_byte(i));
+        ++entry_count;
+    };
+    {
+        std::lock_guard lock{mutex_};
+        for (std::size_t word = 0; word < dirty_pages_.size(); ++word) {
+            uint64_t pages = dirty_pages_[word].exchange(0, std::memory_order_acquire);
+            for (; pages; pages &= pages - 1) {
+                std::size_t offset = (word * 64 + static_cast<std::size_t>(std::countr_zero(pages)))
+                                   * page_size;
+                append(offset, std::min(page_size, ram_.size() - offset), [this](std::size_t i) {
+                    return std::atomic_ref{ram_[i]}.load(std::memory_order_relaxed);
+                });
+            }
+        }
+        if (is_clock_dirty_) {
+            is_clock_dirty_ = false;
+            append(ram_.size(), clock_data_size, [this](std::size_t i) {
+                return clock_data_[i - ram_.size()];
+            });
+        }
+    }
+    if (!entry_count)
+        return true;
+
+    JournalHeader header{journal_magic, entry_count, sequence_ + 1, 0,
+                         static_cast<uint32_t>(journal.size())};
+    header.checksum = checksum(std::span{journal}.subspan(sizeof(JournalHeader)));
+    std::memcpy(journal.data(), &header, sizeof(header));
+
+    // The journal has to be complete on disk before the save itself is written
+    if (!writeAll(journal_fd_, journal.data(), journal.size(), 0) || fsync(journal_fd_) != 0)
+        return false;
+
+    // Then only the pages and the clock it holds
+    std::span<const uint8_t> entries = std::span{journal}.subspan(sizeof(JournalHeader));
+    for (uint32_t i = 0; i < entry_count; ++i) {
+        JournalEntry entry;
+        std::memcpy(&entry, entries.data(), sizeof(entry));
+        entries = entries.subspan(sizeof(entry));
+        if (!writeAll(fd_, entries.data(), entry.size, entry.offset))
+            return false;
+        entries = entries.subspan(entry.size);
+    }
+    sequence_ = header.sequence;
+    if (fdatasync(fd_) != 0)
+        return false;
+    return ftruncate(journal_fd_, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+// Replays the last write back if it was interrupted
+bool SaveFile::recoverJournal() {
+#ifdef GBC_HAS_POSIX_FILES
+    struct stat journal_stat;
+    if (fstat(journal_fd_, &journal_stat) != 0)
+        return false;
+    std::vector<uint8_t> journal(static_cast<std::size_t>(journal_stat.st_size));
+    if (journal.size() < sizeof(JournalHeader))
+        return true;
+    if (pread(journal_fd_, journal.data(), journal.size(), 0) !=
+        static_cast<ssize_t>(journal.size()))
+        return false;
+
+    JournalHeader header;
+    std::memcpy(&header, journal.data(), sizeof(header));
+    std::span<const uint8_t> entries = std::span{journal}.subspan(sizeof(JournalHeader));
+    // An incomplete journal means the save itself wasn't touched yet, a complete one may have
+    // been written to it in part, writing it again is harmless
+    bool is_valid = header.magic == journal_magic && header.size == journal.size() &&
+                    header.checksum == checksum(entries);
+
+    for (uint32_t i = 0; is_valid && i < header.entry_count; ++i) {
+        JournalEntry entry;
+        if (entries.size() < sizeof(entry)) break;
+        std::memcpy(&entry, entries.data(), sizeof(entry));
+        entries = entries.subspan(sizeof(entry));
+        if (entries.size() < entry.size) break;
+        // Either RAM, or the clock after it
+        bool is_ram = entry.offset + entry.size <= ram_.size();
+        bool is_clock = has_clock_ && entry.offset == ram_.size() && entry.size == clock_data_size;
+        if (is_ram)
+            std::memcpy(ram_.data() + entry.offset, entries.data(), entry.size);
+        else if (is_clock)
+            std::memcpy(clock_data_.data(), entries.data(), entry.size);
+        if ((is_ram || is_clock) && !writeAll(fd_, entries.data(), entry.size, entry.offset))
+            return false;
+        entries = entries.subspan(entry.size);
+    }
+
+    if (is_valid) {
+        sequence_ = header.sequence;
+        if (fdatasync(fd_) != 0)
+            return false;
+    }
+    return ftruncate(journal_fd_, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+}  // namespace GbcEmulator
@@ -0,0 +1,12 @@
+#include "serial_connection.hpp"
+
+#include "mmu.hpp"
+
+namespace GbcEmulator {
+
+void SerialConnection::registerIoHandlers(MemoryManagmentUnit& mmu) {
+    mmu.registerIoHandler<&SerialConnection::getSb, &SerialConnection::setSb>(0xFF01, *this);
+    mmu.registerIoHandler<&SerialConnection::getSc, &SerialConnection::setSc>(0xFF02, *this, 0x7E);
+}
+
+}  // namespace GbcEmulator
@@ -0,0 +1,26 @@
+#include "tile_cache.hpp"
+
+#include <algorithm>
+
+#include "tile_decoder.hpp"
+
+namespace GbcEmulator {
+
+void TileCache::decode(std::size_t block, std::size_t tile)
+{
+    auto planar = mmu_.getVram().subspan(block * MemoryManagmentUnit::video_block_size,
+                                         MemoryManagmentUnit::video_block_size);
+    std::array<Byte, 8 * 8> indices;
+    decodeTileRows(planar, indices);
+    for (std::size_t row = 0; row < 8; ++row)
+    {
+        auto row_indices = std::span{indices}.subspan(8 * row, 8);
+        std::copy(row_indices.begin(), row_indices.end(), tiles_[tile][row].begin());
+        std::reverse_copy(row_indices.begin(), row_indices.end(), flipped_tiles_[tile][row].begin());
+    }
+
+    generations_[tile] = mmu_.getVideoGeneration();
+    ++decode_count_;
+}
+
+}  // namespace GbcEmulator
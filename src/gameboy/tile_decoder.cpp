@@ -0,0 +1,182 @@
+#include "tile_decoder.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define GBC_HAS_X86_TILE_KERNELS 1
+#include <immintrin.h>
+#else
+#define GBC_HAS_X86_TILE_KERNELS 0
+#endif
+
+namespace GbcEmulator {
+
+namespace {
+
+using Kernel = void (*)(const Byte* planar, std::size_t row_count, Byte* indices);
+
+void decodeScalar(const Byte* planar, std::size_t row_count, Byte* indices)
+{
+    for (std::size_t row = 0; row < row_count; ++row, planar += 2, indices += 8)
+    {
+        auto row_indices = decodeTileRow(planar[0], planar[1]);
+        std::memcpy(indices, row_indices.data(), row_indices.size());
+    }
+}
+
+#if GBC_HAS_X86_TILE_KERNELS
+
+// Every x86 is little endian, the first pixel goes to the low byte
+__attribute__((target("bmi2")))
+void decodeBmi2(const Byte* planar, std::size_t row_count, Byte* indices)
+{
+    constexpr uint64_t bit_0_of_each_byte = 0x0101010101010101;
+    for (std::size_t row = 0; row < row_count; ++row, planar += 2, indices += 8)
+    {
+        // PDEP spreads bit 0 to the first byte, where the rightmost pixel goes
+        uint64_t packed = _pdep_u64(planar[0], bit_0_of_each_byte)
+                        | _pdep_u64(planar[1], bit_0_of_each_byte << 1);
+        packed = __builtin_bswap64(packed);
+        std::memcpy(indices, &packed, sizeof(packed));
+    }
+}
+
+// Both kernels broadcast the low and high byte of each row to 8 bytes, and test each of those
+// against the bit of its pixel
+__attribute__((target("sse2")))
+void decodeSse2(const Byte* planar, std::size_t row_count, Byte* indices)
+{
+    const __m128i pixel_bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                            1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i ones = _mm_set1_epi8(1);
+
+    std::size_t row = 0;
+    for (; row + 2 <= row_count; row += 2, planar += 4, indices += 16)
+    {
+        int32_t rows;
+        std::memcpy(&rows, planar, sizeof(rows));
+        // l0 l0 h0 h0 l1 l1 h1 h1, then l0 x4 h0 x4 l1 x4 h1 x4
+        __m128i bytes = _mm_cvtsi32_si128(rows);
+        bytes = _mm_unpacklo_epi8(bytes, bytes);
+        bytes = _mm_unpacklo_epi16(bytes, bytes);
+        __m128i row0 = _mm_unpacklo_epi32(bytes, bytes);
+        __m128i row1 = _mm_unpackhi_epi32(bytes, bytes);
+        __m128i lows = _mm_unpacklo_epi64(row0, row1);
+        __m128i highs = _mm_unpackhi_epi64(row0, row1);
+
+        __m128i low_bits = _mm_cmpeq_epi8(_mm_and_si128(lows, pixel_bits), pixel_bits);
+        __m128i high_bits = _mm_cmpeq_epi8(_mm_and_si128(highs, pixel_bits), pixel_bits);
+        __m128i result = _mm_or_si128(_mm_and_si128(low_bits, ones),
+                                      _mm_and_si128(high_bits, _mm_add_epi8(ones, ones)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(indices), result);
+    }
+    decodeScalar(planar, row_count - row, indices);
+}
+
+__attribute__((target("avx2")))
+void decodeAvx2(const Byte* planar, std::size_t row_count, Byte* indices)
+{
+    const __m256i pixel_bits = _mm256_set_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                               1, 2, 4, 8, 16, 32, 64, -128,
+                                               1, 2, 4, 8, 16, 32, 64, -128,
+                                               1, 2, 4, 8, 16, 32, 64, -128);
+    // Rows 0 and 1 in the low lane, 2 and 3 in the high one
+    const __m256i low_bytes = _mm256_set_epi8(6, 6, 6, 6, 6, 6, 6, 6, 4, 4, 4, 4, 4, 4, 4, 4,
+                                              2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i high_bytes = _mm256_add_epi8(low_bytes, _mm256_set1_epi8(1));
+    const __m256i ones = _mm256_set1_epi8(1);
+
+    std::size_t row = 0;
+    for (; row + 4 <= row_count; row += 4, planar += 8, indices += 32)
+    {
+        int64_t rows;
+        std::memcpy(&rows, planar, sizeof(rows));
+        __m256i bytes = _mm256_set1_epi64x(rows);
+        __m256i lows = _mm256_shuffle_epi8(bytes, low_bytes);
+        __m256i highs = _mm256_shuffle_epi8(bytes, high_bytes);
+
+        __m256i low_bits = _mm256_cmpeq_epi8(_mm256_and_si256(lows, pixel_bits), pixel_bits);
+        __m256i high_bits = _mm256_cmpeq_epi8(_mm256_and_si256(highs, pixel_bits), pixel_bits);
+        __m256i result = _mm256_or_si256(_mm256_and_si256(low_bits, ones),
+                                         _mm256_and_si256(high_bits, _mm256_add_epi8(ones, ones)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(indices), result);
+    }
+    decodeSse2(planar, row_count - row, indices);
+}
+
+#endif
+
+Kernel getKernelFunction(TileDecodeKernel kernel)
+{
+    switch (kernel)
+    {
+#if GBC_HAS_X86_TILE_KERNELS
+    case TileDecodeKernel::Bmi2: return decodeBmi2;
+    case TileDecodeKernel::Sse2: return decodeSse2;
+    case TileDecodeKernel::Avx2: return decodeAvx2;
+#endif
+    default: return decodeScalar;
+    }
+}
+
+// PDEP doesn't beat the lookup table, and is microcoded on AMD before Zen 3
+TileDecodeKernel detectFastestKernel()
+{
+    for (TileDecodeKernel kernel : {TileDecodeKernel::Avx2, TileDecodeKernel::Sse2})
+        if (isTileDecodeKernelSupported(kernel))
+            return kernel;
+    return TileDecodeKernel::Scalar;
+}
+
+// Rendering threads read it while the GUI may set it
+std::atomic<TileDecodeKernel>& selectedKernel()
+{
+    static std::atomic<TileDecodeKernel> kernel{detectFastestKernel()};
+    return kernel;
+}
+
+}  // namespace
+
+bool isTileDecodeKernelSupported(TileDecodeKernel kernel)
+{
+#if GBC_HAS_X86_TILE_KERNELS
+    __builtin_cpu_init();
+    switch (kernel)
+    {
+    case TileDecodeKernel::Scalar: return true;
+    case TileDecodeKernel::Bmi2: return __builtin_cpu_supports("bmi2");
+    case TileDecodeKernel::Sse2: return __builtin_cpu_supports("sse2");
+    case TileDecodeKernel::Avx2: return __builtin_cpu_supports("avx2");
+    }
+    return false;
+#else
+    return kernel == TileDecodeKernel::Scalar;
+#endif
+}
+
+TileDecodeKernel getTileDecodeKernel()
+{
+    return selectedKernel().load(std::memory_order_relaxed);
+}
+
+bool setTileDecodeKernel(TileDecodeKernel kernel)
+{
+    if (!isTileDecodeKernelSupported(kernel))
+        return false;
+    selectedKernel().store(kernel, std::memory_order_relaxed);
+    return true;
+}
+
+void decodeTileRows(std::span<const Byte> planar, std::span<Byte> indices)
+{
+    decodeTileRows(getTileDecodeKernel(), planar, indices);
+}
+
+void decodeTileRows(TileDecodeKernel kernel, std::span<const Byte> planar, std::span<Byte> indices)
+{
+    std::size_t row_count = std::min(planar.size() / 2, indices.size() / 8);
+    getKernelFunction(kernel)(planar.data(), row_count, indices.data());
+}
+
+}  // namespace GbcEmulator
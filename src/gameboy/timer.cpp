@@ -1,7 +1,10 @@
 #include "timer.hpp"
 
+#include <algorithm>
+
 #include "clock.hpp"
 #include "interrupt_scheduler.hpp"
+#include "mmu.hpp"
 
 namespace GbcEmulator {
 
@@ -58,11 +61,24 @@ void Timer::setTac(Byte value) {
     interrupt_scheduler_.reschedule(InterruptType::Timer, getNextInterruptTime());
 }
 
+void Timer::registerIoHandlers(MemoryManagmentUnit& mmu) {
+    mmu.registerIoHandler<&Timer::getDiv, &Timer::setDiv>(0xFF04, *this);
+    mmu.registerIoHandler<&Timer::getTima, &Timer::setTima>(0xFF05, *this);
+    mmu.registerIoHandler<&Timer::getTma, &Timer::setTma>(0xFF06, *this);
+    mmu.registerIoHandler<&Timer::getTac, &Timer::setTac>(0xFF07, *this, 0xF8);
+}
+
 void Timer::catchUp() {
-    // depends on cpu mode (Double speed mode)
-    TCycleCount delta_t_clock = (clock_.get() - last_timestamp_)
-                                << static_cast<unsigned int>(clock_.isDoubleSpeed());
-    last_timestamp_ = clock_.get();
+    // Counts at the CPU speed, the cycles before a speed switch at the other speed,
+    // and is stopped during the switch
+    TCycleCount now = clock_.get();
+    TCycleCount speed_switch_start = clock_.getLastSpeedSwitchStart();
+    TCycleCount speed_switch = clock_.getLastSpeedSwitch();
+    TCycleCount delta_t_clock = clock_.toCpuCycles(now - std::max(last_timestamp_, speed_switch));
+    if (last_timestamp_ < speed_switch_start)
+        delta_t_clock += (speed_switch_start - last_timestamp_)
+                         << static_cast<unsigned int>(!clock_.isDoubleSpeed());
+    last_timestamp_ = now;
 
     if (tac_ & 0x4) {
         Byte selected_freq = tac_ & 0x3;
@@ -92,7 +108,45 @@ TCycleCount Timer::getNextInterruptTime() {
     catchUp();
     Byte selected_freq = tac_ & 0x3;
     TCycleCount tima_period = tac_period[selected_freq];
-    return clock_.get() + tima_period * (0x100 - tima_) - (full_div_t_clock_ & (tima_period - 1));
+    return clock_.get() + toClockCycles(tima_period * (0x100 - tima_)
+                                        - (full_div_t_clock_ & (tima_period - 1)));
+}
+
+// Rounded up, the clock only counts whole T-cycles of the normal speed
+TCycleCount Timer::toClockCycles(TCycleCount t_cycles) const {
+    return clock_.fromCpuCycles(t_cycles + clock_.toCpuCycles(1) - 1);
+}
+
+TCycleCount Timer::cyclesSinceDivBoundary(TCycleCount period) const {
+    return clock_.fromCpuCycles(full_div_t_clock_ & (period - 1));
+}
+
+TCycleCount Timer::cyclesUntilDivBoundary(TCycleCount period) const {
+    return toClockCycles(period - (full_div_t_clock_ & (period - 1)));
+}
+
+TCycleCount Timer::getLastDivChange() {
+    catchUp();
+    return clock_.get() - cyclesSinceDivBoundary(0x100);
+}
+
+TCycleCount Timer::getNextDivChange() {
+    catchUp();
+    return clock_.get() + cyclesUntilDivBoundary(0x100);
+}
+
+TCycleCount Timer::getLastTimaChange() {
+    if (!(tac_ & 0x4)) return 0;
+
+    catchUp();
+    return clock_.get() - cyclesSinceDivBoundary(tac_period[tac_ & 0x3]);
+}
+
+TCycleCount Timer::getNextTimaChange() {
+    if (!(tac_ & 0x4)) return TCycle_never;
+
+    catchUp();
+    return clock_.get() + cyclesUntilDivBoundary(tac_period[tac_ & 0x3]);
 }
 
 void Timer::reset()
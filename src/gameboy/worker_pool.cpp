@@ -0,0 +1,70 @@
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace GbcEmulator {
+
+WorkerPool::WorkerPool(unsigned thread_count)
+{
+    threads_.reserve(thread_count);
+    for (unsigned i = 0; i < thread_count; ++i)
+        threads_.emplace_back([this](std::stop_token stop_token) { runWorker(stop_token); });
+}
+
+// One less than the cores, the emulation has one
+std::shared_ptr<WorkerPool> WorkerPool::getShared()
+{
+    static std::mutex mutex;
+    static std::weak_ptr<WorkerPool> shared;
+    std::lock_guard lock{mutex};
+    std::shared_ptr<WorkerPool> pool = shared.lock();
+    if (!pool)
+    {
+        pool = std::make_shared<WorkerPool>(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+        shared = pool;
+    }
+    return pool;
+}
+
+void WorkerPool::start(Job& job, std::size_t chunk_count, Task task)
+{
+    wait(job);
+    {
+        std::lock_guard lock{mutex_};
+        job.task_ = std::move(task);
+        job.chunk_count_ = chunk_count;
+        job.next_chunk_ = 0;
+        job.done_chunk_count_ = 0;
+        if (chunk_count)
+            jobs_.push_back(&job);
+    }
+    job_started_.notify_all();
+}
+
+void WorkerPool::wait(Job& job)
+{
+    std::unique_lock lock{mutex_};
+    job_done_.wait(lock, [&job] { return job.done_chunk_count_ == job.chunk_count_; });
+}
+
+void WorkerPool::runWorker(std::stop_token stop_token)
+{
+    std::unique_lock lock{mutex_};
+    while (job_started_.wait(lock, stop_token, [this] { return !jobs_.empty(); }))
+    {
+        Job& job = *jobs_.front();
+        std::size_t chunk = job.next_chunk_++;
+        if (job.next_chunk_ == job.chunk_count_)
+            jobs_.pop_front();
+
+        // The task only changes once every chunk is done
+        lock.unlock();
+        job.task_(chunk);
+        lock.lock();
+        if (++job.done_chunk_count_ == job.chunk_count_)
+            job_done_.notify_all();
+    }
+}
+
+}  // namespace GbcEmulator
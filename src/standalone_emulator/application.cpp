@@ -55,6 +55,10 @@ Application::Application()
     glfwSetWindowUserPointer(glfw_window_, this);
     glfwSetKeyCallback(glfw_window_, glfwApplicationKeyCallback);
 
+    // Games keep their saves, and their clock runs while the emulator is closed
+    gb_.setBatterySaves(true);
+    gb_.setClockCatchUp(true);
+
     emulation_window_ = std::make_unique<EmulationWindow>(glfw_window_, gb_.getPpu().getScreenData());
 
     initializeImGui();
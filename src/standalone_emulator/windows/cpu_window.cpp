@@ -1,6 +1,8 @@
 #include "cpu_window.hpp"
 
 #include <algorithm>
+#include <optional>
+#include <utility>
 
 #include <imgui/imgui.h>
 #include <gameboy.hpp>
@@ -87,6 +89,8 @@ void CpuWindow::drawDebugControl()
         ImGui::EndListBox();
     }
 
+    drawWatchpoints();
+
     const char* mode_str;
     if (is_emulator_running)
     {
@@ -105,6 +109,94 @@ void CpuWindow::drawDebugControl()
     ImGui::Text("Ran for %llu (T-cycles)", gb.getCpu().getClock().get());
 }
 
+// Draws the fields of a watchpoint, returns whether one of them was changed
+static bool editWatchpoint(MemoryManagmentUnit::Watchpoint& wp)
+{
+    using Watchpoint = MemoryManagmentUnit::Watchpoint;
+    bool is_changed = false;
+
+    ImGui::PushItemWidth(36);
+    is_changed |= ImGui::InputScalar("##first", ImGuiDataType_U16, &wp.first, nullptr, nullptr, "%04X");
+    ImGui::SameLine();
+    is_changed |= ImGui::InputScalar("##last", ImGuiDataType_U16, &wp.last, nullptr, nullptr, "%04X");
+    ImGui::PopItemWidth();
+
+    for (auto [access, label] : {std::pair{Watchpoint::Read, "r"},
+                                 std::pair{Watchpoint::Write, "w"},
+                                 std::pair{Watchpoint::Execute, "x"}})
+    {
+        ImGui::SameLine();
+        bool is_set = wp.access & access;
+        if (ImGui::Checkbox(label, &is_set))
+        {
+            wp.access = static_cast<Byte>(is_set ? wp.access | access : wp.access & ~access);
+            is_changed = true;
+        }
+    }
+
+    // Value condition
+    ImGui::SameLine();
+    bool has_value = wp.value.has_value();
+    if (ImGui::Checkbox("==", &has_value))
+    {
+        wp.value = has_value ? std::optional<Byte>{0} : std::nullopt;
+        is_changed = true;
+    }
+    if (wp.value)
+    {
+        ImGui::SameLine();
+        ImGui::PushItemWidth(22);
+        is_changed |= ImGui::InputScalar("##value", ImGuiDataType_U8, &*wp.value, nullptr, nullptr, "%02X");
+        ImGui::PopItemWidth();
+    }
+    return is_changed;
+}
+
+void CpuWindow::drawWatchpoints()
+{
+    auto& mmu = application_->getEmulator().getMmu();
+
+    // The next watchpoint is filled in first, it is only added once it watches something
+    ImGui::PushID("new watchpoint");
+    editWatchpoint(new_watchpoint_);
+    ImGui::SameLine();
+    ImGui::BeginDisabled(!new_watchpoint_.isValid());
+    if (ImGui::SmallButton(ICON_FA_PLUS))
+        mmu.addWatchpoint(new_watchpoint_);
+    ImGui::EndDisabled();
+    ImGui::PopID();
+
+    if (ImGui::BeginListBox("Watchpoint"))
+    {
+        const auto& watchpoints = mmu.getWatchpoints();
+        for (int id = static_cast<int>(watchpoints.size())-1; id >= 0; --id)
+        {
+            MemoryManagmentUnit::Watchpoint wp = watchpoints[id];
+            ImGui::PushID(id);
+            bool is_changed = editWatchpoint(wp);
+
+            ImGui::SameLine();
+            if (ImGui::SmallButton(ICON_FA_TRASH_CAN))
+                mmu.removeWatchpoint(id);
+            // An edit that would watch nothing is dropped
+            else if (is_changed && wp.isValid())
+                mmu.setWatchpoint(id, wp);
+
+            ImGui::PopID();
+        }
+
+        ImGui::EndListBox();
+    }
+
+    if (const auto& hit = mmu.getLastWatchpointHit())
+    {
+        using Watchpoint = MemoryManagmentUnit::Watchpoint;
+        const char* access_str = hit->access == Watchpoint::Read ? "Read"
+                               : hit->access == Watchpoint::Write ? "Write" : "Execute";
+        ImGui::Text("Last hit: %s %02X at %04X", access_str, hit->value, hit->address);
+    }
+}
+
 void CpuWindow::drawCpuState()
 {
     auto& gb = application_->getEmulator();
@@ -134,18 +226,18 @@ void CpuWindow::drawCpuState()
 
     ImGui::TextUnformatted("Flags");
     { 
-        bool c= cpu_state[RegFlag::C],
-            h = cpu_state[RegFlag::H],
-            n = cpu_state[RegFlag::N],
-            z = cpu_state[RegFlag::Z];
+        bool c= cpu_state.getFlag(RegFlag::C),
+            h = cpu_state.getFlag(RegFlag::H),
+            n = cpu_state.getFlag(RegFlag::N),
+            z = cpu_state.getFlag(RegFlag::Z);
         ImGui::Checkbox("c", &c); ImGui::SameLine();
         ImGui::Checkbox("h", &h); ImGui::SameLine();
         ImGui::Checkbox("n", &n); ImGui::SameLine();
         ImGui::Checkbox("z", &z);
-        cpu_state[RegFlag::C] = c;
-        cpu_state[RegFlag::H] = h;
-        cpu_state[RegFlag::N] = n;
-        cpu_state[RegFlag::Z] = z;
+        cpu_state.setFlag(RegFlag::C, c);
+        cpu_state.setFlag(RegFlag::H, h);
+        cpu_state.setFlag(RegFlag::N, n);
+        cpu_state.setFlag(RegFlag::Z, z);
     }
 }
 
@@ -158,6 +250,7 @@ void CpuWindow::drawInterrupts()
     auto& all_interrupts = interrupts.getAllInts();
 
     ImGui::Text("IF: %02X", interrupts.getIf());
+    ImGui::Text("IE: %02X", interrupts.getIe());
     ImGui::Text("Vblank: %llu", all_interrupts[static_cast<std::underlying_type<InterruptType>::type>(InterruptType::VBlank)]);
     ImGui::Text("LCD:    %llu", all_interrupts[static_cast<std::underlying_type<InterruptType>::type>(InterruptType::LCD)]);
     ImGui::Text("Timer:  %llu", all_interrupts[static_cast<std::underlying_type<InterruptType>::type>(InterruptType::Timer)]);
@@ -2,6 +2,7 @@
 
 #include <vector>
 
+#include <mmu.hpp>
 #include <types.hpp>
 
 #include "imgui_window.hpp"
@@ -18,6 +19,7 @@ public:
 
 private:
     void drawDebugControl();
+    void drawWatchpoints();
     void drawCpuState();
     void drawInterrupts();
     void drawTimer();
@@ -25,4 +27,6 @@ private:
 
     Application* application_;
     std::vector<GbcEmulator::Word> breakpoints_;
+    // Watches nothing until filled in
+    GbcEmulator::MemoryManagmentUnit::Watchpoint new_watchpoint_{0, 0, 0, std::nullopt};
 };
@@ -1,5 +1,6 @@
 #include "log_window.hpp"
 
+#include <iomanip>
 #include <sstream>
 
 #include <imgui/imgui.h>
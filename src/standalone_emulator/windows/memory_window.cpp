@@ -1,5 +1,13 @@
 #include "memory_window.hpp"
 
+#if GBC_HAS_MEMORY_PROFILER
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#endif
+
 #include <imgui/imgui.h>
 #include <imgui/imgui_memory_editor.h>
 
@@ -7,6 +15,7 @@
 
 #include "application.hpp"
 #include "font/fa_icons.h"
+#include "logging.hpp"
 
 using namespace GbcEmulator;
 
@@ -35,15 +44,152 @@ static constexpr size_t instruction_length[256] = {
 static ImU8 readGameBoyMemory([[maybe_unused]] const ImU8* mem, size_t offset, void* user_data)
 {
     auto& mmu = static_cast<GameBoy*>(user_data)->getMmu();
-    return mmu.load(static_cast<Word>(offset));
+    return mmu.loadDirect(static_cast<Word>(offset));
 }
 
+#if GBC_HAS_MEMORY_PROFILER
+// What the heatmap shows, updated once per frame
+static struct
+{
+    bool is_shown = false;
+    bool is_cycle_weighted = false;
+    double max_heat = 0.0;
+} heatmap;
+
+static double getHeat(const MemoryProfiler::Counts& counts)
+{
+    return heatmap.is_cycle_weighted ? static_cast<double>(counts.read_cycles + counts.write_cycles)
+                                     : static_cast<double>(counts.reads + counts.writes);
+}
+
+// Transparent to opaque red-orange, in log scale as a few registers take most accesses
+static ImU32 getHeatColor(double heat)
+{
+    if (heat <= 0.0 || heatmap.max_heat <= 0.0)
+        return 0;
+    float t = static_cast<float>(std::log1p(heat) / std::log1p(heatmap.max_heat));
+    return IM_COL32(255, static_cast<int>(160 * (1.0f - t)), 0, static_cast<int>(40 + 160 * t));
+}
+#endif
+
 static ImU32 colorGameBoyMemory([[maybe_unused]] const ImU8* mem, size_t offset, void* user_data)
 {
-    const auto& cpu = static_cast<GameBoy*>(user_data)->getCpu();
-    return cpu.hasBreakpoint(static_cast<Word>(offset)) ? IM_COL32(255, 0, 0, 255) : 0;
+    auto& gb = *static_cast<GameBoy*>(user_data);
+    if (gb.getCpu().hasBreakpoint(static_cast<Word>(offset)))
+        return IM_COL32(255, 0, 0, 255);
+#if GBC_HAS_MEMORY_PROFILER
+    if (heatmap.is_shown)
+    {
+        const auto& profiler = gb.getMmu().getProfiler();
+        bool is_io = (offset & 0xFF80) == 0xFF00;
+        return getHeatColor(getHeat(is_io ? profiler.getIoRegisters()[offset & 0x7F]
+                                          : profiler.getPages()[offset >> 8]));
+    }
+#endif
+    return 0;
 }
 
+#if GBC_HAS_MEMORY_PROFILER
+void MemoryWindow::drawProfiler()
+{
+    auto& mmu = application_->getEmulator().getMmu();
+    const auto& profiler = mmu.getProfiler();
+
+    bool is_profiling = mmu.isProfiling();
+    if (ImGui::Checkbox("Profile accesses", &is_profiling))
+        mmu.setProfiling(is_profiling);
+    ImGui::SameLine();
+    ImGui::Checkbox("Heatmap", &heatmap.is_shown);
+    ImGui::SameLine();
+    ImGui::Checkbox("Cycle-weighted", &heatmap.is_cycle_weighted);
+    ImGui::SameLine();
+    if (ImGui::Button(ICON_FA_ARROWS_ROTATE "##profiler"))
+        mmu.resetProfiler();
+
+    for (auto [path, write] : {std::pair{"memory_profile.csv", &MemoryProfiler::writeCsv},
+                               std::pair{"memory_profile.json", &MemoryProfiler::writeJson}})
+    {
+        ImGui::SameLine();
+        if (ImGui::Button(path))
+        {
+            std::ofstream file{path};
+            (profiler.*write)(file);
+            if (file)
+            {
+                LOG_INFO << "Saved the memory profile to '" << path << '\'';
+            }
+            else
+            {
+                LOG_ERROR << "Couldn't save the memory profile to '" << path << '\'';
+            }
+        }
+    }
+
+    const auto& pages = profiler.getPages();
+    const auto& io_registers = profiler.getIoRegisters();
+    // The hex view colors the I/O registers on the same scale as the pages
+    heatmap.max_heat = 0.0;
+    for (const auto& counts : pages)
+        heatmap.max_heat = std::max(heatmap.max_heat, getHeat(counts));
+    for (const auto& counts : io_registers)
+        heatmap.max_heat = std::max(heatmap.max_heat, getHeat(counts));
+
+    // One cell per page, the high byte of the address
+    constexpr float cell_size = 12.0f;
+    ImVec2 origin = ImGui::GetCursorScreenPos();
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+    for (int page = 0; page < 0x100; ++page)
+    {
+        ImVec2 min{origin.x + static_cast<float>(page & 0xF) * cell_size,
+                   origin.y + static_cast<float>(page >> 4) * cell_size};
+        ImVec2 max{min.x + cell_size - 1.0f, min.y + cell_size - 1.0f};
+        draw_list->AddRectFilled(min, max, ImGui::GetColorU32(ImGuiCol_FrameBg));
+        draw_list->AddRectFilled(min, max, getHeatColor(getHeat(pages[page])));
+    }
+    ImGui::InvisibleButton("##heatmap", ImVec2{16 * cell_size, 16 * cell_size});
+    if (ImGui::IsItemHovered())
+    {
+        ImVec2 mouse = ImGui::GetMousePos();
+        int page = std::clamp(static_cast<int>((mouse.y - origin.y) / cell_size), 0, 15) * 16
+                 + std::clamp(static_cast<int>((mouse.x - origin.x) / cell_size), 0, 15);
+        const auto& counts = pages[page];
+        ImGui::SetTooltip("%02X00-%02XFF\nReads: %" PRIu64 " (%llu cycles)\nWrites: %" PRIu64 " (%llu cycles)",
+                          page, page, counts.reads, counts.read_cycles,
+                          counts.writes, counts.write_cycles);
+    }
+
+    // I/O registers, most accessed first
+    ImGui::SameLine();
+    std::array<int, 0x80> order;
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return getHeat(io_registers[a]) > getHeat(io_registers[b]);
+    });
+    constexpr ImGuiTableFlags table_flags = ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY
+                                          | ImGuiTableFlags_BordersInnerV;
+    if (ImGui::BeginTable("IoRegisters", 5, table_flags, ImVec2{0.0f, 16 * cell_size}))
+    {
+        ImGui::TableSetupScrollFreeze(0, 1);
+        for (const char* header : {"Register", "Reads", "Writes", "Read cycles", "Write cycles"})
+            ImGui::TableSetupColumn(header);
+        ImGui::TableHeadersRow();
+        for (int reg : order)
+        {
+            const auto& counts = io_registers[reg];
+            if (!counts.reads && !counts.writes)
+                break;
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn(); ImGui::Text("FF%02X", reg);
+            ImGui::TableNextColumn(); ImGui::Text("%" PRIu64, counts.reads);
+            ImGui::TableNextColumn(); ImGui::Text("%" PRIu64, counts.writes);
+            ImGui::TableNextColumn(); ImGui::Text("%llu", counts.read_cycles);
+            ImGui::TableNextColumn(); ImGui::Text("%llu", counts.write_cycles);
+        }
+        ImGui::EndTable();
+    }
+}
+#endif
+
 void MemoryWindow::draw()
 {
     if (!ImGui::Begin(getName(), &is_opened_, ImGuiWindowFlags_NoScrollbar))
@@ -61,6 +207,11 @@ void MemoryWindow::draw()
         return;
     }
 
+#if GBC_HAS_MEMORY_PROFILER
+    if (ImGui::CollapsingHeader("Access profile"))
+        drawProfiler();
+#endif
+
     static MemoryEditor mem_edit;
     mem_edit.UserData = &gb;
     mem_edit.ReadFn = readGameBoyMemory;
@@ -69,7 +220,7 @@ void MemoryWindow::draw()
 
     uint16_t pc = const_cast<GbcEmulator::CpuState&>(gb.getCpu().getState())[Reg16::PC];
     mem_edit.HighlightMin = pc;
-    uint8_t current_inst = gb.getMmu().load(pc);
+    uint8_t current_inst = gb.getMmu().loadDirect(pc);
     mem_edit.HighlightMax = mem_edit.HighlightMin + instruction_length[current_inst];
     
     mem_edit.DrawContents(nullptr, gb.getMmu().hasCartridge() ? 0x10000 : 0);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <mmu.hpp>
+
 #include "imgui_window.hpp"
 
 class Application;
@@ -13,5 +15,9 @@ public:
     void draw() override;
 
 private:
+#if GBC_HAS_MEMORY_PROFILER
+    void drawProfiler();
+#endif
+
     Application* application_;
 };
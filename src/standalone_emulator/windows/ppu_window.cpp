@@ -25,28 +25,31 @@ void PpuWindow::drawTileset()
     static constexpr size_t tile_per_row = 16;
     static constexpr uint16_t palette[4] = { 0x0001, 0x5295, 0xAD6B, 0xFFFF };
 
-    std::array<uint16_t, 64*128*3> texture_data;
-    texture_data.fill(0xF0FF);
+    // The tiles of the bank mapped for the CPU, all redrawn when it changes
+    std::size_t bank_offset = mmu.getBank(0x8000) * 0x2000u;
+    bool is_bank_changed = bank_offset != tileset_bank_offset_;
+    tileset_bank_offset_ = bank_offset;
+
+    auto& tile_cache = gb.getPpu().getTileCache();
+    auto& texture_data = tileset_texture_;
     for (unsigned int tile_index = 0; tile_index < 128*3; ++tile_index)
     {
+        // Each tile is one block of VRAM
+        std::size_t tile_offset = bank_offset + 16*tile_index;
+        if (!is_bank_changed && !mmu.isVramBlockChangedSince(tile_offset / 16, tileset_generation_))
+            continue;
+
         unsigned int tile_x = tile_index % tile_per_row;
         unsigned int tile_y = tile_index / tile_per_row;
         for (unsigned int tile_line = 0; tile_line < 8; ++tile_line)
         {
             size_t offset = (tile_x + (8*tile_y + tile_line) * tile_per_row) * 8;
-            Byte first_byte = mmu.load(0x8000 + 16*tile_index + 2*tile_line);
-            Byte second_byte = mmu.load(0x8001 + 16*tile_index + 2*tile_line);
-
-            texture_data[offset]     = palette[((first_byte >> 7) & 1) | ((second_byte >> 7) & 1) << 1];
-            texture_data[offset + 1] = palette[((first_byte >> 6) & 1) | ((second_byte >> 6) & 1) << 1];
-            texture_data[offset + 2] = palette[((first_byte >> 5) & 1) | ((second_byte >> 5) & 1) << 1];
-            texture_data[offset + 3] = palette[((first_byte >> 4) & 1) | ((second_byte >> 4) & 1) << 1];
-            texture_data[offset + 4] = palette[((first_byte >> 3) & 1) | ((second_byte >> 3) & 1) << 1];
-            texture_data[offset + 5] = palette[((first_byte >> 2) & 1) | ((second_byte >> 2) & 1) << 1];
-            texture_data[offset + 6] = palette[((first_byte >> 1) & 1) | ((second_byte >> 1) & 1) << 1];
-            texture_data[offset + 7] = palette[((first_byte >> 0) & 1) | ((second_byte >> 0) & 1) << 1];
+            const auto& indices = tile_cache.getRow(tile_offset, tile_line, false);
+            for (size_t pixel = 0; pixel < 8; ++pixel)
+                texture_data[offset + pixel] = palette[indices[pixel]];
         }
     }
+    tileset_generation_ = mmu.getVideoGeneration();
 
     glBindTexture(GL_TEXTURE_2D, video_memory_texture_);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 8*tile_per_row, 8*128*3/tile_per_row, 0, GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1, texture_data.data());
@@ -59,39 +62,62 @@ void PpuWindow::drawTileset()
     ImGui::Image(reinterpret_cast<ImTextureID>(video_memory_texture_), ImVec2(8*tile_per_row*2, 8*128*3/tile_per_row*2), uv_min, uv_max, tint_col, border_col);
 }
 
-void PpuWindow::drawBackground()
+void PpuWindow::decodeBackground(bool use_alt_tileset, bool is_redecoding_all)
 {
     auto& gb = application_->getEmulator();
     auto& mmu = gb.getMmu();
-    auto& ppu = gb.getPpu();
+    auto& tile_cache = gb.getPpu().getTileCache();
+    std::size_t bank_offset = mmu.getBank(0x8000) * 0x2000u;
 
     static constexpr uint16_t palette[4] = { 0x0001, 0x5295, 0xAD6B, 0xFFFF };
 
-    bool use_alt_tileset = !(ppu.getLcdc() & 0x10);
-
-    std::array<uint16_t, 256*256> texture_data;
-    texture_data.fill(0xF0FF);
+    auto& texture_data = background_texture_;
     for (unsigned int i = 0; i < 32*32; ++i)
     {
         unsigned int tile_x = i % 32;
         unsigned int tile_y = i / 32;
         
-        Byte tile_index = mmu.load(0x9800 + i);
+        Byte tile_index = mmu.loadDirect(0x9800 + i);
+        int tile_offset = use_alt_tileset ? 0x1000 + 16*static_cast<int8_t>(tile_index)
+                                          : 16*tile_index;
+        // Only the entries of the map, or the tiles they show, written since the last decode
+        std::size_t map_block = (bank_offset + 0x1800 + i) / 16;
+        std::size_t tile_block = (bank_offset + static_cast<size_t>(tile_offset)) / 16;
+        if (!is_redecoding_all && !mmu.isVramBlockChangedSince(map_block, background_generation_)
+            && !mmu.isVramBlockChangedSince(tile_block, background_generation_))
+            continue;
+
         size_t offset = tile_x * 8 + tile_y * 8 * 32 * 8;
-        for (Word tile_line = 0; tile_line < 8; ++tile_line, offset += 32 * 8)
+        for (unsigned int tile_line = 0; tile_line < 8; ++tile_line, offset += 32 * 8)
         {
-            Byte first_byte = mmu.load(use_alt_tileset ?
-                0x9000 + 16*static_cast<int8_t>(tile_index) + 2*tile_line :
-                0x8000 + 16*tile_index + 2*tile_line);
-            Byte second_byte = mmu.load(use_alt_tileset ?
-                0x9001 + 16*static_cast<int8_t>(tile_index) + 2*tile_line :
-                0x8001 + 16*tile_index + 2*tile_line);
-
+            const auto& indices =
+                tile_cache.getRow(bank_offset + static_cast<size_t>(tile_offset), tile_line, false);
             for (size_t pixel = 0; pixel < 8; ++pixel)
-                texture_data[offset + pixel] =
-                    palette[((first_byte >> (7-pixel)) & 1) | ((second_byte >> (7-pixel)) & 1) << 1];
+                texture_data[offset + pixel] = palette[indices[pixel]];
         }
     }
+}
+
+void PpuWindow::drawBackground()
+{
+    auto& gb = application_->getEmulator();
+    auto& mmu = gb.getMmu();
+    auto& ppu = gb.getPpu();
+
+    bool use_alt_tileset = !(ppu.getLcdc() & 0x10);
+
+    // OAM writes don't change the map, only VRAM block generations are compared
+    std::size_t bank_offset = mmu.getBank(0x8000) * 0x2000u;
+    bool is_redecoding_all = use_alt_tileset != background_alt_tileset_
+                          || bank_offset != background_bank_offset_;
+    if (is_redecoding_all || mmu.getVideoGeneration() != background_generation_)
+    {
+        decodeBackground(use_alt_tileset, is_redecoding_all);
+        background_generation_ = mmu.getVideoGeneration();
+        background_alt_tileset_ = use_alt_tileset;
+        background_bank_offset_ = bank_offset;
+    }
+    std::array<uint16_t, 256*256> texture_data = background_texture_;
 
     const uint16_t window_color = 0xF801;
 
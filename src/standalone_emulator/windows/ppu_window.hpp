@@ -1,5 +1,10 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+
+#include <mmu.hpp>
+
 #include "imgui_window.hpp"
 #include "opengl_types.hpp"
 
@@ -16,7 +21,19 @@ public:
 private:
     void drawTileset();
     void drawBackground();
+    // Redecodes the map entries that changed, or all of them
+    void decodeBackground(bool use_alt_tileset, bool is_redecoding_all);
 
     Application* application_;
     GLuint video_memory_texture_;
+
+    // Textures are only redecoded where VRAM changed since their generation
+    using VideoGeneration = GbcEmulator::MemoryManagmentUnit::VideoGeneration;
+    std::array<uint16_t, 64*128*3> tileset_texture_;
+    VideoGeneration tileset_generation_ = 0;
+    std::size_t tileset_bank_offset_ = 0;
+    std::array<uint16_t, 256*256> background_texture_;
+    VideoGeneration background_generation_ = 0;
+    bool background_alt_tileset_ = false;
+    std::size_t background_bank_offset_ = 0;
 };
@@ -0,0 +1,302 @@
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators_all.hpp>
+
+#include <array>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <gameboy.hpp>
+#include <tile_decoder.hpp>
+
+using namespace GbcEmulator;
+
+static constexpr TCycleCount timeout_limit = 100000000;
+static constexpr TCycleCount run_slice = 100000;
+
+static constexpr std::array<std::pair<const char*, Cpu::DispatchMode>, 5> dispatch_modes = {{
+    {"Switch", Cpu::DispatchMode::Switch},
+    {"Table", Cpu::DispatchMode::Table},
+    {"Threaded", Cpu::DispatchMode::Threaded},
+    {"Cached", Cpu::DispatchMode::Cached},
+    {"Jit", Cpu::DispatchMode::Jit},
+}};
+
+static bool has_test_ended(GameBoy& gb)
+{
+    const auto& serial_buffer = gb.getSerial().getSerialBuffer();
+    std::string_view output{reinterpret_cast<const char*>(serial_buffer.data()), serial_buffer.size()};
+    return output.ends_with("Passed\n") || output.find("Failed") != std::string_view::npos;
+}
+
+// Speeds are reported as work per host microsecond, scaled: emulated MHz are T-cycles per
+// microsecond, fps are frames per second
+struct Unit {
+    const char* name;
+    double scale;
+};
+static constexpr Unit mhz{"MHz", 1.0};
+static constexpr Unit fps{"fps", 1000000.0};
+static constexpr Unit rows_per_us{"rows/us", 1.0};
+
+// What a timed run did, counted in its unit, and details to print after its speed
+struct Work {
+    double amount;
+    std::string note = "";
+};
+
+// Times run, which returns its Work, and prints its speed as a row of the report
+template <typename Run>
+static void measure(std::string_view name, std::string_view variant, Unit unit, Run run)
+{
+    auto start = std::chrono::steady_clock::now();
+    Work work = run();
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << std::left << std::setw(48) << name << std::setw(10) << variant
+              << std::right << std::fixed << std::setprecision(1) << std::setw(8)
+              << work.amount * unit.scale / elapsed.count() << ' ' << unit.name << work.note << '\n';
+}
+
+// T-cycles run by the Cpu of gb, the work of the MHz benchmarks
+static Work emulated_cycles(GameBoy& gb, std::string note = "")
+{
+    return {static_cast<double>(gb.getCpu().getClock().get()), std::move(note)};
+}
+
+TEST_CASE( "Cpu dispatch backends speed (blargg)", "[cpu][benchmark]" )
+{
+    const char* path = GENERATE(
+        "tests/roms/cpu/instr/01-special.gb",
+        "tests/roms/cpu/instr/02-interrupts.gb",
+        "tests/roms/cpu/instr/03-op sp,hl.gb",
+        "tests/roms/cpu/instr/04-op r,imm.gb",
+        "tests/roms/cpu/instr/05-op rp.gb",
+        "tests/roms/cpu/instr/06-ld r,r.gb",
+        "tests/roms/cpu/instr/07-jr,jp,call,ret,rst.gb",
+        "tests/roms/cpu/instr/08-misc instrs.gb",
+        "tests/roms/cpu/instr/09-op r,r.gb",
+        "tests/roms/cpu/instr/10-bit ops.gb",
+        "tests/roms/cpu/instr/11-op a,(hl).gb",
+        "tests/roms/cpu/timing/instr_timing.gb"
+    );
+
+    for (const auto& [name, mode] : dispatch_modes)
+    {
+        GameBoy gb;
+        REQUIRE(gb.loadRomFile(path));
+        gb.getCpu().setDispatchMode(mode);
+        gb.setPause(false);
+
+        // Until the test ROM reports its result, so idle loops don't skew it
+        measure(path, name, mhz, [&gb]() {
+            while (!has_test_ended(gb) && gb.getCpu().getClock().get() < timeout_limit)
+                gb.runFor(run_slice);
+            return emulated_cycles(gb);
+        });
+    }
+}
+
+// Tight loop of 8 and 16-bit register operations, run from WRAM
+static constexpr std::array<Byte, 15> register_loop = {
+    0x01, 0x34, 0x12,  // ld bc, $1234
+    0x03,              // inc bc
+    0x09,              // add hl, bc
+    0x13,              // inc de
+    0x7B,              // ld a, e
+    0x80,              // add a, b
+    0xC5,              // push bc
+    0xD1,              // pop de
+    0x2B,              // dec hl
+    0xCB, 0x7C,        // bit 7, h
+    0x18, 0xF1,        // jr $C000
+};
+
+TEST_CASE( "Cpu fetch/execute loop speed", "[cpu][benchmark]" )
+{
+    static constexpr TCycleCount loop_cycles = 100000000;
+
+    for (const auto& [name, mode] : dispatch_modes)
+    {
+        GameBoy gb;
+        REQUIRE(gb.loadRomFile("tests/roms/cpu/instr/06-ld r,r.gb"));
+        gb.getCpu().setDispatchMode(mode);
+        for (std::size_t i = 0; i < register_loop.size(); ++i)
+            gb.getMmu().store(static_cast<Word>(0xC000 + i), register_loop[i]);
+
+        CpuState state = gb.getCpu().createStateSnapshot();
+        state[Reg16::PC] = 0xC000;
+        state[Reg16::SP] = 0xDFF0;
+        gb.getCpu().restoreStateSnapshot(state);
+        gb.setPause(false);
+
+        measure("register loop", name, mhz, [&gb]() {
+            while (gb.getCpu().getClock().get() < loop_cycles)
+                gb.runFor(run_slice);
+            return emulated_cycles(gb);
+        });
+    }
+}
+
+// Waits for the timer interrupt with HALT, like games waiting for VBlank
+static constexpr std::array<Byte, 16> halt_loop = {
+    0x3E, 0x04,        // ld a, $04
+    0xE0, 0xFF,        // ldh [rIE], a
+    0x3E, 0x04,        // ld a, $04
+    0xE0, 0x07,        // ldh [rTAC], a
+    0x76,              // halt
+    0xAF,              // xor a
+    0xE0, 0x0F,        // ldh [rIF], a
+    0x04,              // inc b
+    0x18, 0xF9,        // jr $C008
+    0x00,
+};
+
+TEST_CASE( "Halted Cpu speed", "[cpu][benchmark]" )
+{
+    static constexpr TCycleCount halt_cycles = 1000000000;
+
+    GameBoy gb;
+    REQUIRE(gb.loadRomFile("tests/roms/cpu/instr/06-ld r,r.gb"));
+    for (std::size_t i = 0; i < halt_loop.size(); ++i)
+        gb.getMmu().store(static_cast<Word>(0xC000 + i), halt_loop[i]);
+
+    CpuState state = gb.getCpu().createStateSnapshot();
+    state[Reg16::PC] = 0xC000;
+    gb.getCpu().restoreStateSnapshot(state);
+    gb.setPause(false);
+
+    measure("halt loop", "Table", mhz, [&gb]() {
+        while (gb.getCpu().getClock().get() < halt_cycles)
+            gb.runFor(run_slice);
+        int wake_up_count = gb.getCpu().getState()[Reg8::B];
+        return emulated_cycles(gb, " (" + std::to_string(wake_up_count) + " wake-ups)");
+    });
+}
+
+// Waits for LY to reach 144 and to leave it again, like games polling for VBlank
+static constexpr std::array<Byte, 15> ly_polling_loop = {
+    0xF0, 0x44,        // ldh a, [rLY]
+    0xFE, 0x90,        // cp $90
+    0x20, 0xFA,        // jr nz, $C000
+    0x04,              // inc b
+    0xF0, 0x44,        // ldh a, [rLY]
+    0xFE, 0x90,        // cp $90
+    0x28, 0xFA,        // jr z, $C007
+    0x18, 0xF1,        // jr $C000
+};
+
+TEST_CASE( "Idle loop speed", "[cpu][benchmark]" )
+{
+    static constexpr TCycleCount idle_cycles = 1000000000;
+
+    for (bool idle_loop_skipping : {false, true})
+    {
+        GameBoy gb;
+        REQUIRE(gb.loadRomFile("tests/roms/cpu/instr/06-ld r,r.gb"));
+        gb.getCpu().setIdleLoopSkipping(idle_loop_skipping);
+        for (std::size_t i = 0; i < ly_polling_loop.size(); ++i)
+            gb.getMmu().store(static_cast<Word>(0xC000 + i), ly_polling_loop[i]);
+
+        CpuState state = gb.getCpu().createStateSnapshot();
+        state[Reg16::PC] = 0xC000;
+        gb.getCpu().restoreStateSnapshot(state);
+        gb.setPause(false);
+
+        measure("LY polling loop", idle_loop_skipping ? "Skipping" : "Polling", mhz, [&gb]() {
+            while (gb.getCpu().getClock().get() < idle_cycles)
+                gb.runFor(run_slice);
+            int frames = gb.getCpu().getState()[Reg8::B];
+            return emulated_cycles(gb, " (" + std::to_string(frames) + " frames, "
+                                       + std::to_string(gb.getCpu().getSkippedIdleCycles())
+                                       + " T-cycles skipped)");
+        });
+    }
+}
+
+static constexpr std::array<std::pair<const char*, Ppu::RenderMode>, 3> render_modes = {{
+    {"Scanline", Ppu::RenderMode::Scanline},
+    {"PixelFifo", Ppu::RenderMode::PixelFifo},
+    {"Deferred", Ppu::RenderMode::Deferred},
+}};
+
+// Draws frames of noise with the window and every sprite shown, without running the Cpu
+TEST_CASE( "Ppu render modes speed", "[ppu][benchmark]" )
+{
+    static constexpr int frame_count = 2000;
+    static constexpr TCycleCount frame_cycles = 456 * 154;
+
+    for (const auto& [name, mode] : render_modes)
+    {
+        GameBoy gb;
+        gb.getPpu().setRenderMode(mode);
+        uint32_t seed = 1;
+        auto fill = [&gb, &seed](Word begin, Word end) {
+            for (Word address = begin; address < end; ++address)
+            {
+                seed = seed * 1103515245 + 12345;
+                gb.getMmu().store(address, static_cast<Byte>(seed >> 16));
+            }
+        };
+        fill(0x8000, 0xA000);
+        fill(0xFE00, 0xFEA0);
+        gb.getMmu().store(0xFF40, 0xF3);
+        gb.getMmu().store(0xFF4A, 40);
+        gb.getMmu().store(0xFF4B, 50);
+
+        measure("noise frames", name, fps, [&gb]() {
+            for (int frame = 0; frame < frame_count; ++frame)
+            {
+                gb.getCpu().getClock().add(frame_cycles);
+                gb.getPpu().catchUp();
+            }
+            return Work{frame_count};
+        });
+
+        // Deferred mode is a frame behind
+        uint64_t shown_frame_count = mode == Ppu::RenderMode::Deferred ? frame_count - 1 : frame_count;
+        REQUIRE(gb.getPpu().getFrameCount() == shown_frame_count);
+    }
+}
+
+static constexpr std::array<std::pair<const char*, TileDecodeKernel>, 4> tile_decode_kernels = {{
+    {"Scalar", TileDecodeKernel::Scalar},
+    {"Bmi2", TileDecodeKernel::Bmi2},
+    {"Sse2", TileDecodeKernel::Sse2},
+    {"Avx2", TileDecodeKernel::Avx2},
+}};
+
+// Decodes the 384 tiles of a VRAM bank over and over, like the tileset view
+TEST_CASE( "Tile decode kernels speed", "[ppu][benchmark]" )
+{
+    static constexpr int repeat_count = 20000;
+
+    std::array<Byte, 0x1800> planar;
+    uint32_t seed = 1;
+    for (Byte& byte : planar)
+    {
+        seed = seed * 1103515245 + 12345;
+        byte = static_cast<Byte>(seed >> 16);
+    }
+    std::array<Byte, 4 * planar.size()> indices;
+
+    for (const auto& [name, kernel] : tile_decode_kernels)
+    {
+        if (!isTileDecodeKernelSupported(kernel))
+            continue;
+
+        measure("tile rows", name, rows_per_us, [&, kernel = kernel]() {
+            unsigned checksum = 0;
+            for (int i = 0; i < repeat_count; ++i)
+            {
+                decodeTileRows(kernel, planar, indices);
+                checksum += indices[static_cast<std::size_t>(i) % indices.size()];
+            }
+            return Work{repeat_count * (planar.size() / 2.0),
+                        " (checksum " + std::to_string(checksum) + ")"};
+        });
+    }
+}